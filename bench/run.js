@@ -0,0 +1,288 @@
+/* Throughput and latency benchmarks against the mock hidapi backend,
+	so that no device needs to be attached.  Build the mock binding
+	first, then run all benchmarks or those whose name contains
+	`filter`:
+
+		node-gyp rebuild --mock=true
+		node bench/run.js [filter]
+
+	The mock is configured through the HID_MOCK_* environment
+	variables described in `src/mock/hid.cc`; by default reports are
+	produced as fast as they are read.  BENCH_DURATION sets the time
+	spent on each benchmark in milliseconds. */
+process.env.NODE_HID_MOCK = "1";
+if(process.env.HID_MOCK_REPORT_RATE === undefined)
+	process.env.HID_MOCK_REPORT_RATE = "0";
+
+var HID = require("..");
+
+var duration = parseInt(process.env.BENCH_DURATION, 10) || 2000;
+var reportSize = parseInt(process.env.HID_MOCK_REPORT_SIZE, 10) || 64;
+var report = new Buffer(reportSize);
+report.fill(0);
+
+//Counts operations and estimates the allocation rate from heap growth
+function Meter() {
+	this.ops = 0;
+	this.allocated = 0;
+	this.latencies = [];
+	this._heapUsed = process.memoryUsage().heapUsed;
+	this._start = process.hrtime();
+}
+Meter.prototype.elapsed = function elapsed() {
+	var t = process.hrtime(this._start);
+	return t[0] * 1e3 + t[1] / 1e6;
+};
+Meter.prototype.done = function done() {
+	return this.elapsed() >= duration;
+};
+Meter.prototype.op = function op(count) {
+	this.ops += count || 1;
+	if(this.ops % 64 < (count || 1) )
+		this.sample();
+};
+//Records the latency of a single operation started at `process.hrtime()` `t`
+Meter.prototype.time = function time(t) {
+	var d = process.hrtime(t);
+	this.latencies.push(d[0] * 1e6 + d[1] / 1e3);
+};
+Meter.prototype.sample = function sample() {
+	//Heap usage only drops when the GC runs, which we don't count
+	var heapUsed = process.memoryUsage().heapUsed;
+	if(heapUsed > this._heapUsed)
+		this.allocated += heapUsed - this._heapUsed;
+	this._heapUsed = heapUsed;
+};
+
+function percentile(sorted, fraction) {
+	return sorted[Math.min(sorted.length - 1, Math.floor(fraction * sorted.length) )];
+}
+
+function pad(s, width) {
+	s = String(s);
+	while(s.length < width)
+		s = " " + s;
+	return s;
+}
+
+/* Each benchmark runs until `meter.done()` and then calls `done()`,
+	optionally with a latency histogram from `device.stats()` that
+	replaces the latencies recorded through `meter.time()` */
+var benchmarks = [
+	{
+		name: "read",
+		run: function(device, meter, done) {
+			device.on("data", function() {
+				meter.op();
+				if(meter.done() )
+				{
+					device.pause();
+					done(device.stats().deliveryLatency);
+				}
+			});
+		}
+	},
+	{
+		name: "read streaming",
+		run: function(device, meter, done) {
+			device.setStreaming(true);
+			device.on("data", function() {
+				meter.op();
+				if(meter.done() )
+				{
+					device.pause();
+					done(device.stats().deliveryLatency);
+				}
+			});
+		}
+	},
+	{
+		name: "reports streaming",
+		run: function(device, meter, done) {
+			device.setStreaming(true);
+			device.on("reports", function(data, offsets) {
+				meter.op(offsets.length - 1);
+				if(meter.done() )
+				{
+					device.pause();
+					done(device.stats().deliveryLatency);
+				}
+			});
+		}
+	},
+	{
+		name: "readBatch",
+		run: function(device, meter, done) {
+			device.on("reports", function(data, offsets) {
+				meter.op(offsets.length - 1);
+				if(meter.done() )
+				{
+					device.pause();
+					done(device.stats().deliveryLatency);
+				}
+			});
+		}
+	},
+	{
+		name: "write",
+		run: function(device, meter, done) {
+			while(!meter.done() )
+			{
+				var t = process.hrtime();
+				device.write(report);
+				meter.time(t);
+				meter.op();
+			}
+			done();
+		}
+	},
+	{
+		name: "writeAsync",
+		run: function(device, meter, done) {
+			var finished = false;
+			function fill() {
+				while(!finished && device.write(report, written) )
+					;
+			}
+			function written(err) {
+				if(err)
+					throw err;
+				meter.op();
+				if(!finished && meter.done() )
+				{
+					finished = true;
+					done(device.stats().writeLatency);
+				}
+			}
+			device.on("drain", fill);
+			fill();
+		}
+	},
+	{
+		name: "getFeatureReport",
+		run: function(device, meter, done) {
+			while(!meter.done() )
+			{
+				var t = process.hrtime();
+				device.getFeatureReport(1, reportSize);
+				meter.time(t);
+				meter.op();
+			}
+			done();
+		}
+	},
+	{
+		name: "getFeatureReportAsync",
+		run: function(device, meter, done) {
+			function next() {
+				var t = process.hrtime();
+				device.getFeatureReportAsync(1, reportSize, function(err) {
+					if(err)
+						throw err;
+					meter.time(t);
+					meter.op();
+					if(meter.done() )
+						done();
+					else
+						next();
+				});
+			}
+			next();
+		}
+	},
+	{
+		name: "sendFeatureReport",
+		run: function(device, meter, done) {
+			while(!meter.done() )
+			{
+				var t = process.hrtime();
+				device.sendFeatureReport(report);
+				meter.time(t);
+				meter.op();
+			}
+			done();
+		}
+	},
+	{
+		name: "devices",
+		run: function(device, meter, done) {
+			while(!meter.done() )
+			{
+				var t = process.hrtime();
+				HID.devices();
+				meter.time(t);
+				meter.op();
+			}
+			done();
+		}
+	},
+	{
+		name: "devicesAsync",
+		run: function(device, meter, done) {
+			function next() {
+				var t = process.hrtime();
+				HID.devicesAsync(function(err) {
+					if(err)
+						throw err;
+					meter.time(t);
+					meter.op();
+					if(meter.done() )
+						done();
+					else
+						next();
+				});
+			}
+			next();
+		}
+	}
+];
+
+var filter = process.argv[2];
+var selected = benchmarks.filter(function(benchmark) {
+	return !filter || benchmark.name.indexOf(filter) >= 0;
+});
+
+console.log(pad("benchmark", 22) + pad("ops/s", 12) + pad("alloc B/op", 12) +
+	pad("p50 us", 10) + pad("p99 us", 10) + pad("max us", 10) );
+
+function runNext() {
+	var benchmark = selected.shift();
+	if(!benchmark)
+		return;
+	var device = new HID.HID("mock:0");
+	var meter = new Meter();
+	var finished = false;
+	benchmark.run(device, meter, function done(histogram) {
+		//Reports already on their way may still come in after pause()
+		if(finished)
+			return;
+		finished = true;
+		meter.sample();
+		var elapsed = meter.elapsed();
+		var p50, p99, max;
+		if(histogram)
+		{
+			p50 = histogram.p50;
+			p99 = histogram.p99;
+			max = histogram.max;
+		}
+		else
+		{
+			var sorted = meter.latencies.sort(function(a, b) { return a - b; });
+			p50 = percentile(sorted, 0.5);
+			p99 = percentile(sorted, 0.99);
+			max = sorted[sorted.length - 1];
+		}
+		console.log(pad(benchmark.name, 22) +
+			pad(Math.round(meter.ops * 1e3 / elapsed), 12) +
+			pad(Math.round(meter.allocated / meter.ops), 12) +
+			pad(p50.toFixed(1), 10) + pad(p99.toFixed(1), 10) +
+			pad(max.toFixed(1), 10) );
+		//Let reads still in flight complete before closing
+		setTimeout(function() {
+			device.close();
+			runNext();
+		}, 100);
+	});
+}
+runNext();
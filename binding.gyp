@@ -1,6 +1,8 @@
 {
    'variables': {
-      'driver%': 'libusb'
+      'driver%': 'libusb',
+      # builds HID-mock.node against src/mock/hid.cc for benchmarks
+      'mock%': 'false'
   },
   'targets': [
     {
@@ -57,7 +59,7 @@
     },
     {
       'target_name': 'HID',
-      'sources': [ 'src/HID.cc' ],
+      'sources': [ 'src/HID.cc', 'src/BufferPool.cc', 'src/DeviceCache.cc', 'src/Hotplug.cc', 'src/ReportDescriptor.cc', 'src/ReportFilter.cc', 'src/ReplyMatcher.cc', 'src/CaptureLog.cc', 'src/ThreadPolicy.cc' ],
       'dependencies': ['hidapi'],
       'defines': [
         '_LARGEFILE_SOURCE',
@@ -71,6 +73,9 @@
           ],
           'xcode_settings': {
             'GCC_ENABLE_CPP_EXCEPTIONS': 'YES',
+            'CLANG_CXX_LANGUAGE_STANDARD': 'c++11',
+            'CLANG_CXX_LIBRARY': 'libc++',
+            'MACOSX_DEPLOYMENT_TARGET': '10.7',
             'OTHER_LDFLAGS': [
               '-framework IOKit',
               '-framework CoreFoundation'
@@ -80,11 +85,17 @@
         [ 'OS=="linux"', {
           'conditions': [
             [ 'driver=="libusb"', {
+              'defines': [ 'HID_DRIVER_LIBUSB' ],
+              'include_dirs+': [
+                '/usr/include/libusb-1.0/'
+              ],
               'libraries': [
                 '-lusb-1.0'
               ]
             }],
             [ 'driver=="hidraw"', {
+              'defines': [ 'HID_DRIVER_HIDRAW' ],
+              'sources': [ 'src/HidrawPoller.cc' ],
               'libraries': [
                 '-ludev',
                 '-lusb-1.0'
@@ -105,7 +116,60 @@
       'cflags!': ['-ansi', '-fno-exceptions' ],
       'cflags_cc!': [ '-fno-exceptions' ],
       'cflags': ['-g', '-exceptions'],
-      'cflags_cc': ['-g', '-exceptions']
+      'cflags_cc': ['-g', '-exceptions', '-std=c++11']
     }
+  ],
+  'conditions': [
+    [ 'mock=="true"', {
+      'targets': [
+        {
+          'target_name': 'hidapi-mock',
+          'type': 'static_library',
+          'sources': [ 'src/mock/hid.cc' ],
+          'direct_dependent_settings': {
+            'include_dirs': [
+              'hidapi/hidapi',
+              "<!(node -e \"require('nan')\")"
+            ]
+          },
+          'include_dirs': [
+            'hidapi/hidapi'
+          ],
+          'xcode_settings': {
+            'CLANG_CXX_LANGUAGE_STANDARD': 'c++11',
+            'CLANG_CXX_LIBRARY': 'libc++',
+            'MACOSX_DEPLOYMENT_TARGET': '10.7'
+          },
+          'cflags_cc': ['-g', '-std=c++11']
+        },
+        {
+          'target_name': 'HID-mock',
+          'sources': [ 'src/HID.cc', 'src/BufferPool.cc', 'src/DeviceCache.cc', 'src/Hotplug.cc', 'src/ReportDescriptor.cc', 'src/ReportFilter.cc', 'src/ReplyMatcher.cc', 'src/CaptureLog.cc', 'src/ThreadPolicy.cc' ],
+          'dependencies': ['hidapi-mock'],
+          'defines': [
+            '_LARGEFILE_SOURCE',
+            '_FILE_OFFSET_BITS=64',
+          ],
+          'conditions': [
+            [ 'OS=="mac"', {
+              'xcode_settings': {
+                'GCC_ENABLE_CPP_EXCEPTIONS': 'YES',
+                'CLANG_CXX_LANGUAGE_STANDARD': 'c++11',
+                'CLANG_CXX_LIBRARY': 'libc++',
+                'MACOSX_DEPLOYMENT_TARGET': '10.7',
+                'OTHER_LDFLAGS': [
+                  '-framework IOKit',
+                  '-framework CoreFoundation'
+                ]
+              }
+            }]
+          ],
+          'cflags!': ['-ansi', '-fno-exceptions' ],
+          'cflags_cc!': [ '-fno-exceptions' ],
+          'cflags': ['-g', '-exceptions'],
+          'cflags_cc': ['-g', '-exceptions', '-std=c++11']
+        }
+      ]
+    }]
   ]
-}
\ No newline at end of file
+}
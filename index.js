@@ -1,8 +1,10 @@
 var EventEmitter = require("events").EventEmitter,
+	stream = require("stream"),
 	util = require("util");
 
-//Load C++ binding
-var binding = require("./build/Release/HID.node");
+//Load C++ binding, or the one built against the mock hidapi for benchmarks
+var binding = require(process.env.NODE_HID_MOCK ?
+	"./build/Release/HID-mock.node" : "./build/Release/HID.node");
 
 //This class is a wrapper for `binding.HID` class
 function HID() {
@@ -21,72 +23,805 @@ function HID() {
 	thisPlusArgs[0] = null;
 	for(var i = 0; i < arguments.length; i++)
 		thisPlusArgs[i + 1] = arguments[i];
-	this._raw = new (Function.prototype.bind.apply(binding.HID,
-		thisPlusArgs) )();
-	
-	/* Now we have `this._raw` Object from which we need to
-		inherit.  So, one solution is to simply copy all
-		prototype methods over to `this` and binding them to
-		`this._raw`
-	*/
-	for(var i in binding.HID.prototype)
-		if(i != "close")
-			this[i] = binding.HID.prototype[i].bind(this._raw);
+	this._setRaw(new (Function.prototype.bind.apply(binding.HID,
+		thisPlusArgs) )() );
 
 	/* We are now done inheriting from `binding.HID` and EventEmitter.
 
-		Now upon adding a new listener for "data" events, we start
-		polling the HID device using `read(...)`
+		Now upon adding a new listener for "data", "reports" or "values" events,
+		we start polling the HID device using `read(...)` or
+		`readBatch(...)`
 		See `resume()` for more details. */
 	this._paused = true;
+	this._streaming = false;
+	this._needDrain = false;
+	this._periodicOutputs = [];
 	var self = this;
 	self.on("newListener", function(eventName, listener) {
-		if(eventName == "data")
-			process.nextTick(self.resume.bind(self) );
+		if(eventName == "data" || eventName == "reports" || eventName == "values")
+			process.nextTick(function() {
+				//A running native reader needs to be restarted to batch
+				if(eventName == "reports" && self._streaming &&
+					!self._paused && !self._batched)
+					self.pause();
+				self.resume();
+			});
 	});
 }
 //Inherit prototype methods
 util.inherits(HID, EventEmitter);
-//Don't inherit from `binding.HID`; that's done above already!
+//Don't inherit from `binding.HID`; that's done in `_setRaw(...)` instead!
+
+HID.prototype._setRaw = function _setRaw(raw) {
+	this._raw = raw;
+	/* Now we have `this._raw` Object from which we need to
+		inherit.  So, one solution is to simply copy all
+		prototype methods over to `this` and binding them to
+		`this._raw`, except for those that we wrap below
+	*/
+	for(var i in binding.HID.prototype)
+		if(!HID.prototype.hasOwnProperty(i) )
+			this[i] = binding.HID.prototype[i].bind(this._raw);
+};
+
+//Maximum number of reports delivered by one "reports" event
+HID.maxBatchReports = 64;
+//Milliseconds `transact(...)` waits for a reply unless told otherwise
+HID.transactionTimeout = 1000;
+//Number of queued asynchronous writes at which `write(...)` returns false
+HID.prototype.writeHighWaterMark = 16;
+/* Number of reports the native reader buffers in streaming mode, and
+	what it does once JavaScript falls that far behind: "drop-newest",
+	"drop-oldest" or "pause" reading until there is room again.  Both
+	take effect the next time the reader is started. */
+HID.prototype.readQueueCapacity = 256;
+HID.prototype.readOverflow = "drop-newest";
 
 HID.prototype.close = function close() {
 	this._closing = true;
+	this._stopReconnecting();
+	if(this._readStream)
+		this._readStream.close();
 	this._raw.close();
 };
-//Pauses the reader, which stops "data" events from being emitted
+/* Opens a device without blocking the event loop and calls
+	`callback(err, device)` with the HID object, or returns a promise
+	of it if no callback is given.  `target` is a path or an object
+	with `vendorId`, `productId` and optionally `serialNumber`.  With
+	`options.reconnect` set, the device is reopened whenever it goes
+	away, see `README.md`. */
+HID.open = function open(target, options, callback) {
+	if(typeof options === "function")
+	{
+		callback = options;
+		options = {};
+	}
+	options = options || {};
+	return callbackOrPromise(callback, function(done) {
+		openAsync(target, function(err, token) {
+			if(err)
+				return done(err);
+			var device = new HID(token);
+			if(options.threadPolicy || options.inputQueue)
+			{
+				try
+				{
+					if(options.threadPolicy)
+						device.setThreadPolicy(options.threadPolicy);
+					if(options.inputQueue)
+						device.setInputQueue(options.inputQueue);
+				}
+				catch(e)
+				{
+					device.close();
+					return done(e);
+				}
+			}
+			if(options.reconnect)
+				device._startReconnecting(target, options.reconnect);
+			done(null, device);
+		});
+	});
+};
+/* Runs `start(done)` and passes what it calls `done(err, result)`
+	with to `callback`.  Without a callback, returns a promise of the
+	result instead, which needs node 0.12 or later. */
+function callbackOrPromise(callback, start) {
+	if(callback)
+		return start(callback);
+	if(typeof Promise !== "function")
+		throw new Error("need a callback, this version of node has no Promise");
+	return new Promise(function(resolve, reject) {
+		start(function(err, result) {
+			if(err)
+				reject(err);
+			else
+				resolve(result);
+		});
+	});
+}
+function openAsync(target, callback) {
+	if(typeof target === "string")
+		binding.openAsync(target, callback);
+	else if(target.serialNumber !== undefined)
+		binding.openAsync(target.vendorId, target.productId,
+			target.serialNumber, callback);
+	else
+		binding.openAsync(target.vendorId, target.productId, callback);
+}
+//Delays between attempts to reopen a device, see `HID.open(...)`
+HID.reconnectDefaults = {
+	initialDelay: 100,
+	maxDelay: 10000,
+	factor: 2
+};
+HID.prototype._startReconnecting = function _startReconnecting(target, options) {
+	var self = this;
+	self._reconnect = {
+		target: target,
+		initialDelay: valueOr(options.initialDelay, HID.reconnectDefaults.initialDelay),
+		maxDelay: valueOr(options.maxDelay, HID.reconnectDefaults.maxDelay),
+		factor: valueOr(options.factor, HID.reconnectDefaults.factor),
+		timer: null,
+		//Commands to send once the device is back
+		pending: [],
+		onDetach: null
+	};
+	/* Devices opened by path notice being unplugged even when idle.
+		Without hotplug notifications, as in the mock build, read and
+		write errors are all there is to go by. */
+	if(typeof target === "string")
+	{
+		var onDetach = function onDetach(device) {
+			if(device.path === target)
+				self._disconnect(new Error("device detached"));
+		};
+		try
+		{
+			hotplug.on("detach", onDetach);
+			self._reconnect.onDetach = onDetach;
+		}
+		catch(e) {}
+	}
+};
+function valueOr(value, defaultValue) {
+	return value === undefined ? defaultValue : value;
+}
+HID.prototype._stopReconnecting = function _stopReconnecting() {
+	var reconnect = this._reconnect;
+	if(!reconnect)
+		return;
+	this._reconnect = null;
+	clearTimeout(reconnect.timer);
+	if(reconnect.onDetach)
+		hotplug.removeListener("detach", reconnect.onDetach);
+	reconnect.pending.forEach(function(command) {
+		var err = new Error("device closed before the report was written");
+		err.cancelled = true;
+		if(command.callback)
+			command.callback(err);
+	});
+};
+/* Reports an error of the reader, or starts reconnecting if that is
+	what it means */
+HID.prototype._failed = function _failed(err) {
+	if(this._closing)
+		return;
+	if(this._reconnect)
+		this._disconnect(err, true);
+	else
+		this.emit("error", err);
+};
+HID.prototype._disconnect = function _disconnect(err, readerFailed) {
+	var self = this;
+	if(!self._reconnect || self._disconnected)
+		return;
+	self._disconnected = true;
+	self._reconnect.resume = readerFailed || !self._paused;
+	self.pause();
+	//Commands still queued natively come back cancelled and are resent
+	self._raw.close();
+	self.emit("disconnect", err);
+	self._reopen(self._reconnect.initialDelay);
+};
+HID.prototype._reopen = function _reopen(delay) {
+	var self = this;
+	var reconnect = self._reconnect;
+	reconnect.timer = setTimeout(function reopen() {
+		openAsync(reconnect.target, function(err, token) {
+			if(self._reconnect !== reconnect)
+			{
+				//Closed meanwhile
+				if(!err)
+					new binding.HID(token).close();
+				return;
+			}
+			if(err)
+				return self._reopen(Math.min(delay * reconnect.factor,
+					reconnect.maxDelay) );
+			self._setRaw(new binding.HID(token) );
+			try
+			{
+				if(self._threadPolicy)
+					self._raw.setThreadPolicy(self._threadPolicy);
+				if(self._inputQueue)
+					self._raw.setInputQueue(self._inputQueue);
+			}
+			catch(e)
+			{
+				//Keeps the commands pending for the next attempt
+				self._raw.close();
+				self.emit("error", e);
+				return self._reopen(Math.min(delay * reconnect.factor,
+					reconnect.maxDelay) );
+			}
+			self._disconnected = false;
+			//In the order they were first queued
+			var pending = reconnect.pending.sort(function(a, b) {
+				return a.id - b.id;
+			});
+			reconnect.pending = [];
+			pending.forEach(function(command) {
+				//Transactions need the reader, which may not be back yet
+				try
+				{
+					command.send();
+				}
+				catch(e)
+				{
+					if(command.callback)
+						command.callback(e);
+				}
+			});
+			self._periodicOutputs.forEach(function(output) {
+				output._start();
+			});
+			self.emit("reconnect");
+			//Pick up reading where it was left off
+			if(reconnect.resume)
+				self.resume();
+		});
+	}, delay);
+};
+/* Lets a native thread read ahead into a queue of `capacity` reports
+	whenever the device is not streaming, so that reports arriving
+	while JavaScript is busy are not lost in the driver's own, much
+	smaller queue.  Can be set once per device, and is set again on
+	reconnecting. */
+HID.prototype.setInputQueue = function setInputQueue(capacity) {
+	this._raw.setInputQueue(capacity);
+	this._inputQueue = capacity;
+};
+/* Sets the scheduling of the native threads reading and writing the
+	device: `{ realtime, priority, cpus }`, see `README.md`.  Throws if
+	the OS refuses, typically for lack of privileges.  Is set again on
+	reconnecting. */
+HID.prototype.setThreadPolicy = function setThreadPolicy(policy) {
+	this._raw.setThreadPolicy(policy);
+	this._threadPolicy = policy;
+};
+/* Writes a report.  Without a callback or options, the report is
+	written synchronously.  Otherwise, it is queued for the native
+	writer thread, see `writeAsync(...)`. */
+HID.prototype.write = function write(data, options, callback) {
+	if(arguments.length < 2)
+		return this._raw.write(data);
+	return this.writeAsync(data, options, callback);
+};
+/* Queues a report for the native writer thread and calls
+	`callback(err, bytesWritten)` once it has been written.
+	`options.priority` is "control", "normal" (the default) or "bulk";
+	`options.deadlineMs` fails the write with `err.expired` set if it
+	could not be sent in time.  With `options.feature` set, the report
+	is sent as a feature report.  Returns false once
+	`writeHighWaterMark` commands are queued, in which case a "drain"
+	event is emitted when the queue has been emptied. */
+HID.prototype.writeAsync = function writeAsync(data, options, callback) {
+	var self = this;
+	if(typeof options === "function")
+	{
+		callback = options;
+		options = {};
+	}
+	options = options || {};
+	return self._command(callback, function send(done) {
+		return self._raw.writeAsync(data, done, options.priority,
+			options.deadlineMs, options.feature === true);
+	});
+};
+/* Queues a command by calling `send(done)`, which returns the native
+	queue depth.  While reconnecting, commands wait to be sent once
+	the device is back. */
+HID.prototype._command = function _command(callback, send) {
+	var self = this;
+	var command = {
+		id: self._commandCount = (self._commandCount || 0) + 1,
+		callback: callback,
+		send: function() {
+			return send(self._commandDone(command) );
+		}
+	};
+	if(self._disconnected)
+	{
+		self._reconnect.pending.push(command);
+		return false;
+	}
+	return self._queued(command.send() );
+};
+//Wraps the callback of a queued command to emit "drain" when due
+HID.prototype._commandDone = function _commandDone(command) {
+	var self = this;
+	var callback = command.callback;
+	return function commandDone(err, result, timestamp) {
+		if(err && self._reconnect && !self._closing)
+		{
+			if(err.cancelled)
+			{
+				//Cancelled by `_disconnect()`, keep it for the reopened device
+				self._reconnect.pending.push(command);
+				return;
+			}
+			//Failing writes are a sign of the device having gone away
+			if(!err.expired && !err.timeout)
+				self._disconnect(err);
+		}
+		if(callback)
+			callback(err, result, timestamp);
+		if(self._needDrain && self._raw.writeQueueDepth() == 0)
+		{
+			self._needDrain = false;
+			self.emit("drain");
+		}
+	};
+};
+//Whether more commands should be queued, given the native queue depth
+HID.prototype._queued = function _queued(depth) {
+	if(depth >= this.writeHighWaterMark)
+	{
+		this._needDrain = true;
+		return false;
+	}
+	return true;
+};
+/* Queues `request` for the native writer thread like `writeAsync`
+	does and calls `callback(err, reply, timestamp)` with the first
+	input report starting with `options.matchReportId` and
+	`options.matchPrefix`, both optional.  Matching happens in native
+	code; reports that don't match stay in the normal input stream.
+	Fails with `err.timeout` set after `options.timeoutMs`. */
+HID.prototype.transact = function transact(request, options, callback) {
+	if(typeof options === "function")
+	{
+		callback = options;
+		options = {};
+	}
+	options = options || {};
+	var self = this;
+	return self._command(callback, function send(done) {
+		return self._raw.transact(request,
+			valueOr(options.matchReportId, -1),
+			options.matchPrefix,
+			valueOr(options.timeoutMs, HID.transactionTimeout),
+			done, options.priority, options.deadlineMs);
+	});
+};
+/* Has the native writer thread send `data` every `interval`
+	milliseconds until `stop()` is called on the returned object.
+	`update(data)` changes what is sent from the next time on.  With
+	`options.changesOnly` set, nothing is sent until the data has
+	changed. */
+HID.prototype.periodicOutput = function periodicOutput(data, interval, options) {
+	var output = new PeriodicOutput(this, data, interval, options || {});
+	this._periodicOutputs.push(output);
+	return output;
+};
+function PeriodicOutput(device, data, interval, options) {
+	this._device = device;
+	this._data = data;
+	this._interval = interval;
+	this._changesOnly = !!options.changesOnly;
+	this._start();
+}
+PeriodicOutput.prototype._start = function _start() {
+	this._id = this._device._raw.periodicStart(this._data, this._interval,
+		this._changesOnly);
+};
+PeriodicOutput.prototype.update = function update(data) {
+	//Kept for the reopened device while reconnecting
+	this._data = data;
+	if(!this._device._disconnected)
+		this._device._raw.periodicUpdate(this._id, data);
+};
+PeriodicOutput.prototype.stop = function stop() {
+	var outputs = this._device._periodicOutputs;
+	var index = outputs.indexOf(this);
+	if(index < 0)
+		return;
+	outputs.splice(index, 1);
+	if(!this._device._disconnected)
+		this._device._raw.periodicStop(this._id);
+};
+//Pauses the reader, which stops "data" and "reports" events from being emitted
 HID.prototype.pause = function pause() {
+	//The conflating reader keeps running for `readLatest(...)`
+	if(this._conflating)
+		;
+	else if(this._streaming && !this._paused)
+		this.readStop();
+	//Don't leave a threadpool thread waiting for the next report
+	else if(!this._paused)
+		this.cancelReads();
 	this._paused = true;
+	this._readLoop = null;
 };
 HID.prototype.resume = function pause() {
 	var self = this;
-	if(self._paused && self.listeners("data").length > 0)
+	/* A stream returned by `createReadStream(...)` owns the native
+		reader; while reconnecting, reading resumes once the device is
+		back */
+	if(self._paused && self._hasReadListeners() && !self._readStream &&
+		!self._disconnected)
 	{
 		//Start polling & reading loop
 		self._paused = false;
-		self.read(function readFunc(err, data) {
+		if(self._conflating)
+			return;
+		if(self._streaming)
+		{
+			//The native reader thread keeps reading until `readStop()`
+			self._batched = self.listeners("reports").length > 0;
+			self.readStart(function streamFunc(err, data, offsets, timestamps) {
+				if(err)
+				{
+					//The reader has already stopped itself
+					self._paused = true;
+					self._failed(err);
+				}
+				else
+				{
+					if(!self._hasReadListeners())
+						self.pause();
+					self._emitReports(data, offsets, timestamps);
+				}
+			}, self._batched ? HID.maxBatchReports : 0,
+				self.readQueueCapacity, self.readOverflow);
+			return;
+		}
+		/* A read may still be in flight from before the last `pause()`;
+			only the loop started last keeps reading */
+		var loop = self._readLoop = {};
+		function readNext() {
+			//Read a batch of reports whenever somebody listens for them
+			if(self.listeners("reports").length > 0)
+				self.readBatch(HID.maxBatchReports, readFunc);
+			else
+				self.read(readFunc);
+		}
+		function readFunc(err, data, offsets, timestamps) {
+			var current = self._readLoop === loop;
 			if(err)
 			{
 				//Emit error and pause reading
-				self._paused = true;
-				if(!self._closing)
-					self.emit("error", err);
-				//else ignore any errors if I'm closing the device
+				if(current)
+					self._paused = true;
+				if(!err.cancelled)
+					self._failed(err);
+				//else ignore any errors if I'm closing the device or pausing
 			}
 			else
 			{
-				//If there are no "data" listeners, we pause
-				if(self.listeners("data").length <= 0)
+				//If there are no "data" or "reports" listeners, we pause
+				if(current && !self._hasReadListeners())
 					self._paused = true;
 				//Keep reading if we aren't paused
-				if(!self._paused)
-					self.read(readFunc);
+				if(current && !self._paused)
+					readNext();
 				//Now emit the event
-				self.emit("data", data);
+				self._emitReports(data, offsets, timestamps);
 			}
-		});
+		}
+		readNext();
+	}
+};
+HID.prototype._hasReadListeners = function _hasReadListeners() {
+	return this.listeners("data").length > 0 ||
+		this.listeners("reports").length > 0 ||
+		this.listeners("values").length > 0;
+};
+/* Emits a single report or a batch of reports.  A batch is one Buffer
+	holding the reports back to back; report `i` starts at `offsets[i]`
+	and ends at `offsets[i + 1]` and arrived at `timestamps[i]`.  For
+	single reports, the native callback passes the timestamp in place
+	of the offsets.  "data" listeners still get one event per report. */
+HID.prototype._emitReports = function _emitReports(data, offsets, timestamps) {
+	var batch = Array.isArray(offsets);
+	//Decode all reports in one native call
+	if(this._decoder && this.listeners("values").length > 0)
+	{
+		if(batch)
+			this.emit("values", this._decoder.decode(data, offsets), timestamps);
+		else
+			this.emit("values", this._decoder.decode(data), offsets);
+	}
+	if(!batch)
+	{
+		this.emit("data", data, offsets);
+		return;
+	}
+	this.emit("reports", data, offsets, timestamps);
+	if(this.listeners("data").length > 0)
+		for(var i = 0; i + 1 < offsets.length; i++)
+			this.emit("data", data.slice(offsets[i], offsets[i + 1]), timestamps[i]);
+};
+/* Decodes the given report fields, usually taken from
+	`HID.parseReportDescriptor(...)`, from every report read and emits
+	their values with a "values" event.  Pass null to stop decoding. */
+HID.prototype.setDecoder = function setDecoder(fields) {
+	this._decoder = fields ? new binding.ReportDecoder(fields) : null;
+};
+/* Switches to conflating mode, in which a native reader keeps only
+	the most recent report of each report ID.  "data" events are
+	emitted for the reports that changed, at most once every
+	`options.interval` milliseconds, and `readLatest([reportId])`
+	returns the latest report at any time.  Set
+	`options.numberedReports` if the device uses report IDs.  Pass
+	null to go back to reading every report. */
+HID.prototype.setConflation = function setConflation(options) {
+	var self = this;
+	var paused = self._paused;
+	self.pause();
+	if(self._conflating)
+	{
+		self.readStop();
+		self._conflating = false;
+	}
+	if(options)
+	{
+		self.readLatestStart(function latestFunc(err, data, timestamp) {
+			if(err)
+			{
+				//The reader has already stopped itself
+				self._conflating = false;
+				if(!self._closing)
+					self.emit("error", err);
+			}
+			else if(!self._paused)
+				self._emitReports(data, timestamp);
+		}, options.interval || 0, !!options.numberedReports);
+		self._conflating = true;
 	}
+	if(!paused)
+		self.resume();
+};
+/* Switches between issuing one `read(...)` per report (the default)
+	and streaming mode, in which a dedicated native thread reads the
+	device and hands reports to `readStart(...)` without tying up
+	the libuv threadpool. */
+HID.prototype.setStreaming = function setStreaming(streaming) {
+	var paused = this._paused;
+	this.pause();
+	this._streaming = !!streaming;
+	if(!paused)
+		this.resume();
 };
+/* Returns a Readable stream of the reports read from this device, see
+	`ReadStream`.  The device must not be read by other means until
+	the stream has ended. */
+HID.prototype.createReadStream = function createReadStream(options) {
+	if(!this._paused || this._conflating || this._readStream)
+		throw new Error("device is already being read");
+	return this._readStream = new ReadStream(this, options);
+};
+
+/* Readable stream fed by the native reader of a device.  In object
+	mode (the default), every report is a Buffer of its own; otherwise
+	the stream is binary and the reports read since the last callback
+	are pushed as one chunk, up to `options.maxBatch` at a time.  Once
+	`options.highWaterMark` reports (or bytes) are buffered, the native
+	reader holds back further reports, and when its ring of
+	`options.capacity` reports is full too, the reader thread stops
+	reading until the stream is read from again.  No reports are ever
+	dropped for lack of room. */
+function ReadStream(device, options) {
+	if(!ReadStream.super_)
+		inheritReadable();
+	options = options || {};
+	var objectMode = options.objectMode !== false;
+	stream.Readable.call(this, {
+		objectMode: objectMode,
+		highWaterMark: options.highWaterMark
+	});
+	this._device = device;
+	this._maxBatch = objectMode ? 0 : options.maxBatch || HID.maxBatchReports;
+	this._capacity = options.capacity || device.readQueueCapacity;
+	this._reading = false;
+	this._ended = false;
+}
+/* stream.Readable came with node 0.10, so ReadStream only inherits
+	from it once the first stream is created.  Doing it by prototype
+	keeps the methods defined below. */
+function inheritReadable() {
+	if(!stream.Readable)
+		throw new Error("read streams need node 0.10 or later");
+	ReadStream.super_ = stream.Readable;
+	ReadStream.prototype.__proto__ = stream.Readable.prototype;
+	//Before node 8, destroy() is not there to call _destroy()
+	if(!stream.Readable.prototype.destroy)
+		ReadStream.prototype.destroy = function destroy(err) {
+			this.close();
+			if(err)
+				this.emit("error", err);
+		};
+}
+
+ReadStream.prototype._read = function _read() {
+	var self = this;
+	var device = self._device;
+	if(self._ended)
+		return;
+	if(self._reading)
+	{
+		//Have the native reader deliver what it has been holding back
+		device.readResume();
+		return;
+	}
+	self._reading = true;
+	device.readStart(function streamFunc(err, data) {
+		if(err)
+		{
+			//The reader has already stopped itself
+			self._reading = false;
+			self._end();
+			self.emit("error", err);
+		}
+		else if(!self.push(data))
+			device.readPause();
+	}, self._maxBatch, self._capacity, "pause");
+};
+//Stops the native reader and ends the stream
+ReadStream.prototype.close = function close() {
+	if(this._reading)
+		this._device.readStop();
+	this._reading = false;
+	this._end();
+};
+ReadStream.prototype._destroy = function _destroy(err, callback) {
+	this.close();
+	callback(err);
+};
+ReadStream.prototype._end = function _end() {
+	if(this._ended)
+		return;
+	this._ended = true;
+	if(this._device._readStream === this)
+		this._device._readStream = null;
+	this.push(null);
+};
+
+/* A group of devices opened by path and read by a single native
+	reader.  "reports" events carry the reports of all devices read at
+	once as `(data, offsets, timestamps, devices)`, where `devices[i]`
+	is the index into `paths` of the device report `i` came from.
+	"data" events are emitted as `(device, data, timestamp)` for each
+	report, but only if somebody listens for them. */
+function Group(paths) {
+	EventEmitter.call(this);
+	this._raw = new binding.DeviceGroup(paths);
+	this.paths = paths.slice();
+	this._paused = true;
+	var self = this;
+	self.on("newListener", function(eventName, listener) {
+		if(eventName == "data" || eventName == "reports")
+			process.nextTick(function() {
+				self.resume();
+			});
+	});
+}
+util.inherits(Group, EventEmitter);
+
+//Opens the devices with the given paths as a `Group`
+HID.group = function group(paths) {
+	return new Group(paths);
+};
+
+Group.prototype.close = function close() {
+	this._closing = true;
+	this._paused = true;
+	this._raw.close();
+};
+Group.prototype.pause = function pause() {
+	if(!this._paused)
+		this._raw.readStop();
+	this._paused = true;
+};
+Group.prototype.resume = function resume() {
+	var self = this;
+	if(!self._paused || self._closing || !self._hasReadListeners())
+		return;
+	self._paused = false;
+	self._raw.readStart(function groupFunc(err, data, offsets, timestamps, devices) {
+		if(err)
+		{
+			//Only the device `err.device` has stopped being read
+			if(!self._closing)
+				self.emit("error", err);
+			return;
+		}
+		if(!self._hasReadListeners())
+			self.pause();
+		self.emit("reports", data, offsets, timestamps, devices);
+		if(self.listeners("data").length > 0)
+			for(var i = 0; i < devices.length; i++)
+				self.emit("data", devices[i], data.slice(offsets[i], offsets[i + 1]),
+					timestamps[i]);
+	}, HID.maxBatchReports);
+};
+Group.prototype._hasReadListeners = function _hasReadListeners() {
+	return this.listeners("data").length > 0 ||
+		this.listeners("reports").length > 0;
+};
+//Writes a report to the device with the given index into `paths`
+Group.prototype.write = function write(device, data) {
+	return this._raw.write(device, data);
+};
+Group.prototype.stats = function stats(reset) {
+	return this._raw.stats(reset);
+};
+//Sets the scheduling of the native reader thread, like `HID.prototype.setThreadPolicy(...)`
+Group.prototype.setThreadPolicy = function setThreadPolicy(policy) {
+	this._raw.setThreadPolicy(policy);
+};
+
+/* Enumerates devices on the libuv threadpool.  Takes the same
+	optional filter arguments as `devices(...)` and calls
+	`callback(err, devices)`, or returns a Promise if no callback is
+	given. */
+function devicesAsync() {
+	var args = Array.prototype.slice.call(arguments);
+	var callback = typeof args[args.length - 1] == "function" ?
+		args.pop() : null;
+	return callbackOrPromise(callback, function(done) {
+		args.push(done);
+		binding.devicesAsync.apply(binding, args);
+	});
+}
+
+/* Emits "attach" and "detach" events with the device info of HID
+	devices as they come and go.  The native monitor runs while there
+	are listeners for either event. */
+var hotplug = new EventEmitter();
+hotplug._listening = function _listening() {
+	return hotplug.listeners("attach").length > 0 ||
+		hotplug.listeners("detach").length > 0;
+};
+hotplug._running = false;
+hotplug.on("newListener", function(eventName) {
+	if(!hotplug._running && (eventName == "attach" || eventName == "detach") )
+	{
+		binding.hotplugStart(function(eventName, device) {
+			hotplug.emit(eventName, device);
+		});
+		hotplug._running = true;
+	}
+});
+hotplug.on("removeListener", function(eventName) {
+	if(hotplug._running && !hotplug._listening() )
+	{
+		binding.hotplugStop();
+		hotplug._running = false;
+	}
+});
 
 //Expose API
 exports.HID = HID;
+exports.ReadStream = ReadStream;
+exports.PeriodicOutput = PeriodicOutput;
+exports.Group = Group;
+exports.hotplug = hotplug;
 exports.devices = binding.devices;
+exports.devicesAsync = devicesAsync;
+exports.setDevicesCacheTimeout = binding.setDevicesCacheTimeout;
+exports.captureStart = binding.captureStart;
+exports.captureStop = binding.captureStop;
+exports.parseReportDescriptor = binding.parseReportDescriptor;
+exports.ReportDecoder = binding.ReportDecoder;
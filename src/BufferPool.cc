@@ -0,0 +1,143 @@
+// -*- C++ -*-
+
+// Copyright Hans Huebner and contributors. All rights reserved.
+// Permission is hereby granted, free of charge, to any person
+// obtaining a copy of this software and associated documentation
+// files (the "Software"), to deal in the Software without
+// restriction, including without limitation the rights to use, copy,
+// modify, merge, publish, distribute, sublicense, and/or sell copies
+// of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be
+// included in all copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+
+
+#include <nan.h>
+
+#include "BufferPool.h"
+
+using namespace std;
+
+BufferPool::BufferPool(size_t slabSize, size_t maxFreeSlabs)
+  : _slabSize(slabSize),
+    _maxFreeSlabs(maxFreeSlabs),
+    _current(0),
+    _slabs(0),
+    _disposed(false)
+{
+}
+
+BufferPool::~BufferPool()
+{
+}
+
+void
+BufferPool::dispose()
+{
+  // Slabs still referenced by live Buffers are deleted when the last
+  // of them is released, and the pool with the last slab
+  _disposed = true;
+  Slab* current = _current;
+  _current = 0;
+  if (current && !current->_refs) {
+    destroy(current);
+  }
+  vector<Slab*> free;
+  free.swap(_free);
+  for (vector<Slab*>::iterator i = free.begin(); i != free.end(); i++) {
+    destroy(*i);
+  }
+  if (!_slabs) {
+    delete this;
+  }
+}
+
+BufferPool::Slab*
+BufferPool::newSlab(size_t size)
+{
+  NanAdjustExternalMemory(size);
+  _slabs++;
+  return new Slab(this, size);
+}
+
+void
+BufferPool::destroy(Slab* slab)
+{
+  NanAdjustExternalMemory(-(int) slab->_size);
+  delete slab;
+  _slabs--;
+}
+
+char*
+BufferPool::allocate(size_t length, void*& hint)
+{
+  // Keep every report 8 byte aligned within its slab
+  size_t size = (length + 7) & ~(size_t) 7;
+
+  if (size > _slabSize / 4) {
+    // Large reports would waste most of a slab, give them their own
+    Slab* slab = newSlab(size);
+    slab->_used = size;
+    slab->_refs = 1;
+    hint = slab;
+    return slab->_data;
+  }
+
+  if (!_current || _current->_size - _current->_used < size) {
+    Slab* retired = _current;
+    if (_free.empty()) {
+      _current = newSlab(_slabSize);
+    } else {
+      _current = _free.back();
+      _free.pop_back();
+    }
+    if (retired && !retired->_refs) {
+      recycle(retired);
+    }
+  }
+
+  char* data = _current->_data + _current->_used;
+  _current->_used += size;
+  _current->_refs++;
+  hint = _current;
+  return data;
+}
+
+void
+BufferPool::release(char*, void* hint)
+{
+  Slab* slab = static_cast<Slab*>(hint);
+  if (--slab->_refs) {
+    return;
+  }
+  BufferPool* pool = slab->_pool;
+  if (slab == pool->_current) {
+    // Nothing points into the current slab anymore, start over
+    slab->_used = 0;
+  } else {
+    pool->recycle(slab);
+    if (pool->_disposed && !pool->_slabs) {
+      delete pool;
+    }
+  }
+}
+
+void
+BufferPool::recycle(Slab* slab)
+{
+  if (!_disposed && slab->_size == _slabSize && _free.size() < _maxFreeSlabs) {
+    slab->_used = 0;
+    _free.push_back(slab);
+  } else {
+    destroy(slab);
+  }
+}
@@ -0,0 +1,95 @@
+// -*- C++ -*-
+
+// Copyright Hans Huebner and contributors. All rights reserved.
+// Permission is hereby granted, free of charge, to any person
+// obtaining a copy of this software and associated documentation
+// files (the "Software"), to deal in the Software without
+// restriction, including without limitation the rights to use, copy,
+// modify, merge, publish, distribute, sublicense, and/or sell copies
+// of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be
+// included in all copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+
+
+#ifndef BUFFER_POOL_H
+#define BUFFER_POOL_H
+
+#include <vector>
+
+#include <stddef.h>
+
+// //////////////////////////////////////////////////////////////////
+// Slab allocator backing the Buffers that carry input reports.
+// Reports are carved out of large slabs which are handed to JS as
+// externally backed Buffers.  Each slab counts the Buffers that
+// still point into it and is recycled once all of them have been
+// collected, so a steady stream of reports allocates no memory.
+// Must only be used from the JavaScript thread.
+// //////////////////////////////////////////////////////////////////
+class BufferPool
+{
+public:
+  BufferPool(size_t slabSize, size_t maxFreeSlabs);
+
+  // Deletes the pool, right away or once the last Buffer pointing
+  // into it has been collected
+  void dispose();
+
+  // Returns room for length bytes; hint must be passed to release()
+  // together with the returned pointer once the memory is unused.
+  char* allocate(size_t length, void*& hint);
+
+  // Signature matches the free callback of externally backed Buffers
+  static void release(char* data, void* hint);
+
+private:
+  struct Slab {
+    Slab(BufferPool* pool, size_t size)
+      : _pool(pool),
+        _data(new char[size]),
+        _size(size),
+        _used(0),
+        _refs(0)
+    {}
+
+    ~Slab()
+    {
+      delete[] _data;
+    }
+
+    BufferPool* _pool;
+    char* _data;
+    size_t _size;
+    size_t _used;
+    size_t _refs;
+  };
+
+  ~BufferPool();
+
+  Slab* newSlab(size_t size);
+  void recycle(Slab* slab);
+  void destroy(Slab* slab);
+
+  BufferPool(const BufferPool&);
+  BufferPool& operator=(const BufferPool&);
+
+  const size_t _slabSize;
+  const size_t _maxFreeSlabs;
+  Slab* _current;
+  std::vector<Slab*> _free;
+  // Slabs allocated and not yet deleted
+  size_t _slabs;
+  bool _disposed;
+};
+
+#endif
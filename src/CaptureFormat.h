@@ -0,0 +1,65 @@
+// -*- C++ -*-
+
+// Copyright Hans Huebner and contributors. All rights reserved.
+// Permission is hereby granted, free of charge, to any person
+// obtaining a copy of this software and associated documentation
+// files (the "Software"), to deal in the Software without
+// restriction, including without limitation the rights to use, copy,
+// modify, merge, publish, distribute, sublicense, and/or sell copies
+// of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be
+// included in all copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+
+
+#ifndef CAPTURE_FORMAT_H
+#define CAPTURE_FORMAT_H
+
+#include <stdint.h>
+
+// //////////////////////////////////////////////////////////////////
+// Layout of the capture logs written by HID.captureStart() and
+// replayed by the mock hidapi.  A log is the magic followed by
+// records, each a header and the report, padded to a multiple of 8
+// bytes so that the headers of a memory mapped log stay aligned.
+// Integers are in the byte order of the machine that wrote the log.
+// //////////////////////////////////////////////////////////////////
+namespace CaptureFormat {
+
+const char magic[8] = { 'H', 'I', 'D', 'C', 'A', 'P', 0, 1 };
+
+enum Kind {
+  input = 0,
+  output = 1,
+  feature = 2,
+  // Precedes the first report of a device in a log; the report is
+  // the path the device was opened with, if any
+  device = 3
+};
+
+struct RecordHeader {
+  uint64_t _time;   // uv_hrtime() of reading or writing the report
+  uint32_t _device; // same for all records of one device
+  uint16_t _length; // of the report following the header
+  uint8_t _kind;
+  uint8_t _reserved;
+};
+
+inline size_t
+recordSize(size_t length)
+{
+  return sizeof(RecordHeader) + ((length + 7) & ~(size_t) 7);
+}
+
+}
+
+#endif
@@ -0,0 +1,208 @@
+// -*- C++ -*-
+
+// Copyright Hans Huebner and contributors. All rights reserved.
+// Permission is hereby granted, free of charge, to any person
+// obtaining a copy of this software and associated documentation
+// files (the "Software"), to deal in the Software without
+// restriction, including without limitation the rights to use, copy,
+// modify, merge, publish, distribute, sublicense, and/or sell copies
+// of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be
+// included in all copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+
+
+#include <errno.h>
+#include <string.h>
+
+#include "CaptureLog.h"
+
+using namespace std;
+
+CaptureLog captureLog;
+
+CaptureLog::CaptureLog()
+  : _active(false),
+    _session(0),
+    _started(false),
+    _stopping(false),
+    _file(0)
+{
+  memset(&_totals, 0, sizeof _totals);
+  uv_mutex_init(&_lock);
+  uv_cond_init(&_wakeup);
+}
+
+CaptureLog::~CaptureLog()
+{
+  Totals totals;
+  stop(totals);
+  uv_cond_destroy(&_wakeup);
+  uv_mutex_destroy(&_lock);
+}
+
+bool
+CaptureLog::start(const string& path, string& error)
+{
+  // Nothing records while the capture is inactive, so holding the
+  // lock while opening the file keeps no one waiting
+  uv_mutex_lock(&_lock);
+  if (_started) {
+    uv_mutex_unlock(&_lock);
+    error = "already capturing";
+    return false;
+  }
+  FILE* file = fopen(path.c_str(), "wb");
+  if (!file) {
+    uv_mutex_unlock(&_lock);
+    error = "cannot create " + path + ": " + strerror(errno);
+    return false;
+  }
+  if (fwrite(CaptureFormat::magic, sizeof CaptureFormat::magic, 1, file) != 1) {
+    uv_mutex_unlock(&_lock);
+    error = "cannot write to " + path + ": " + strerror(errno);
+    fclose(file);
+    return false;
+  }
+  _session++;
+  _buffer.clear();
+  _buffer.reserve(flushThreshold * 2);
+  _stopping = false;
+  memset(&_totals, 0, sizeof _totals);
+  _file = file;
+  if (uv_thread_create(&_thread, writerThread, this)) {
+    _file = 0;
+    uv_mutex_unlock(&_lock);
+    error = "cannot start capture thread";
+    fclose(file);
+    return false;
+  }
+  _started = true;
+  _active.store(true, std::memory_order_release);
+  uv_mutex_unlock(&_lock);
+  return true;
+}
+
+bool
+CaptureLog::stop(Totals& totals)
+{
+  uv_mutex_lock(&_lock);
+  if (!_active.load(std::memory_order_relaxed)) {
+    uv_mutex_unlock(&_lock);
+    return false;
+  }
+  _active.store(false, std::memory_order_release);
+  _stopping = true;
+  uv_cond_signal(&_wakeup);
+  uv_mutex_unlock(&_lock);
+  uv_thread_join(&_thread);
+  bool closed = fclose(_file) == 0;
+  _file = 0;
+  uv_mutex_lock(&_lock);
+  if (!closed) {
+    _totals._writeFailed = true;
+  }
+  totals = _totals;
+  _started = false;
+  uv_mutex_unlock(&_lock);
+  return true;
+}
+
+void
+CaptureLog::append(uint32_t device, const string& path, unsigned int& announced,
+                   CaptureFormat::Kind kind, const unsigned char* data, size_t length)
+{
+  uv_mutex_lock(&_lock);
+  // Checked again as the capture may have stopped since the caller
+  // looked
+  if (_active.load(std::memory_order_relaxed)) {
+    if (announced != _session) {
+      announced = _session;
+      appendRecord(device, CaptureFormat::device, (const unsigned char*) path.data(), path.size());
+    }
+    appendRecord(device, kind, data, length);
+    if (_buffer.size() >= flushThreshold) {
+      uv_cond_signal(&_wakeup);
+    }
+  }
+  uv_mutex_unlock(&_lock);
+}
+
+void
+CaptureLog::appendRecord(uint32_t device, CaptureFormat::Kind kind, const unsigned char* data, size_t length)
+{
+  if (length > 0xffff) {
+    length = 0xffff;
+  }
+  size_t size = CaptureFormat::recordSize(length);
+  if (_buffer.size() + size > maxBuffered) {
+    _totals._dropped++;
+    return;
+  }
+  CaptureFormat::RecordHeader header;
+  header._time = uv_hrtime();
+  header._device = device;
+  header._length = (uint16_t) length;
+  header._kind = (uint8_t) kind;
+  header._reserved = 0;
+  size_t offset = _buffer.size();
+  _buffer.resize(offset + size);
+  memcpy(&_buffer[offset], &header, sizeof header);
+  if (length) {
+    memcpy(&_buffer[offset + sizeof header], data, length);
+  }
+  _totals._records++;
+  _totals._bytes += size;
+}
+
+void
+CaptureLog::writerThread(void* arg)
+{
+  CaptureLog* log = (CaptureLog*) arg;
+  vector<unsigned char> pending;
+  pending.reserve(flushThreshold * 2);
+  bool stopping = false;
+  while (!stopping) {
+    uv_mutex_lock(&log->_lock);
+    if (!log->_stopping && log->_buffer.size() < flushThreshold) {
+      uv_cond_timedwait(&log->_wakeup, &log->_lock, (uint64_t) flushInterval * 1000000);
+    }
+    pending.swap(log->_buffer);
+    stopping = log->_stopping;
+    uv_mutex_unlock(&log->_lock);
+
+    if (!pending.empty()) {
+      if (fwrite(&pending[0], pending.size(), 1, log->_file) != 1 || fflush(log->_file)) {
+        uv_mutex_lock(&log->_lock);
+        log->_totals._writeFailed = true;
+        uv_mutex_unlock(&log->_lock);
+      }
+      pending.clear();
+    }
+  }
+}
+
+// //////////////////////////////////////////////////////////////////
+
+atomic<uint32_t> CaptureSource::lastId(0);
+
+CaptureSource::CaptureSource(const string& path)
+  : _path(path),
+    _id(++lastId),
+    _announced(0)
+{}
+
+void
+CaptureSource::append(CaptureFormat::Kind kind, const unsigned char* data, size_t length)
+{
+  captureLog.append(_id, _path, _announced, kind, data, length);
+}
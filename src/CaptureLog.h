@@ -0,0 +1,135 @@
+// -*- C++ -*-
+
+// Copyright Hans Huebner and contributors. All rights reserved.
+// Permission is hereby granted, free of charge, to any person
+// obtaining a copy of this software and associated documentation
+// files (the "Software"), to deal in the Software without
+// restriction, including without limitation the rights to use, copy,
+// modify, merge, publish, distribute, sublicense, and/or sell copies
+// of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be
+// included in all copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+
+
+#ifndef CAPTURE_LOG_H
+#define CAPTURE_LOG_H
+
+#include <atomic>
+#include <string>
+#include <vector>
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include <uv.h>
+
+#include "CaptureFormat.h"
+
+// //////////////////////////////////////////////////////////////////
+// Appends the reports of all devices to a log file, see
+// CaptureFormat.h.  Reports are copied into a buffer under a short
+// lock from whichever thread reads or writes them, and a background
+// thread writes the buffer out.  Reports are dropped rather than
+// making the I/O threads wait if the disk falls behind.  Costs one
+// atomic load per report while not capturing.
+// //////////////////////////////////////////////////////////////////
+class CaptureLog
+{
+public:
+  struct Totals
+  {
+    uint64_t _records;
+    uint64_t _bytes;
+    uint64_t _dropped;
+    bool _writeFailed;
+  };
+
+  CaptureLog();
+  ~CaptureLog();
+
+  // Returns false with error set if already capturing or the file
+  // cannot be created
+  bool start(const std::string& path, std::string& error);
+  // Writes out what is buffered and closes the file.  Returns false
+  // if not capturing.
+  bool stop(Totals& totals);
+
+  bool active() const { return _active.load(std::memory_order_acquire); }
+
+  // Logs a report of the given device, preceded by a device record
+  // with its path unless the device has already been announced in
+  // this capture.  announced is the caller's, but protected by the
+  // log; it is 0 for devices never announced.
+  void append(uint32_t device, const std::string& path, unsigned int& announced,
+              CaptureFormat::Kind kind, const unsigned char* data, size_t length);
+
+  // Bytes buffered at most, and from which on the writer is woken
+  static const size_t maxBuffered = 16 * 1024 * 1024;
+  static const size_t flushThreshold = 64 * 1024;
+  static const int flushInterval = 100; // ms
+
+private:
+  static void writerThread(void* arg);
+  void appendRecord(uint32_t device, CaptureFormat::Kind kind, const unsigned char* data, size_t length);
+
+  CaptureLog(const CaptureLog&);
+  CaptureLog& operator=(const CaptureLog&);
+
+  std::atomic<bool> _active;
+  uv_mutex_t _lock;
+  uv_cond_t _wakeup;
+  // everything below is protected by _lock
+  unsigned int _session; // counts start()s
+  bool _started; // from start() until stop() is done with the writer
+  std::vector<unsigned char> _buffer;
+  bool _stopping;
+  Totals _totals;
+  // writer thread only, once started
+  FILE* _file;
+  uv_thread_t _thread;
+};
+
+// The process wide log
+extern CaptureLog captureLog;
+
+// //////////////////////////////////////////////////////////////////
+// One device as it appears in capture logs: a number of its own and
+// the path it was opened with, which is logged ahead of its first
+// report in each capture.  Safe to use from any thread.
+// //////////////////////////////////////////////////////////////////
+class CaptureSource
+{
+public:
+  explicit CaptureSource(const std::string& path);
+
+  void record(CaptureFormat::Kind kind, const unsigned char* data, size_t length)
+  {
+    if (captureLog.active()) {
+      append(kind, data, length);
+    }
+  }
+
+private:
+  void append(CaptureFormat::Kind kind, const unsigned char* data, size_t length);
+
+  CaptureSource(const CaptureSource&);
+  CaptureSource& operator=(const CaptureSource&);
+
+  const std::string _path;
+  const uint32_t _id;
+  unsigned int _announced; // see CaptureLog::append()
+
+  static std::atomic<uint32_t> lastId;
+};
+
+#endif
@@ -0,0 +1,175 @@
+// -*- C++ -*-
+
+// Copyright Hans Huebner and contributors. All rights reserved.
+// Permission is hereby granted, free of charge, to any person
+// obtaining a copy of this software and associated documentation
+// files (the "Software"), to deal in the Software without
+// restriction, including without limitation the rights to use, copy,
+// modify, merge, publish, distribute, sublicense, and/or sell copies
+// of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be
+// included in all copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+
+
+#include "DeviceCache.h"
+
+using namespace std;
+
+static uint32_t
+key(unsigned short high, unsigned short low)
+{
+  return ((uint32_t) high << 16) | low;
+}
+
+bool
+DeviceFilter::matches(const DeviceInfo& device) const
+{
+  return (!_vendorId || device._vendorId == _vendorId)
+    && (!_productId || device._productId == _productId)
+    && (!_usagePage || device._usagePage == _usagePage)
+    && (!_usage || device._usage == _usage)
+    && (_path.empty() || device._path == _path);
+}
+
+DeviceCache::DeviceCache()
+  : _timeout(0),
+    _watched(false),
+    _valid(false),
+    _enumerated(0)
+{
+  uv_mutex_init(&_lock);
+}
+
+DeviceCache::~DeviceCache()
+{
+  uv_mutex_destroy(&_lock);
+}
+
+void
+DeviceCache::setTimeout(unsigned int timeoutMs)
+{
+  uv_mutex_lock(&_lock);
+  _timeout = timeoutMs;
+  uv_mutex_unlock(&_lock);
+}
+
+void
+DeviceCache::setWatched(bool watched)
+{
+  uv_mutex_lock(&_lock);
+  // Changes may have gone unnoticed before the monitor started
+  _watched = watched;
+  _valid = false;
+  uv_mutex_unlock(&_lock);
+}
+
+void
+DeviceCache::invalidate()
+{
+  uv_mutex_lock(&_lock);
+  _valid = false;
+  uv_mutex_unlock(&_lock);
+}
+
+bool
+DeviceCache::isFresh() const
+{
+  if (!_valid) {
+    return false;
+  }
+  return _watched || uv_hrtime() - _enumerated < (uint64_t) _timeout * 1000000;
+}
+
+void
+DeviceCache::refresh()
+{
+  _devices.clear();
+  _byIds.clear();
+  _byVendorId.clear();
+  _byUsage.clear();
+  _byPath.clear();
+
+  enumerateDevices(0, 0, _devices);
+  for (size_t i = 0; i < _devices.size(); i++) {
+    const DeviceInfo& device = _devices[i];
+    _byIds[key(device._vendorId, device._productId)].push_back(i);
+    _byVendorId[device._vendorId].push_back(i);
+    _byUsage[key(device._usagePage, device._usage)].push_back(i);
+    _byPath[device._path] = i;
+  }
+  _enumerated = uv_hrtime();
+  _valid = true;
+}
+
+void
+DeviceCache::lookup(const DeviceFilter& filter, vector<DeviceInfo>& result)
+{
+  uv_mutex_lock(&_lock);
+
+  if (!_watched && !_timeout) {
+    // Caching is off, let hidapi do the vendor/product ID filtering
+    uv_mutex_unlock(&_lock);
+    vector<DeviceInfo> devices;
+    enumerateDevices(filter._vendorId, filter._productId, devices);
+    for (size_t i = 0; i < devices.size(); i++) {
+      if (filter.matches(devices[i])) {
+        result.push_back(devices[i]);
+      }
+    }
+    return;
+  }
+
+  if (!isFresh()) {
+    refresh();
+  }
+
+  // Use the most selective index available for the filter
+  if (!filter._path.empty()) {
+    map<string, size_t>::const_iterator i = _byPath.find(filter._path);
+    if (i != _byPath.end() && filter.matches(_devices[i->second])) {
+      result.push_back(_devices[i->second]);
+    }
+    uv_mutex_unlock(&_lock);
+    return;
+  }
+
+  static const vector<size_t> none;
+  const vector<size_t>* candidates = 0;
+  Index::const_iterator i;
+  if (filter._vendorId && filter._productId) {
+    i = _byIds.find(key(filter._vendorId, filter._productId));
+    candidates = i == _byIds.end() ? &none : &i->second;
+  } else if (filter._vendorId) {
+    i = _byVendorId.find(filter._vendorId);
+    candidates = i == _byVendorId.end() ? &none : &i->second;
+  } else if (filter._usagePage && filter._usage) {
+    i = _byUsage.find(key(filter._usagePage, filter._usage));
+    candidates = i == _byUsage.end() ? &none : &i->second;
+  }
+
+  if (candidates) {
+    for (vector<size_t>::const_iterator j = candidates->begin(); j != candidates->end(); j++) {
+      if (filter.matches(_devices[*j])) {
+        result.push_back(_devices[*j]);
+      }
+    }
+  } else {
+    for (size_t j = 0; j < _devices.size(); j++) {
+      if (filter.matches(_devices[j])) {
+        result.push_back(_devices[j]);
+      }
+    }
+  }
+
+  uv_mutex_unlock(&_lock);
+}
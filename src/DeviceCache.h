@@ -0,0 +1,99 @@
+// -*- C++ -*-
+
+// Copyright Hans Huebner and contributors. All rights reserved.
+// Permission is hereby granted, free of charge, to any person
+// obtaining a copy of this software and associated documentation
+// files (the "Software"), to deal in the Software without
+// restriction, including without limitation the rights to use, copy,
+// modify, merge, publish, distribute, sublicense, and/or sell copies
+// of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be
+// included in all copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+
+
+#ifndef DEVICE_CACHE_H
+#define DEVICE_CACHE_H
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include <stdint.h>
+
+#include <uv.h>
+
+#include "DeviceInfo.h"
+
+// Criteria for looking up devices; zero IDs and an empty path match
+// any device
+struct DeviceFilter
+{
+  DeviceFilter()
+    : _vendorId(0),
+      _productId(0),
+      _usagePage(0),
+      _usage(0)
+  {}
+
+  bool matches(const DeviceInfo& device) const;
+
+  unsigned short _vendorId;
+  unsigned short _productId;
+  unsigned short _usagePage;
+  unsigned short _usage;
+  std::string _path;
+};
+
+// //////////////////////////////////////////////////////////////////
+// Result of the last full enumeration, indexed by vendor/product
+// ID, usage page/usage and path, so that filtered lookups do not
+// scan the bus.  While the hotplug monitor is watching, the cache
+// is valid until the monitor invalidates it; otherwise it expires
+// after a timeout.  With a timeout of zero, every lookup enumerates.
+// Safe to use from any thread.
+// //////////////////////////////////////////////////////////////////
+class DeviceCache
+{
+public:
+  DeviceCache();
+  ~DeviceCache();
+
+  void setTimeout(unsigned int timeoutMs);
+  void setWatched(bool watched);
+  void invalidate();
+
+  void lookup(const DeviceFilter& filter, std::vector<DeviceInfo>& result);
+
+private:
+  typedef std::map<uint32_t, std::vector<size_t> > Index;
+
+  bool isFresh() const;
+  void refresh();
+
+  DeviceCache(const DeviceCache&);
+  DeviceCache& operator=(const DeviceCache&);
+
+  uv_mutex_t _lock;
+  // everything below is protected by _lock
+  unsigned int _timeout; // ms
+  bool _watched;
+  bool _valid;
+  uint64_t _enumerated; // uv_hrtime() of the last enumeration
+  std::vector<DeviceInfo> _devices;
+  Index _byIds;
+  Index _byVendorId;
+  Index _byUsage;
+  std::map<std::string, size_t> _byPath;
+};
+
+#endif
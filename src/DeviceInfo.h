@@ -0,0 +1,162 @@
+// -*- C++ -*-
+
+// Copyright Hans Huebner and contributors. All rights reserved.
+// Permission is hereby granted, free of charge, to any person
+// obtaining a copy of this software and associated documentation
+// files (the "Software"), to deal in the Software without
+// restriction, including without limitation the rights to use, copy,
+// modify, merge, publish, distribute, sublicense, and/or sell copies
+// of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be
+// included in all copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+
+
+#ifndef DEVICE_INFO_H
+#define DEVICE_INFO_H
+
+#include <string>
+#include <vector>
+
+#include <hidapi.h>
+#include <uv.h>
+
+// //////////////////////////////////////////////////////////////////
+// Converts the strings hidapi reports to UTF-8.  wchar_t holds UTF-32
+// on most systems and UTF-16 on Windows; unpaired surrogates and
+// invalid code points become U+FFFD.
+// //////////////////////////////////////////////////////////////////
+inline std::string
+utf8(const wchar_t* wide)
+{
+  std::string result;
+  if (!wide) {
+    return result;
+  }
+  for (; *wide; wide++) {
+    unsigned long c = (unsigned long) *wide;
+    if (sizeof(wchar_t) == 2 && c >= 0xd800 && c < 0xdc00
+        && wide[1] >= 0xdc00 && wide[1] < 0xe000) {
+      c = 0x10000 + ((c - 0xd800) << 10) + ((unsigned long) wide[1] - 0xdc00);
+      wide++;
+    } else if ((c >= 0xd800 && c < 0xe000) || c > 0x10ffff) {
+      c = 0xfffd;
+    }
+    if (c < 0x80) {
+      result += (char) c;
+    } else if (c < 0x800) {
+      result += (char) (0xc0 | (c >> 6));
+      result += (char) (0x80 | (c & 0x3f));
+    } else if (c < 0x10000) {
+      result += (char) (0xe0 | (c >> 12));
+      result += (char) (0x80 | ((c >> 6) & 0x3f));
+      result += (char) (0x80 | (c & 0x3f));
+    } else {
+      result += (char) (0xf0 | (c >> 18));
+      result += (char) (0x80 | ((c >> 12) & 0x3f));
+      result += (char) (0x80 | ((c >> 6) & 0x3f));
+      result += (char) (0x80 | (c & 0x3f));
+    }
+  }
+  return result;
+}
+
+// //////////////////////////////////////////////////////////////////
+// Copy of a hid_device_info entry that can outlive the enumeration
+// it was taken from and be passed between threads.  Strings are
+// converted to UTF-8 once, when the entry is taken.
+// //////////////////////////////////////////////////////////////////
+struct DeviceInfo
+{
+  DeviceInfo(const hid_device_info& dev)
+    : _path(dev.path ? dev.path : ""),
+      _vendorId(dev.vendor_id),
+      _productId(dev.product_id),
+      _hasSerialNumber(dev.serial_number != 0),
+      _serialNumber(utf8(dev.serial_number)),
+      _hasManufacturer(dev.manufacturer_string != 0),
+      _manufacturer(utf8(dev.manufacturer_string)),
+      _hasProduct(dev.product_string != 0),
+      _product(utf8(dev.product_string)),
+      _release(dev.release_number),
+      _interface(dev.interface_number),
+      _usagePage(dev.usage_page),
+      _usage(dev.usage)
+  {}
+
+  bool operator<(const DeviceInfo& other) const { return _path < other._path; }
+
+  std::string _path;
+  unsigned short _vendorId;
+  unsigned short _productId;
+  bool _hasSerialNumber;
+  std::string _serialNumber;
+  bool _hasManufacturer;
+  std::string _manufacturer;
+  bool _hasProduct;
+  std::string _product;
+  unsigned short _release;
+  int _interface;
+  unsigned short _usagePage;
+  unsigned short _usage;
+};
+
+// //////////////////////////////////////////////////////////////////
+// The hidapi backends keep process wide state behind hid_init(),
+// hid_enumerate() and hid_open*(), such as the IOHIDManager on macOS,
+// that must not be used from two threads at once.  Enumerations and
+// opens from the JS thread, the threadpool and the hotplug monitor
+// all go through the functions below, which take one lock.
+// //////////////////////////////////////////////////////////////////
+inline uv_mutex_t*
+hidapiMutex()
+{
+  static uv_once_t once = UV_ONCE_INIT;
+  static uv_mutex_t mutex;
+  struct Init {
+    static void run() { uv_mutex_init(&mutex); }
+  };
+  uv_once(&once, Init::run);
+  return &mutex;
+}
+
+inline void
+enumerateDevices(unsigned short vendorId, unsigned short productId, std::vector<DeviceInfo>& devices)
+{
+  uv_mutex_lock(hidapiMutex());
+  hid_device_info* devs = hid_enumerate(vendorId, productId);
+  for (hid_device_info* dev = devs; dev; dev = dev->next) {
+    devices.push_back(DeviceInfo(*dev));
+  }
+  hid_free_enumeration(devs);
+  uv_mutex_unlock(hidapiMutex());
+}
+
+inline hid_device*
+openDevice(const char* path)
+{
+  uv_mutex_lock(hidapiMutex());
+  hid_device* handle = hid_open_path(path);
+  uv_mutex_unlock(hidapiMutex());
+  return handle;
+}
+
+inline hid_device*
+openDevice(unsigned short vendorId, unsigned short productId, const wchar_t* serialNumber)
+{
+  uv_mutex_lock(hidapiMutex());
+  hid_device* handle = hid_open(vendorId, productId, serialNumber);
+  uv_mutex_unlock(hidapiMutex());
+  return handle;
+}
+
+#endif
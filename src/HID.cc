@@ -20,12 +20,26 @@
 // FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
 // IN THE SOFTWARE.
 
+#include <algorithm>
+#include <atomic>
+#include <deque>
 #include <iostream>
 #include <iomanip>
+#include <map>
+#include <set>
 #include <sstream>
 #include <vector>
 
 #include <stdlib.h>
+#include <string.h>
+
+#ifdef HID_DRIVER_HIDRAW
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <linux/hidraw.h>
+#endif
 
 #include <v8.h>
 #include <node.h>
@@ -34,6 +48,23 @@
 #include <hidapi.h>
 #include "nan.h"
 
+#include "BufferPool.h"
+#include "CaptureLog.h"
+#include "DeviceCache.h"
+#include "DeviceInfo.h"
+#include "Hotplug.h"
+#include "InputQueue.h"
+#include "LatestReports.h"
+#include "ReplyMatcher.h"
+#include "ReportDescriptor.h"
+#include "ReportFilter.h"
+#include "ReportRing.h"
+#include "Stats.h"
+#include "ThreadPolicy.h"
+#ifdef HID_DRIVER_HIDRAW
+#include "HidrawPoller.h"
+#endif
+
 using namespace std;
 using namespace v8;
 using namespace node;
@@ -54,45 +85,272 @@ protected:
   string _message;
 };
 
+// //////////////////////////////////////////////////////////////////
+// Bytes of an output or feature report passed in from JavaScript.
+// Buffers and byte typed arrays are used in place, Arrays of
+// numbers are converted.
+// //////////////////////////////////////////////////////////////////
+class ReportData
+{
+public:
+  ReportData(Handle<Value> value);
+
+  const unsigned char* data() const { return _data; }
+  size_t length() const { return _length; }
+
+private:
+  const unsigned char* _data;
+  size_t _length;
+  vector<unsigned char> _converted;
+};
+
+// uv_timer_cb lost its status argument after node 0.10
+#if NODE_MODULE_VERSION > NODE_0_10_MODULE_VERSION
+#define TIMER_CB(name) void name(uv_timer_t* timer)
+#else
+#define TIMER_CB(name) void name(uv_timer_t* timer, int)
+#endif
+
+static bool
+isByteArray(ExternalArrayType type)
+{
+#if NODE_MODULE_VERSION > NODE_0_10_MODULE_VERSION
+  return type == kExternalUint8Array || type == kExternalInt8Array || type == kExternalUint8ClampedArray;
+#else
+  return type == kExternalUnsignedByteArray || type == kExternalByteArray || type == kExternalPixelArray;
+#endif
+}
+
+ReportData::ReportData(Handle<Value> value)
+  : _data(0),
+    _length(0)
+{
+  if (Buffer::HasInstance(value)) {
+    _data = (const unsigned char*) Buffer::Data(value);
+    _length = Buffer::Length(value);
+    return;
+  }
+
+  if (!value->IsObject()) {
+    throw JSException("unexpected report to send, expecting a Buffer, Uint8Array or Array of integers");
+  }
+
+  Local<Object> object = value->ToObject();
+  if (object->HasIndexedPropertiesInExternalArrayData()) {
+    if (!isByteArray(object->GetIndexedPropertiesExternalArrayDataType())) {
+      throw JSException("unexpected typed array to send, expecting a Uint8Array");
+    }
+    _data = (const unsigned char*) object->GetIndexedPropertiesExternalArrayData();
+    _length = object->GetIndexedPropertiesExternalArrayDataLength();
+    return;
+  }
+
+  if (!value->IsArray()) {
+    throw JSException("unexpected report to send, expecting a Buffer, Uint8Array or Array of integers");
+  }
+
+  Local<Array> messageArray = Local<Array>::Cast(value);
+  _converted.reserve(messageArray->Length());
+  for (unsigned i = 0; i < messageArray->Length(); i++) {
+    Local<Value> element = messageArray->Get(i);
+    if (!element->IsNumber()) {
+      throw JSException("unexpected array element in array to send, expecting only integers");
+    }
+    _converted.push_back((unsigned char) element->Int32Value());
+  }
+  _data = _converted.empty() ? 0 : &_converted[0];
+  _length = _converted.size();
+}
+
+class HID;
+class DeviceGroup;
+
+// Properties of the objects HID.devices() returns, see
+// deviceInfosToJS().  The strings hidapi reports come last.
+enum DeviceInfoField {
+  vendorIdField,
+  productIdField,
+  pathField,
+  releaseField,
+  interfaceField,
+  usagePageField,
+  usageField,
+  serialNumberField,
+  manufacturerField,
+  productField,
+  deviceInfoFields
+};
+
+const DeviceInfoField firstStringField = serialNumberField;
+
+// //////////////////////////////////////////////////////////////////
+// State of the addon, set up when it is loaded and torn down at exit.
+// All JS facing code runs on the main thread and its default loop;
+// NAN 1.x only builds for node versions without worker threads.
+// //////////////////////////////////////////////////////////////////
+struct AddonState
+{
+  AddonState()
+    : _reportPool(new BufferPool(16 * 1024, 8)),
+      _hotplugMonitor(0),
+      _hotplugAsync(0),
+      _hotplugCallback(0)
+  {}
+
+  // Input reports are handed to JS in Buffers carved out of recycled
+  // slabs, see BufferPool.h.  Disposed of at exit, but lives on until
+  // the Buffers still pointing into it are collected.
+  BufferPool* _reportPool;
+  // Hotplug notifications, delivered through one callback
+  HotplugMonitor* _hotplugMonitor;
+  uv_async_t* _hotplugAsync;
+  NanCallback* _hotplugCallback;
+  // Closed at exit
+  set<HID*> _devices;
+  set<DeviceGroup*> _groups;
+  // Shared by all enumeration results
+  Persistent<ObjectTemplate> _deviceInfoTemplate;
+  Persistent<String> _deviceInfoKeys[deviceInfoFields];
+  // Float64Array as it was when the addon loaded, for decoded reports
+  Persistent<Function> _float64Array;
+};
+
+static AddonState* addonState = 0;
+
+static Local<Object>
+newReportBuffer(size_t length, char*& data)
+{
+  void* hint;
+  data = addonState->_reportPool->allocate(length, hint);
+  return NanNewBufferHandle(data, length, BufferPool::release, hint);
+}
+
+static Local<Object>
+newReportBuffer(const unsigned char* report, size_t length)
+{
+  char* data;
+  Local<Object> buf = newReportBuffer(length, data);
+  memcpy(data, report, length);
+  return buf;
+}
+
+// Report timestamps are passed to JavaScript as milliseconds on the
+// clock of uv_hrtime() and process.hrtime(), which keeps microsecond
+// resolution in a double
+static Local<Number>
+timestampToJS(uint64_t time)
+{
+  return NanNew<Number>(time / 1e6);
+}
+
 class HID
   : public ObjectWrap
 {
 public:
   static void Initialize(Handle<Object> target);
   static NAN_METHOD(devices);
+  static NAN_METHOD(devicesAsync);
+  static NAN_METHOD(openAsync);
+  static NAN_METHOD(setDevicesCacheTimeout);
+  static NAN_METHOD(captureStart);
+  static NAN_METHOD(captureStop);
+  static NAN_METHOD(hotplugStart);
+  static NAN_METHOD(hotplugStop);
+  static NAN_METHOD(parseReportDescriptor);
 
-  typedef vector<unsigned char> databuf_t;
-
-  void write(const databuf_t& message)
-    throw(JSException);
+  void write(const unsigned char* data, size_t length);
+  void getReportDescriptor(vector<unsigned char>& descriptor);
   void close();
-  void setNonBlocking(int message)
-    throw(JSException);
+  // Waits until the reads still finishing after close() are done
+  void waitForHandleUsers();
+  void setNonBlocking(int message);
 
 private:
   HID(unsigned short vendorId, unsigned short productId, wchar_t* serialNumber = 0);
   HID(const char* path);
-  ~HID() { close(); }
+  HID(hid_device* handle, const string& path);
+  ~HID();
+
+  // Threadpool work using the device brackets itself with these and
+  // uses the handle acquireHandle() returns, which is 0 once the
+  // device has been closed.  close() does not wait for such work,
+  // the last of it closes the handle instead.
+  hid_device* acquireHandle();
+  void releaseHandle();
+  // One thread at a time reads the device: the streaming reader, the
+  // prefetcher or a threadpool read.  Reader threads are told to stop
+  // rather than waited for, so whichever reads next waits here for up
+  // to timeout milliseconds for them to finish their last read.
+  // Returns whether the input was claimed.
+  bool claimInput(int timeout);
+  void releaseInput();
+  int readCancellable(hid_device* handle, unsigned int generation, unsigned char* data, size_t length,
+                      uint64_t& time, bool& cancelled);
+  int readQueued(hid_device* handle, unsigned char* data, size_t length, uint64_t& time);
+  void cancelReads();
+
+  // hidapi cannot interrupt a blocked read, so reads from the device
+  // wait in slices of this length for reports, checking for
+  // cancellation in between.  A reader thread that is stopped
+  // finishes its slice on its own and is joined on the threadpool.
+  // Reads from the input queue are woken up right away instead.
+  static const int readPollInterval = 50; // ms
+  static const int queueWaitInterval = 1000; // ms
 
   static NAN_METHOD(New);
   static NAN_METHOD(read);
+  static NAN_METHOD(cancelReads);
+  static NAN_METHOD(readBatch);
   static NAN_METHOD(write);
   static NAN_METHOD(close);
   static NAN_METHOD(setNonBlocking);
   static NAN_METHOD(getFeatureReport);
 
   static NAN_METHOD(sendFeatureReport);
+  static NAN_METHOD(getFeatureReportAsync);
+  static NAN_METHOD(sendFeatureReportAsync);
+  static NAN_METHOD(transact);
+  static NAN_METHOD(readStart);
+  static NAN_METHOD(readStop);
+  static NAN_METHOD(readPause);
+  static NAN_METHOD(readResume);
+  static NAN_METHOD(readLatestStart);
+  static NAN_METHOD(readLatest);
+  static NAN_METHOD(writeAsync);
+  static NAN_METHOD(writeQueueDepth);
+  static NAN_METHOD(setPipelineDepth);
+  static NAN_METHOD(periodicStart);
+  static NAN_METHOD(periodicUpdate);
+  static NAN_METHOD(periodicStop);
+  static NAN_METHOD(stats);
+  static NAN_METHOD(setFilter);
+  static NAN_METHOD(getReportDescriptor);
 
 
   static void recvAsync(uv_work_t* req);
+  static void recvBatchAsync(uv_work_t* req);
   static void recvAsyncDone(uv_work_t* req);
 
+  static void readerThread(void* arg);
+  static NAUV_WORK_CB(readerWakeup);
+  static TIMER_CB(readerTimer);
+  static void readerClosed(uv_handle_t* handle);
+
+  static void writerThread(void* arg);
+  static NAUV_WORK_CB(writerWakeup);
+  static void writerClosed(uv_handle_t* handle);
+
 
   struct ReceiveIOCB {
-    ReceiveIOCB(HID* hid, NanCallback *callback)
+    ReceiveIOCB(HID* hid, NanCallback *callback, size_t maxReports = 0)
       : _hid(hid),
         _callback(callback),
-        _error(0)
+        _error(0),
+        _maxReports(maxReports),
+        _queued(uv_hrtime()),
+        _received(0),
+        _generation(hid->_readGeneration),
+        _cancelled(false)
     {}
 
     ~ReceiveIOCB()
@@ -106,68 +364,759 @@ private:
     NanCallback *_callback;
     JSException* _error;
     vector<unsigned char> _data;
+    // Batched reads only: number of reports to read at most and the
+    // start offset of each report in _data, followed by its end
+    size_t _maxReports;
+    vector<size_t> _offsets;
+    // uv_hrtime() of queueing the read and of the first report
+    // arriving, and for batched reads, of each report arriving
+    uint64_t _queued;
+    uint64_t _received;
+    vector<uint64_t> _times;
+    // Value of _readGeneration when the read was queued; the read is
+    // cancelled once it changes
+    unsigned int _generation;
+    bool _cancelled;
   };
 
   void readResultsToJSCallbackArguments(ReceiveIOCB* iocb, Local<Value> argv[]);
 
+  static void getFeatureReportAsync(uv_work_t* req);
+  static void sendFeatureReportAsync(uv_work_t* req);
+  static void featureReportAsyncDone(uv_work_t* req);
+
+  struct FeatureReportIOCB {
+    FeatureReportIOCB(HID* hid, NanCallback *callback)
+      : _hid(hid),
+        _callback(callback),
+        _report(0),
+        _hint(0),
+        _result(0)
+    {}
+
+    HID* _hid;
+    NanCallback *_callback;
+    // Report to send, or pooled memory receiving the report to get
+    vector<unsigned char> _data;
+    char* _report;
+    void* _hint;
+    size_t _length;
+    int _result;
+  };
+
+  struct Reader;
+  struct Writer;
+
+  // What the streaming reader does with a report that doesn't fit
+  // into its ring
+  enum OverflowPolicy {
+    dropNewest,
+    dropOldest,
+    pauseReader // stop reading, leaving reports queued in the OS
+  };
+
+#ifdef HID_DRIVER_HIDRAW
+  // Reads a streaming device's hidraw descriptor from the shared
+  // epoll thread instead of a reader thread of its own
+  struct PolledInput
+    : public HidrawPoller::Client
+  {
+    PolledInput(Reader* reader) : _reader(reader) {}
+    bool readable(int fd);
+
+    Reader* _reader;
+  };
+#endif
+
+  // State of the streaming mode, in which a dedicated thread reads
+  // reports into a ring and wakes up the event loop through one
+  // uv_async_t.  In the conflating mode, the ring is replaced by the
+  // latest report of each report ID, delivered at most once per
+  // interval.  Deleted when its handles have been closed.
+  struct Reader {
+    Reader(HID* hid, NanCallback* callback, size_t maxBatch,
+           size_t capacity = readerRingCapacity, OverflowPolicy overflow = dropNewest,
+           LatestReports* latest = 0, unsigned int interval = 0)
+      : _hid(hid),
+        _callback(callback),
+        _maxBatch(maxBatch),
+        _handle(0),
+        _ring(capacity, readerSlotSize),
+        _overflow(overflow),
+        _running(true),
+        _error(false),
+        _held(false),
+        _latest(latest),
+        _interval(interval),
+        _lastDelivery(0),
+        _timerPending(false),
+        _openHandles(0)
+#ifdef HID_DRIVER_HIDRAW
+        , _fd(-1),
+        _input(this)
+#endif
+    {
+      uv_mutex_init(&_ringLock);
+      uv_cond_init(&_spaceAvailable);
+    }
+
+    ~Reader()
+    {
+      delete _callback;
+      delete _latest;
+      uv_cond_destroy(&_spaceAvailable);
+      uv_mutex_destroy(&_ringLock);
+    }
+
+    // Called from the reading thread: where to read the next report
+    // into, or 0 to read it into scratch memory of readerSlotSize
+    unsigned char* reserve()
+    {
+      return _latest ? 0 : _ring.reserve();
+    }
+    // Called from the reading thread for each report read into slot,
+    // which is 0 if the ring was full and the report was read into
+    // scratch memory instead, at uv_hrtime() time.  Reports from the
+    // input queue have already been captured and offered to
+    // transactions, and are not fresh.  Returns whether JS needs
+    // waking up.
+    bool received(unsigned char* slot, const unsigned char* data, size_t length, uint64_t time, bool fresh = true);
+    // Called from the reader thread under the pause policy, returns
+    // once JS has made room in the ring or the reader is stopped
+    void waitForSpace();
+
+    // The JS thread brackets copying reports out of the ring with
+    // these, passing the number of reports to release to the latter.
+    // Under the drop-oldest policy, this keeps the producer from
+    // discarding reports while they are being copied.
+    void beginDelivery()
+    {
+      if (_overflow == dropOldest) {
+        uv_mutex_lock(&_ringLock);
+      }
+    }
+    void endDelivery(size_t count);
+
+    static const size_t readerRingCapacity = 256;
+    static const size_t maxRingCapacity = 65536;
+    static const size_t readerSlotSize = 1024;
+
+    HID* _hid;
+    NanCallback* _callback;
+    size_t _maxBatch; // 0 delivers one report per callback
+    uv_thread_t _thread;
+    hid_device* _handle; // acquired for _thread
+    uv_async_t _async;
+    ReportRing _ring;
+    OverflowPolicy _overflow;
+    // Taken by the producer to drop the oldest report or to wait for
+    // space, depending on _overflow
+    uv_mutex_t _ringLock;
+    uv_cond_t _spaceAvailable;
+    std::atomic<bool> _running;
+    std::atomic<bool> _error;
+    // JS thread only: reports stay in the ring while set, see readPause
+    bool _held;
+    // Conflating mode only
+    LatestReports* _latest;
+    unsigned int _interval; // ms
+    uint64_t _lastDelivery; // uv_hrtime()
+    uv_timer_t _timer;
+    bool _timerPending;
+    int _openHandles;
+#ifdef HID_DRIVER_HIDRAW
+    // Descriptor polled instead of running _thread, or -1
+    int _fd;
+    PolledInput _input;
+#endif
+  };
+
+  void startReader(Reader* reader);
+  void stopReader();
+  void deliverReports();
+  // Moves the reports the prefetcher has read ahead into the reader,
+  // returns whether JS needs waking up
+  bool takeQueued(Reader* reader);
+  static void readReports(Reader* reader);
+
+  // With an input queue, a thread of its own reads ahead into it
+  // whenever the streaming reader is not running, so that reports
+  // wait there rather than in the driver's much smaller queue
+  void setInputQueue(size_t capacity);
+  void startPrefetching();
+  void stopPrefetching();
+  // Back to prefetching after a reader failed to start
+  void resumePrefetching();
+  bool prefetching() const { return _prefetching && !_prefetchFailed; }
+  static void prefetchThread(void* arg);
+  static NAN_METHOD(setInputQueue);
+
+  struct Prefetcher {
+    Prefetcher(HID* hid, hid_device* handle)
+      : _hid(hid),
+        _handle(handle),
+        _running(true)
+    {}
+
+    HID* _hid;
+    hid_device* _handle; // acquired for the thread
+    uv_thread_t _thread;
+    std::atomic<bool> _running;
+  };
+
+  // A reader, prefetcher or writer thread that has been told to stop,
+  // joined on the threadpool.  Afterwards, the reader's uv_async_t is
+  // closed, the prefetcher deleted and the writer's queued commands
+  // cancelled.
+  struct ExitingThread {
+    ExitingThread(uv_thread_t thread, Reader* reader, Prefetcher* prefetcher, Writer* writer)
+      : _thread(thread),
+        _reader(reader),
+        _prefetcher(prefetcher),
+        _writer(writer)
+    {
+      _req.data = this;
+    }
+
+    uv_work_t _req;
+    uv_thread_t _thread;
+    Reader* _reader;
+    Prefetcher* _prefetcher;
+    Writer* _writer;
+  };
+  static void joinLater(ExitingThread* exiting);
+  static void joinThread(uv_work_t* req);
+  static void threadJoined(uv_work_t* req);
+
+  // Applies _threadPolicy to a native thread of the device that has
+  // just been started
+  void scheduleThread(uv_thread_t thread);
+  static NAN_METHOD(setThreadPolicy);
+  bool deliverBatch(Reader* reader);
+  void deliverLatest(Reader* reader);
+
+  // What the writer thread does with a command
+  enum CommandKind {
+    outputReport,
+    featureReport,
+    transaction // an output report followed by waiting for the reply
+  };
+
+  // Commands are sent strictly in the order of these classes, and in
+  // the order they were queued within each class
+  enum Priority {
+    priorityControl,
+    priorityNormal,
+    priorityBulk,
+    priorityClasses
+  };
+
+  static Priority priorityFromJS(Handle<Value> value);
+  static uint64_t deadlineFromJS(Handle<Value> value);
+
+  struct WriteRequest {
+    CommandKind _kind;
+    Priority _priority;
+    vector<unsigned char> _data;
+    NanCallback* _callback;
+    int _result;
+    const char* _failure; // set by the writer thread if _result is no use
+    bool _cancelled;
+    bool _expired;  // the deadline passed before the command was sent
+    bool _timedOut; // transactions only: no reply in time
+    uint64_t _queued;   // uv_hrtime() of queueCommand()
+    uint64_t _deadline; // uv_hrtime() from which it isn't sent, or 0
+    // Transactions only
+    unsigned int _timeout; // ms
+    uint64_t _sent;
+    uint64_t _replyDeadline;
+    ReplyMatcher::Transaction _transaction;
+  };
+
+  // An output report the writer thread sends at a fixed rate, see
+  // periodicStart().  Updates in between only change what is sent
+  // next.
+  struct PeriodicOutput {
+    vector<unsigned char> _data;
+    uint64_t _interval; // ns
+    uint64_t _due;      // uv_hrtime() of the next send
+    bool _changesOnly;  // skip sends while _data is what was last sent
+    bool _changed;
+
+    // Unchanged outputs that skip sends don't wake the writer up
+    bool waiting() const { return !_changesOnly || _changed; }
+  };
+
+  // Command scheduler: per priority queues of asynchronous writes and
+  // transactions and the thread sending them.  Up to pipelineDepth
+  // transactions may wait for their replies at a time while other
+  // commands go on.  Periodic outputs go before everything else when
+  // they are due.  Like the Reader, it is deleted once its async
+  // handle is closed, which happens after the results of all
+  // commands have been delivered.
+  struct Writer {
+    Writer(HID* hid, hid_device* handle)
+      : _hid(hid),
+        _handle(handle),
+        _stopping(false),
+        _joined(false),
+        _lastPeriodicId(0),
+        _depth(0)
+    {
+      uv_mutex_init(&_lock);
+      uv_cond_init(&_wakeup);
+    }
+
+    ~Writer()
+    {
+      for (deque<WriteRequest*>::iterator i = _free.begin(); i != _free.end(); i++) {
+        delete *i;
+      }
+      uv_cond_destroy(&_wakeup);
+      uv_mutex_destroy(&_lock);
+    }
+
+    // Called with _lock held: whether anything is queued, and the
+    // command to send next, if any may be sent.  Commands whose
+    // deadline has passed by the time they are due are moved to
+    // _done instead.
+    bool hasPending() const;
+    WriteRequest* next(uint64_t now, size_t pipelineDepth, DeviceStats& stats);
+    // Also with _lock held: when the next periodic output is due, or
+    // noneDue, and the report to send now, if any.  Copies it into
+    // data and returns when it was due.
+    uint64_t nextDue() const;
+    uint64_t takeDue(uint64_t now, vector<unsigned char>& data, DeviceStats& stats);
+
+    static const uint64_t noneDue = ~(uint64_t) 0;
+
+    HID* _hid;
+    hid_device* _handle; // acquired for _thread
+    uv_thread_t _thread;
+    uv_async_t _async;
+    uv_mutex_t _lock;
+    uv_cond_t _wakeup;
+    // _pending and _done are protected by _lock
+    deque<WriteRequest*> _pending[priorityClasses];
+    deque<WriteRequest*> _done;
+    bool _stopping;
+    // JS thread only: set once a stopped writer's thread has exited
+    bool _joined;
+    map<unsigned int, PeriodicOutput> _periodic;
+    unsigned int _lastPeriodicId;
+    // Writer thread only: transactions waiting for their reply
+    deque<WriteRequest*> _outstanding;
+    // JS thread only: recycled requests and the number of writes
+    // whose callback has not been called yet
+    deque<WriteRequest*> _free;
+    size_t _depth;
+  };
+
+  // Starts the writer on first use and returns a recycled request to
+  // fill in and pass to queueCommand(), which returns the number of
+  // commands whose callback is yet to be called
+  WriteRequest* newCommand(CommandKind kind, const ReportData& message, Priority priority,
+                           uint64_t deadline, Local<Function> callback);
+  Writer* startWriter();
+  size_t queueCommand(WriteRequest* request);
+  void stopWriter();
+  // Once a stopped writer's thread has been joined, cancels the
+  // commands still queued and calls them back
+  static void cancelQueued(Writer* writer);
+  // Writer thread: sends a command, waits a little for replies to
+  // the transactions outstanding and hands on those that are done
+  void sendCommand(Writer* writer, WriteRequest* request);
+  void awaitReplies(Writer* writer);
+  void finishTransactions(Writer* writer, bool cancel);
+
+  // Slice in which the writer thread waits for replies, checking for
+  // commands to send in between
+  static const int replyPollInterval = 1; // ms
+  void deliverWriteResults(Writer* writer);
+
   hid_device* _hidHandle;
+  string _path; // empty if opened by vendor and product ID
+  DeviceStats _stats;
+  ReportFilter _filter;
+  Reader* _reader;
+  Writer* _writer;
+  // Set on the JS thread, read by threadpool reads
+  std::atomic<bool> _nonBlocking;
+  // Protects _hidHandle against closing while threadpool work uses it
+  uv_mutex_t _handleLock;
+  uv_cond_t _handleReleased;
+  unsigned int _handleUsers;
+  // Set while a thread reads the device, see claimInput()
+  bool _inputClaimed;
+  uv_cond_t _inputReleased;
+  // Held around every write and feature report transfer.  hidapi does
+  // not promise that one device may be written by two threads at
+  // once, and the writer thread runs alongside synchronous writes.
+  uv_mutex_t _outputLock;
+  // Let go of by close() while still in use, closed by the last user
+  hid_device* _orphanedHandle;
+  std::atomic<unsigned int> _readGeneration;
+  // Set once the device is being closed
+  std::atomic<bool> _releasing;
+  // Replies to transactions in flight are taken out of the input
+  // here, whichever thread reads them
+  ReplyMatcher _replies;
+  // Set while the streaming reader or the prefetcher owns the input
+  // and passes replies on to transactions
+  std::atomic<bool> _streaming;
+  // Created by setInputQueue() and kept until the device goes away
+  InputQueue* _inputQueue;
+  Prefetcher* _prefetcher; // 0 unless prefetching
+  std::atomic<bool> _prefetching; // set while _prefetcher should run
+  std::atomic<bool> _prefetchFailed; // set by _prefetcher on read errors
+  // Transactions the device may have outstanding at a time
+  std::atomic<unsigned int> _pipelineDepth;
+  // Reports read and written show up in capture logs under this
+  CaptureSource _capture;
+  // Scheduling of the reader, writer and prefetcher threads
+  ThreadPolicy _threadPolicy;
+};
+
+#ifdef HID_DRIVER_HIDRAW
+static HidrawPoller hidrawPoller;
+#endif
+
+// //////////////////////////////////////////////////////////////////
+// Devices opened by HID.openAsync() wait here until the HID
+// constructor is passed their id
+// //////////////////////////////////////////////////////////////////
+struct ParkedDevice
+{
+  hid_device* _handle;
+  string _path;
 };
 
+// everything below is protected by hidapiMutex()
+static map<unsigned int, ParkedDevice> parkedDevices;
+static unsigned int lastParkedId = 0;
+
+static unsigned int
+parkDevice(hid_device* handle, const string& path)
+{
+  uv_mutex_lock(hidapiMutex());
+  unsigned int id = ++lastParkedId;
+  ParkedDevice& device = parkedDevices[id];
+  device._handle = handle;
+  device._path = path;
+  uv_mutex_unlock(hidapiMutex());
+  return id;
+}
+
+static void
+exitHidapi()
+{
+  uv_mutex_lock(hidapiMutex());
+#ifdef HID_DRIVER_HIDRAW
+  hidrawPoller.stop();
+#endif
+  // Opened, but never handed to a HID object
+  for (map<unsigned int, ParkedDevice>::iterator i = parkedDevices.begin(); i != parkedDevices.end(); i++) {
+    hid_close(i->second._handle);
+  }
+  parkedDevices.clear();
+  if (hid_exit()) {
+    cerr << "cannot shut down hidapi (hid_exit failed)" << endl;
+    abort();
+  }
+  uv_mutex_unlock(hidapiMutex());
+}
+
 HID::HID(unsigned short vendorId, unsigned short productId, wchar_t* serialNumber)
+  : _reader(0),
+    _writer(0),
+    _nonBlocking(false),
+    _handleUsers(0),
+    _inputClaimed(false),
+    _orphanedHandle(0),
+    _readGeneration(0),
+    _releasing(false),
+    _streaming(false),
+    _inputQueue(0),
+    _prefetcher(0),
+    _prefetching(false),
+    _prefetchFailed(false),
+    _pipelineDepth(1),
+    _capture(_path)
 {
-  _hidHandle = hid_open(vendorId, productId, serialNumber);
+  _hidHandle = openDevice(vendorId, productId, serialNumber);
 
   if (!_hidHandle) {
     ostringstream os;
     os << "cannot open device with vendor id 0x" << hex << vendorId << " and product id 0x" << productId;
     throw JSException(os.str());
   }
+  uv_mutex_init(&_handleLock);
+  uv_cond_init(&_handleReleased);
+  uv_cond_init(&_inputReleased);
+  uv_mutex_init(&_outputLock);
+  addonState->_devices.insert(this);
 }
 
 HID::HID(const char* path)
+  : _path(path),
+    _reader(0),
+    _writer(0),
+    _nonBlocking(false),
+    _handleUsers(0),
+    _inputClaimed(false),
+    _orphanedHandle(0),
+    _readGeneration(0),
+    _releasing(false),
+    _streaming(false),
+    _inputQueue(0),
+    _prefetcher(0),
+    _prefetching(false),
+    _prefetchFailed(false),
+    _pipelineDepth(1),
+    _capture(_path)
 {
-  _hidHandle = hid_open_path(path);
+  _hidHandle = openDevice(path);
 
   if (!_hidHandle) {
     ostringstream os;
     os << "cannot open device with path " << path;
     throw JSException(os.str());
   }
+  uv_mutex_init(&_handleLock);
+  uv_cond_init(&_handleReleased);
+  uv_cond_init(&_inputReleased);
+  uv_mutex_init(&_outputLock);
+  addonState->_devices.insert(this);
 }  
 
+// Takes over a device opened by HID.openAsync()
+HID::HID(hid_device* handle, const string& path)
+  : _hidHandle(handle),
+    _path(path),
+    _reader(0),
+    _writer(0),
+    _nonBlocking(false),
+    _handleUsers(0),
+    _inputClaimed(false),
+    _orphanedHandle(0),
+    _readGeneration(0),
+    _releasing(false),
+    _streaming(false),
+    _inputQueue(0),
+    _prefetcher(0),
+    _prefetching(false),
+    _prefetchFailed(false),
+    _pipelineDepth(1),
+    _capture(_path)
+{
+  hid_set_nonblocking(_hidHandle, 0);
+  uv_mutex_init(&_handleLock);
+  uv_cond_init(&_handleReleased);
+  uv_cond_init(&_inputReleased);
+  uv_mutex_init(&_outputLock);
+  addonState->_devices.insert(this);
+}
+
+HID::~HID()
+{
+  close();
+  // Objects collected while the addon is torn down outlive it
+  if (addonState) {
+    addonState->_devices.erase(this);
+  }
+  // A stopped prefetcher or writer may still be finishing its last
+  // read or write
+  waitForHandleUsers();
+  delete _inputQueue;
+  uv_mutex_destroy(&_outputLock);
+  uv_cond_destroy(&_inputReleased);
+  uv_cond_destroy(&_handleReleased);
+  uv_mutex_destroy(&_handleLock);
+}
+
 void
 HID::close()
 {
-  if (_hidHandle) {
-    hid_close(_hidHandle);
-    _hidHandle = 0;
+  stopReader();
+  stopPrefetching();
+  stopWriter();
+  if (!_hidHandle) {
+    return;
+  }
+  // Reads and feature report transfers in flight go on without
+  // holding up the JS thread, the last of them closes the handle
+  cancelReads();
+  _releasing = true;
+  uv_mutex_lock(&_handleLock);
+  hid_device* handle = _hidHandle;
+  _hidHandle = 0;
+  if (_handleUsers) {
+    _orphanedHandle = handle;
+    handle = 0;
+  }
+  uv_mutex_unlock(&_handleLock);
+  if (handle) {
+    hid_close(handle);
+  }
+}
+
+hid_device*
+HID::acquireHandle()
+{
+  uv_mutex_lock(&_handleLock);
+  hid_device* handle = _hidHandle;
+  if (handle) {
+    _handleUsers++;
+  }
+  uv_mutex_unlock(&_handleLock);
+  return handle;
+}
+
+void
+HID::releaseHandle()
+{
+  hid_device* orphaned = 0;
+  uv_mutex_lock(&_handleLock);
+  if (!--_handleUsers) {
+    uv_cond_signal(&_handleReleased);
+    orphaned = _orphanedHandle;
+    _orphanedHandle = 0;
+  }
+  uv_mutex_unlock(&_handleLock);
+  if (orphaned) {
+    hid_close(orphaned);
+  }
+}
+
+void
+HID::waitForHandleUsers()
+{
+  uv_mutex_lock(&_handleLock);
+  while (_handleUsers) {
+    uv_cond_wait(&_handleReleased, &_handleLock);
+  }
+  uv_mutex_unlock(&_handleLock);
+}
+
+bool
+HID::claimInput(int timeout)
+{
+  uv_mutex_lock(&_handleLock);
+  if (_inputClaimed && timeout > 0) {
+    uv_cond_timedwait(&_inputReleased, &_handleLock, (uint64_t) timeout * 1000000);
+  }
+  bool claimed = !_inputClaimed;
+  _inputClaimed = true;
+  uv_mutex_unlock(&_handleLock);
+  return claimed;
+}
+
+void
+HID::releaseInput()
+{
+  uv_mutex_lock(&_handleLock);
+  _inputClaimed = false;
+  uv_cond_broadcast(&_inputReleased);
+  uv_mutex_unlock(&_handleLock);
+}
+
+void
+HID::cancelReads()
+{
+  _readGeneration++;
+  if (_inputQueue) {
+    _inputQueue->interrupt();
+  }
+}
+
+// Like hid_read(), but gives up with cancelled set once cancelReads()
+// has been called after the read was queued.  Returns reports in the
+// input queue first, and leaves out replies to transactions.  Sets
+// time to when the report was received.
+int
+HID::readCancellable(hid_device* handle, unsigned int generation, unsigned char* data, size_t length,
+                     uint64_t& time, bool& cancelled)
+{
+  int len;
+  while (true) {
+    bool prefetched = prefetching();
+    if (_inputQueue
+        && (len = _inputQueue->pop(data, length, prefetched && !_nonBlocking ? queueWaitInterval : 0, time,
+                                   &_readGeneration, generation))) {
+      return len;
+    }
+    if (!prefetched) {
+      len = 0;
+      if (claimInput(_nonBlocking ? 0 : readPollInterval)) {
+        len = _nonBlocking
+          ? hid_read(handle, data, length)
+          : hid_read_timeout(handle, data, length, readPollInterval);
+        releaseInput();
+      }
+      if (len > 0) {
+        time = uv_hrtime();
+        _capture.record(CaptureFormat::input, data, len);
+        if (_replies.offer(data, len, time)) {
+          continue;
+        }
+        return len;
+      }
+    }
+    if (len || _nonBlocking) {
+      break;
+    }
+    if (_readGeneration != generation) {
+      cancelled = true;
+      break;
+    }
+  }
+  time = uv_hrtime();
+  return len;
+}
+
+// Returns a report that is already queued without waiting, like
+// readCancellable() does otherwise
+int
+HID::readQueued(hid_device* handle, unsigned char* data, size_t length, uint64_t& time)
+{
+  int len = _inputQueue ? _inputQueue->pop(data, length, 0, time) : 0;
+  if (len) {
+    return len;
+  }
+  // Whoever reads the device at the moment takes the reports
+  if (prefetching() || !claimInput(0)) {
+    return 0;
+  }
+  while ((len = hid_read_timeout(handle, data, length, 0)) > 0) {
+    time = uv_hrtime();
+    _capture.record(CaptureFormat::input, data, len);
+    if (!_replies.offer(data, len, time)) {
+      break;
+    }
   }
+  releaseInput();
+  return len;
 }
 
 void
 HID::setNonBlocking(int message)
-  throw(JSException)
 {
   int res;
   res = hid_set_nonblocking(_hidHandle, message);
   if (res < 0) {
     throw JSException("Error setting non-blocking mode.");
   }
+  _nonBlocking = message != 0;
 }
 
 void
-HID::write(const databuf_t& message)
-  throw(JSException)
+HID::write(const unsigned char* data, size_t length)
 {
-  //unsigned char buf[message.size()];
-  unsigned char* buf = new unsigned char[message.size()];
-  unsigned char* p = buf;
-  int res;
-  for (vector<unsigned char>::const_iterator i = message.begin(); i != message.end(); i++) {
-    *p++ = *i;
-  }
-  res = hid_write(_hidHandle, buf, message.size());
-  delete[] buf;
+  _capture.record(CaptureFormat::output, data, length);
+  uv_mutex_lock(&_outputLock);
+  int res = hid_write(_hidHandle, data, length);
+  uv_mutex_unlock(&_outputLock);
+  _stats.countWrite(res);
   if (res < 0) {
     throw JSException("Cannot write to HID device");
   }
@@ -178,36 +1127,117 @@ HID::recvAsync(uv_work_t* req)
 {
   ReceiveIOCB* iocb = static_cast<ReceiveIOCB*>(req->data);
   HID* hid = iocb->_hid;
+  hid->_stats._queueWait.record(uv_hrtime() - iocb->_queued);
+  hid_device* handle = hid->acquireHandle();
+  if (!handle) {
+    iocb->_cancelled = true;
+    return;
+  }
 
-  unsigned char buf[1024];
-  int len = hid_read(hid->_hidHandle, buf, sizeof buf);
-  if (len < 0) {
+  iocb->_data.resize(1024);
+  int len;
+  while ((len = hid->readCancellable(handle, iocb->_generation, &iocb->_data[0], iocb->_data.size(),
+                                     iocb->_received, iocb->_cancelled)) > 0
+         && !hid->_filter.accept(&iocb->_data[0], len)) {
+    hid->_stats._filteredReports++;
+  }
+  hid->releaseHandle();
+  if (iocb->_cancelled) {
+    iocb->_data.clear();
+  } else if (len < 0) {
+    hid->_stats._readErrors++;
     iocb->_error = new JSException("could not read from HID device");
   } else {
-    iocb->_data = vector<unsigned char>(buf, buf + len);
+    hid->_stats.countRead(len);
+    iocb->_data.resize(len);
+  }
+}
+
+void
+HID::recvBatchAsync(uv_work_t* req)
+{
+  ReceiveIOCB* iocb = static_cast<ReceiveIOCB*>(req->data);
+  HID* hid = iocb->_hid;
+  hid->_stats._queueWait.record(uv_hrtime() - iocb->_queued);
+  hid_device* handle = hid->acquireHandle();
+  if (!handle) {
+    iocb->_cancelled = true;
+    return;
+  }
+
+  // Wait for the first report like read() does, then pick up
+  // whatever else is already queued without blocking again.  Reports
+  // are read straight into the batch buffer.
+  const size_t maxReportSize = 1024;
+  int len = 0;
+  do {
+    size_t offset = iocb->_data.size();
+    uint64_t time;
+    iocb->_data.resize(offset + maxReportSize);
+    if (iocb->_offsets.empty()) {
+      len = hid->readCancellable(handle, iocb->_generation, &iocb->_data[offset], maxReportSize, time, iocb->_cancelled);
+    } else {
+      len = hid->readQueued(handle, &iocb->_data[offset], maxReportSize, time);
+    }
+    iocb->_data.resize(offset + (len > 0 ? len : 0));
+    if (len > 0 && !hid->_filter.accept(&iocb->_data[offset], len)) {
+      // Keeps waiting if it was to be the first report
+      iocb->_data.resize(offset);
+      hid->_stats._filteredReports++;
+      continue;
+    }
+    if (len > 0) {
+      iocb->_times.push_back(time);
+      if (iocb->_offsets.empty()) {
+        iocb->_received = iocb->_times.back();
+      }
+      iocb->_offsets.push_back(offset);
+      hid->_stats.countRead(len);
+    }
+  } while (len > 0 && iocb->_offsets.size() < iocb->_maxReports);
+  hid->releaseHandle();
+
+  if (len < 0) {
+    hid->_stats._readErrors++;
+  }
+  if (len < 0 && iocb->_offsets.empty()) {
+    iocb->_error = new JSException("could not read from HID device");
   }
+  iocb->_offsets.push_back(iocb->_data.size());
 }
 
 void
 HID::readResultsToJSCallbackArguments(ReceiveIOCB* iocb, Local<Value> argv[])
 {
-  if (iocb->_error) {
+  if (iocb->_cancelled) {
+    Local<Object> error = Exception::Error(NanNew<String>("read cancelled"))->ToObject();
+    error->Set(NanNew<String>("cancelled"), NanNew<Boolean>(true));
+    argv[0] = error;
+  } else if (iocb->_error) {
     argv[0] = Exception::Error(NanNew<String>(iocb->_error->message().c_str()));
   } else {
     const vector<unsigned char>& message = iocb->_data;
-    //Get "fast" node Buffer constructor
-    Local<Function> nodeBufConstructor = Local<Function>::Cast(
-      NanGetCurrentContext()->Global()->Get(NanNew<String>("Buffer") )
-    );
-    //Construct a new Buffer
-    Handle<Value> nodeBufferArgs[1] = { NanNew<Integer>((unsigned int) message.size()) };
-    Local<Object> buf = nodeBufConstructor->NewInstance(1, nodeBufferArgs);
-    char* data = Buffer::Data(buf);
-    int j = 0;
-    for (vector<unsigned char>::const_iterator k = message.begin(); k != message.end(); k++) {
-      data[j++] = *k;
+    char* data;
+    Local<Object> buf = newReportBuffer(message.size(), data);
+    if (!message.empty()) {
+      memcpy(data, &message[0], message.size());
     }
     argv[1] = buf;
+
+    if (iocb->_maxReports) {
+      Local<Array> offsets = NanNew<Array>(iocb->_offsets.size());
+      for (size_t i = 0; i < iocb->_offsets.size(); i++) {
+        offsets->Set(i, NanNew<Integer>((unsigned int) iocb->_offsets[i]));
+      }
+      Local<Array> timestamps = NanNew<Array>(iocb->_times.size());
+      for (size_t i = 0; i < iocb->_times.size(); i++) {
+        timestamps->Set(i, timestampToJS(iocb->_times[i]));
+      }
+      argv[2] = offsets;
+      argv[3] = timestamps;
+    } else {
+      argv[2] = timestampToJS(iocb->_received);
+    }
   }
 }
 
@@ -217,15 +1247,20 @@ HID::recvAsyncDone(uv_work_t* req)
   NanScope();
   ReceiveIOCB* iocb = static_cast<ReceiveIOCB*>(req->data);
 
-  Local<Value> argv[2];
+  Local<Value> argv[4];
   argv[0] = NanUndefined();
   argv[1] = NanUndefined();
+  argv[2] = NanUndefined();
+  argv[3] = NanUndefined();
 
   iocb->_hid->readResultsToJSCallbackArguments(iocb, argv);
+  if (!iocb->_error && !iocb->_cancelled) {
+    iocb->_hid->_stats._deliveryLatency.record(uv_hrtime() - iocb->_received);
+  }
   iocb->_hid->Unref();
 
   TryCatch tryCatch;
-  iocb->_callback->Call(2, argv);
+  iocb->_callback->Call(iocb->_maxReports ? 4 : 3, argv);
 
   if (tryCatch.HasCaught()) {
     FatalException(tryCatch);
@@ -246,6 +1281,10 @@ NAN_METHOD(HID::read)
   }
 
   HID* hid = ObjectWrap::Unwrap<HID>(args.This());
+  if (hid->_reader) {
+    NanThrowError("cannot read while the device is streaming");
+    NanReturnUndefined();
+  }
   hid->Ref();
 
   uv_work_t* req = new uv_work_t;
@@ -255,121 +1294,3242 @@ NAN_METHOD(HID::read)
   NanReturnUndefined();
 }
 
-NAN_METHOD(HID::getFeatureReport)
+NAN_METHOD(HID::cancelReads)
+{
+  NanScope();
+
+  // Pending read() and readBatch() calls complete with an error that
+  // has its cancelled property set, unless a report arrives first
+  HID* hid = ObjectWrap::Unwrap<HID>(args.This());
+  hid->cancelReads();
+  NanReturnUndefined();
+}
+
+NAN_METHOD(HID::readBatch)
 {
   NanScope();
 
   if (args.Length() != 2
-      || args[1]->ToUint32()->Value() == 0) {
-    NanThrowError("need report ID and non-zero length parameter in getFeatureReport");
+      || args[0]->ToUint32()->Value() == 0
+      || !args[1]->IsFunction()) {
+    NanThrowError("need non-zero report count and callback function arguments in readBatch");
+    NanReturnUndefined();
   }
 
-  const uint8_t reportId = args[0]->ToUint32()->Value();
   HID* hid = ObjectWrap::Unwrap<HID>(args.This());
-  const int bufSize = args[1]->ToUint32()->Value();
+  if (hid->_reader) {
+    NanThrowError("cannot read while the device is streaming");
+    NanReturnUndefined();
+  }
+  hid->Ref();
+
+  uv_work_t* req = new uv_work_t;
+  req->data = new ReceiveIOCB(hid, new NanCallback(Local<Function>::Cast(args[1])), args[0]->ToUint32()->Value());
+  uv_queue_work(uv_default_loop(), req, recvBatchAsync, (uv_after_work_cb)recvAsyncDone);
+
+  NanReturnUndefined();
+}
+
+void
+HID::startReader(Reader* reader)
+{
+  if (!_hidHandle || _reader) {
+    delete reader;
+    throw JSException(_reader ? "device is already streaming" : "cannot start streaming on a closed device");
+  }
+
+  uv_async_init(uv_default_loop(), &reader->_async, readerWakeup);
+  reader->_async.data = reader;
+  reader->_openHandles++;
+  if (reader->_latest) {
+    uv_timer_init(uv_default_loop(), &reader->_timer);
+    reader->_timer.data = reader;
+    reader->_openHandles++;
+  }
+
+  // The reader takes over the reports the prefetcher has read ahead
+  stopPrefetching();
+  if (takeQueued(reader)) {
+    uv_async_send(&reader->_async);
+  }
+
+#ifdef HID_DRIVER_HIDRAW
+  // Devices opened by path get a descriptor of their own for the
+  // poller; the kernel hands every input report to all of them.
+  // Pausing needs a thread that can stop reading, though, and a
+  // thread policy a thread of the device's own.
+  if (!_path.empty() && reader->_overflow != pauseReader && _threadPolicy.isDefault()) {
+    reader->_fd = ::open(_path.c_str(), O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+    if (reader->_fd >= 0 && !hidrawPoller.add(reader->_fd, &reader->_input)) {
+      ::close(reader->_fd);
+      reader->_fd = -1;
+    }
+  }
+  if (reader->_fd < 0)
+#endif
+  if (!(reader->_handle = acquireHandle())
+      || uv_thread_create(&reader->_thread, readerThread, reader)) {
+    if (reader->_handle) {
+      releaseHandle();
+    }
+    uv_close((uv_handle_t*) &reader->_async, readerClosed);
+    if (reader->_latest) {
+      uv_close((uv_handle_t*) &reader->_timer, readerClosed);
+    }
+    resumePrefetching();
+    throw JSException("cannot create reader thread");
+  }
+
+  _reader = reader;
+  _streaming = true;
+  Ref();
+#ifdef HID_DRIVER_HIDRAW
+  if (reader->_fd < 0)
+#endif
+  {
+    try {
+      scheduleThread(reader->_thread);
+    }
+    catch (const JSException&) {
+      stopReader();
+      resumePrefetching();
+      throw;
+    }
+  }
+}
+
+void
+HID::stopReader()
+{
+  Reader* reader = _reader;
+  if (!reader) {
+    return;
+  }
+
+  // Reports still in the ring are discarded along with the reader
+  _reader = 0;
+  bool polled = false;
+#ifdef HID_DRIVER_HIDRAW
+  if (reader->_fd >= 0) {
+    polled = true;
+    hidrawPoller.remove(&reader->_input);
+    ::close(reader->_fd);
+    // hidapi's descriptor has queued up the reports delivered while
+    // streaming, don't let read() return them a second time
+    unsigned char buf[Reader::readerSlotSize];
+    if (_hidHandle && claimInput(0)) {
+      while (hid_read_timeout(_hidHandle, buf, sizeof buf, 0) > 0)
+        ;
+      releaseInput();
+    }
+  } else
+#endif
+  {
+    // A paused reader waits for space in the ring
+    uv_mutex_lock(&reader->_ringLock);
+    reader->_running = false;
+    uv_cond_signal(&reader->_spaceAvailable);
+    uv_mutex_unlock(&reader->_ringLock);
+  }
+  _streaming = false;
+  if (reader->_latest) {
+    uv_timer_stop(&reader->_timer);
+    uv_close((uv_handle_t*) &reader->_timer, readerClosed);
+  }
+  if (polled) {
+    uv_close((uv_handle_t*) &reader->_async, readerClosed);
+    Unref();
+  } else {
+    // The thread notices within one poll interval, and may still wake
+    // up the loop until then.  The device stays referenced until it
+    // has been joined.
+    joinLater(new ExitingThread(reader->_thread, reader, 0, 0));
+  }
+}
+
+bool
+HID::takeQueued(Reader* reader)
+{
+  if (!_inputQueue) {
+    return false;
+  }
+  unsigned char overflow[Reader::readerSlotSize];
+  bool wake = false;
+  while (true) {
+    unsigned char* slot = reader->reserve();
+    unsigned char* data = slot ? slot : overflow;
+    uint64_t time;
+    int len = _inputQueue->pop(data, sizeof overflow, 0, time);
+    if (!len) {
+      break;
+    }
+    wake = reader->received(slot, data, len, time, false) || wake;
+  }
+  return wake;
+}
+
+void
+HID::joinLater(ExitingThread* exiting)
+{
+  uv_queue_work(uv_default_loop(), &exiting->_req, joinThread, (uv_after_work_cb)threadJoined);
+}
+
+void
+HID::joinThread(uv_work_t* req)
+{
+  ExitingThread* exiting = static_cast<ExitingThread*>(req->data);
+  uv_thread_join(&exiting->_thread);
+}
+
+void
+HID::threadJoined(uv_work_t* req)
+{
+  ExitingThread* exiting = static_cast<ExitingThread*>(req->data);
+  if (exiting->_reader) {
+    HID* hid = exiting->_reader->_hid;
+    uv_close((uv_handle_t*) &exiting->_reader->_async, readerClosed);
+    hid->Unref();
+  }
+  delete exiting->_prefetcher;
+  if (exiting->_writer) {
+    cancelQueued(exiting->_writer);
+  }
+  delete exiting;
+}
+
+void
+HID::readerThread(void* arg)
+{
+  Reader* reader = static_cast<Reader*>(arg);
+  HID* hid = reader->_hid;
+
+  // The prefetcher or an earlier reader may still be in its last read
+  bool claimed = false;
+  while (reader->_running && !(claimed = hid->claimInput(readPollInterval)))
+    ;
+  if (claimed) {
+    // Including what the prefetcher read while finishing
+    if (hid->takeQueued(reader)) {
+      uv_async_send(&reader->_async);
+    }
+    readReports(reader);
+    hid->releaseInput();
+  }
+  hid->releaseHandle();
+}
+
+void
+HID::readReports(Reader* reader)
+{
+  hid_device* handle = reader->_handle;
+  DeviceStats& stats = reader->_hid->_stats;
+  unsigned char overflow[Reader::readerSlotSize];
+
+  while (reader->_running) {
+    // When the JS side falls behind, keep draining the device into a
+    // scratch buffer unless told to leave the reports to the OS
+    unsigned char* slot = reader->reserve();
+    if (!slot && !reader->_latest && reader->_overflow == pauseReader) {
+      stats._readerPauses++;
+      reader->waitForSpace();
+      continue;
+    }
+    unsigned char* data = slot ? slot : overflow;
+    int len = hid_read_timeout(handle, data, Reader::readerSlotSize, readPollInterval);
+    uint64_t time = uv_hrtime();
+    if (len < 0) {
+      stats._readErrors++;
+      reader->_error = true;
+      uv_async_send(&reader->_async);
+      return;
+    }
+    if (len > 0 && reader->received(slot, data, len, time)) {
+      uv_async_send(&reader->_async);
+    }
+  }
+}
+
+bool
+HID::Reader::received(unsigned char* slot, const unsigned char* data, size_t length, uint64_t time, bool fresh)
+{
+  DeviceStats& stats = _hid->_stats;
+  if (fresh) {
+    _hid->_capture.record(CaptureFormat::input, data, length);
+    if (_hid->_replies.offer(data, length, time)) {
+      return false;
+    }
+  }
+  if (!_hid->_filter.accept(data, length, slot || _latest || _overflow == dropOldest)) {
+    stats._filteredReports++;
+    return false;
+  }
+  if (_latest) {
+    _latest->store(data, length, time);
+  } else if (slot) {
+    _ring.commit(length, time);
+  } else if (_overflow == dropOldest) {
+    // Either a report is dropped or JS has made room in the meantime
+    uv_mutex_lock(&_ringLock);
+    if (_ring.dropOldest()) {
+      stats._droppedReports++;
+    }
+    memcpy(_ring.reserve(), data, length);
+    _ring.commit(length, time);
+    uv_mutex_unlock(&_ringLock);
+  } else {
+    stats._droppedReports++;
+    return false;
+  }
+  stats.countRead(length);
+  return true;
+}
+
+void
+HID::Reader::waitForSpace()
+{
+  uv_mutex_lock(&_ringLock);
+  while (_running && !_ring.reserve()) {
+    uv_cond_wait(&_spaceAvailable, &_ringLock);
+  }
+  uv_mutex_unlock(&_ringLock);
+}
+
+void
+HID::Reader::endDelivery(size_t count)
+{
+  if (count) {
+    _ring.release(count);
+  }
+  if (_overflow == dropOldest) {
+    uv_mutex_unlock(&_ringLock);
+  } else if (_overflow == pauseReader && count) {
+    uv_mutex_lock(&_ringLock);
+    uv_cond_signal(&_spaceAvailable);
+    uv_mutex_unlock(&_ringLock);
+  }
+}
+
+#ifdef HID_DRIVER_HIDRAW
+bool
+HID::PolledInput::readable(int fd)
+{
+  Reader* reader = _reader;
+  DeviceStats& stats = reader->_hid->_stats;
+  unsigned char overflow[Reader::readerSlotSize];
+  bool received = false;
+
+  // Drain everything the kernel has queued, then wake up JS once
+  while (true) {
+    unsigned char* slot = reader->reserve();
+    ssize_t len = ::read(fd, slot ? slot : overflow, Reader::readerSlotSize);
+    if (len < 0 && errno == EINTR) {
+      continue;
+    }
+    if (len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      break;
+    }
+    if (len <= 0) {
+      stats._readErrors++;
+      reader->_error = true;
+      uv_async_send(&reader->_async);
+      return false;
+    }
+    if (reader->received(slot, slot ? slot : overflow, len, uv_hrtime())) {
+      received = true;
+    }
+  }
+
+  if (received) {
+    uv_async_send(&reader->_async);
+  }
+  return true;
+}
+#endif
+
+NAUV_WORK_CB(HID::readerWakeup)
+{
+  Reader* reader = static_cast<Reader*>(async->data);
+  // A stopped reader's thread may wake the loop until it is joined
+  if (reader->_hid->_reader == reader) {
+    reader->_hid->deliverReports();
+  }
+}
+
+TIMER_CB(HID::readerTimer)
+{
+  Reader* reader = static_cast<Reader*>(timer->data);
+  reader->_timerPending = false;
+  reader->_hid->deliverReports();
+}
+
+void
+HID::readerClosed(uv_handle_t* handle)
+{
+  Reader* reader = static_cast<Reader*>(handle->data);
+  if (!--reader->_openHandles) {
+    delete reader;
+  }
+}
+
+void
+HID::deliverReports()
+{
+  NanScope();
+  Reader* reader = _reader;
+
+  // Callbacks may stop streaming, close the device or hold back
+  // further reports, so check that this reader is still current
+  // before each report
+  size_t length;
+  uint64_t received;
+  const unsigned char* data;
+  if (reader->_latest) {
+    if (!reader->_held) {
+      deliverLatest(reader);
+    }
+  } else if (reader->_maxBatch) {
+    while (_reader == reader && !reader->_held && deliverBatch(reader))
+      ;
+  } else {
+    while (_reader == reader && !reader->_held) {
+      Local<Value> argv[3];
+      reader->beginDelivery();
+      if ((data = reader->_ring.peek(0, length, received))) {
+        argv[0] = NanUndefined();
+        argv[1] = newReportBuffer(data, length);
+        argv[2] = timestampToJS(received);
+      }
+      reader->endDelivery(data ? 1 : 0);
+      if (!data) {
+        break;
+      }
+      _stats._deliveryLatency.record(uv_hrtime() - received);
+
+      TryCatch tryCatch;
+      reader->_callback->Call(3, argv);
+
+      if (tryCatch.HasCaught()) {
+        FatalException(tryCatch);
+      }
+    }
+  }
+
+  if (_reader == reader && reader->_error) {
+    // The reader thread has already exited
+    stopReader();
+
+    Local<Value> argv[1];
+    argv[0] = Exception::Error(NanNew<String>("could not read from HID device"));
+
+    TryCatch tryCatch;
+    reader->_callback->Call(1, argv);
+
+    if (tryCatch.HasCaught()) {
+      FatalException(tryCatch);
+    }
+  }
+}
+
+bool
+HID::deliverBatch(Reader* reader)
+{
+  NanScope();
+
+  // Copy up to _maxBatch queued reports into one contiguous Buffer
+  size_t count = 0;
+  size_t total = 0;
+  size_t length;
+  reader->beginDelivery();
+  while (count < reader->_maxBatch && reader->_ring.peek(count, length)) {
+    total += length;
+    count++;
+  }
+  if (!count) {
+    reader->endDelivery(0);
+    return false;
+  }
+
+  char* p;
+  Local<Object> buf = newReportBuffer(total, p);
+  Local<Array> offsets = NanNew<Array>(count + 1);
+  Local<Array> timestamps = NanNew<Array>(count);
+  size_t offset = 0;
+  uint64_t now = uv_hrtime();
+  uint64_t received;
+  for (size_t i = 0; i < count; i++) {
+    const unsigned char* data = reader->_ring.peek(i, length, received);
+    memcpy(p + offset, data, length);
+    offsets->Set(i, NanNew<Integer>((unsigned int) offset));
+    timestamps->Set(i, timestampToJS(received));
+    offset += length;
+    _stats._deliveryLatency.record(now - received);
+  }
+  offsets->Set(count, NanNew<Integer>((unsigned int) offset));
+  reader->endDelivery(count);
+
+  Local<Value> argv[4];
+  argv[0] = NanUndefined();
+  argv[1] = buf;
+  argv[2] = offsets;
+  argv[3] = timestamps;
+
+  TryCatch tryCatch;
+  reader->_callback->Call(4, argv);
+
+  if (tryCatch.HasCaught()) {
+    FatalException(tryCatch);
+  }
+  return true;
+}
+
+void
+HID::deliverLatest(Reader* reader)
+{
+  NanScope();
+
+  // Deliveries closer together than the interval are postponed to
+  // its end, by which time more reports may have been overwritten
+  uint64_t now = uv_hrtime();
+  uint64_t interval = (uint64_t) reader->_interval * 1000000;
+  if (now - reader->_lastDelivery < interval) {
+    if (!reader->_timerPending) {
+      reader->_timerPending = true;
+      uv_timer_start(&reader->_timer, readerTimer, (interval - (now - reader->_lastDelivery)) / 1000000 + 1, 0);
+    }
+    return;
+  }
+  reader->_lastDelivery = now;
+
+  vector<unsigned char> reportIds;
+  reader->_latest->takeChanged(reportIds);
+  vector<unsigned char> report;
+  uint64_t received;
+  for (size_t i = 0; i < reportIds.size() && _reader == reader; i++) {
+    if (!reader->_latest->get(reportIds[i], report, received)) {
+      continue;
+    }
+    Local<Value> argv[3];
+    argv[0] = NanUndefined();
+    argv[1] = newReportBuffer(report.empty() ? 0 : &report[0], report.size());
+    argv[2] = timestampToJS(received);
+    _stats._deliveryLatency.record(uv_hrtime() - received);
+
+    TryCatch tryCatch;
+    reader->_callback->Call(3, argv);
+
+    if (tryCatch.HasCaught()) {
+      FatalException(tryCatch);
+    }
+  }
+}
+
+NAN_METHOD(HID::readStart)
+{
+  NanScope();
+
+  if (args.Length() < 1 || args.Length() > 4
+      || !args[0]->IsFunction()) {
+    NanThrowError("need callback function and optional batch size, capacity and overflow arguments in readStart");
+    NanReturnUndefined();
+  }
+
+  try {
+    HID* hid = ObjectWrap::Unwrap<HID>(args.This());
+    size_t maxBatch = args.Length() > 1 ? args[1]->ToUint32()->Value() : 0;
+    size_t capacity = Reader::readerRingCapacity;
+    if (args.Length() > 2 && !args[2]->IsUndefined()) {
+      capacity = args[2]->Uint32Value();
+      if (capacity < 1 || capacity > Reader::maxRingCapacity) {
+        throw JSException("ring capacity must be between 1 and 65536 reports");
+      }
+    }
+    OverflowPolicy overflow = dropNewest;
+    if (args.Length() > 3 && !args[3]->IsUndefined()) {
+      string policy = *NanUtf8String(args[3]);
+      if (policy == "drop-oldest") {
+        overflow = dropOldest;
+      } else if (policy == "pause") {
+        overflow = pauseReader;
+      } else if (policy != "drop-newest") {
+        throw JSException("overflow policy must be \"drop-newest\", \"drop-oldest\" or \"pause\"");
+      }
+    }
+    hid->startReader(new Reader(hid, new NanCallback(Local<Function>::Cast(args[0])), maxBatch, capacity, overflow));
+    NanReturnUndefined();
+  }
+  catch (const JSException& e) {
+    e.throwAsV8Exception();
+    NanReturnUndefined();
+  }
+}
+
+NAN_METHOD(HID::readLatestStart)
+{
+  NanScope();
+
+  if (args.Length() < 1 || args.Length() > 3
+      || !args[0]->IsFunction()) {
+    NanThrowError("need callback function and optional interval and numbered reports arguments in readLatestStart");
+    NanReturnUndefined();
+  }
+
+  try {
+    HID* hid = ObjectWrap::Unwrap<HID>(args.This());
+    unsigned int interval = args.Length() > 1 ? args[1]->Uint32Value() : 0;
+    bool numberedReports = args.Length() > 2 && args[2]->BooleanValue();
+    hid->startReader(new Reader(hid, new NanCallback(Local<Function>::Cast(args[0])), 0,
+                                Reader::readerRingCapacity, dropNewest,
+                                new LatestReports(numberedReports, Reader::readerSlotSize), interval));
+    NanReturnUndefined();
+  }
+  catch (const JSException& e) {
+    e.throwAsV8Exception();
+    NanReturnUndefined();
+  }
+}
+
+NAN_METHOD(HID::readLatest)
+{
+  NanScope();
+
+  HID* hid = ObjectWrap::Unwrap<HID>(args.This());
+  if (!hid->_reader || !hid->_reader->_latest) {
+    NanThrowError("readLatest needs readLatestStart to be called first");
+    NanReturnUndefined();
+  }
+
+  unsigned char reportId = args.Length() > 0 ? (unsigned char) args[0]->Uint32Value() : 0;
+  vector<unsigned char> report;
+  uint64_t received;
+  if (!hid->_reader->_latest->get(reportId, report, received)) {
+    NanReturnUndefined();
+  }
+  NanReturnValue(newReportBuffer(report.empty() ? 0 : &report[0], report.size()));
+}
+
+NAN_METHOD(HID::readStop)
+{
+  NanScope();
+
+  HID* hid = ObjectWrap::Unwrap<HID>(args.This());
+  hid->stopReader();
+  if (hid->_inputQueue) {
+    try {
+      hid->startPrefetching();
+    }
+    catch (const JSException& e) {
+      e.throwAsV8Exception();
+    }
+  }
+  NanReturnUndefined();
+}
+
+void
+HID::setInputQueue(size_t capacity)
+{
+  if (!_hidHandle) {
+    throw JSException("cannot set the input queue of a closed device");
+  }
+  if (_inputQueue) {
+    throw JSException("the input queue can only be set once");
+  }
+  _inputQueue = new InputQueue(capacity, Reader::readerSlotSize);
+  if (!_reader) {
+    startPrefetching();
+  }
+}
+
+void
+HID::startPrefetching()
+{
+  if (_prefetching || !_hidHandle) {
+    return;
+  }
+  Prefetcher* prefetcher = new Prefetcher(this, acquireHandle());
+  _prefetchFailed = false;
+  _prefetching = true;
+  _streaming = true;
+  if (uv_thread_create(&prefetcher->_thread, prefetchThread, prefetcher)) {
+    _prefetching = false;
+    _streaming = false;
+    delete prefetcher;
+    releaseHandle();
+    throw JSException("cannot create input queue thread");
+  }
+  _prefetcher = prefetcher;
+  try {
+    scheduleThread(prefetcher->_thread);
+  }
+  catch (const JSException&) {
+    stopPrefetching();
+    throw;
+  }
+}
+
+void
+HID::stopPrefetching()
+{
+  if (!_prefetching) {
+    return;
+  }
+  // The prefetcher notices within one poll interval.  Whatever reads
+  // the device next waits for it in claimInput().
+  _prefetching = false;
+  _prefetcher->_running = false;
+  joinLater(new ExitingThread(_prefetcher->_thread, 0, _prefetcher, 0));
+  _prefetcher = 0;
+  _streaming = false;
+  // Reads waiting for the queue go to the device from now on
+  _inputQueue->interrupt();
+}
+
+void
+HID::resumePrefetching()
+{
+  if (!_inputQueue) {
+    return;
+  }
+  try {
+    startPrefetching();
+  }
+  catch (const JSException&) {
+    // The caller reports why the reader could not start, reads still
+    // work without the prefetcher
+  }
+}
+
+void
+HID::prefetchThread(void* arg)
+{
+  Prefetcher* prefetcher = static_cast<Prefetcher*>(arg);
+  HID* hid = prefetcher->_hid;
+  unsigned char report[Reader::readerSlotSize];
+
+  // The streaming reader may still be in its last read
+  bool claimed = false;
+  while (prefetcher->_running && !(claimed = hid->claimInput(readPollInterval)))
+    ;
+  while (claimed && prefetcher->_running) {
+    int len = hid_read_timeout(prefetcher->_handle, report, sizeof report, readPollInterval);
+    if (len < 0) {
+      // Reads go back to the device, which reports the error to them
+      if (prefetcher->_running) {
+        hid->_prefetchFailed = true;
+        hid->_streaming = false;
+      }
+      hid->_inputQueue->interrupt();
+      break;
+    }
+    if (len > 0) {
+      uint64_t time = uv_hrtime();
+      hid->_capture.record(CaptureFormat::input, report, len);
+      if (!hid->_replies.offer(report, len, time) && !hid->_inputQueue->push(report, len, time)) {
+        hid->_stats._droppedReports++;
+      }
+    }
+  }
+  if (claimed) {
+    hid->releaseInput();
+  }
+  // The last thing touching the device, which may be destroyed as
+  // soon as it is released
+  hid->releaseHandle();
+}
+
+NAN_METHOD(HID::setInputQueue)
+{
+  NanScope();
+
+  if (args.Length() != 1
+      || !args[0]->IsNumber()
+      || args[0]->Uint32Value() == 0
+      || args[0]->Uint32Value() > Reader::maxRingCapacity) {
+    NanThrowError("need number of reports between 1 and 65536 as argument in setInputQueue");
+    NanReturnUndefined();
+  }
+
+  try {
+    HID* hid = ObjectWrap::Unwrap<HID>(args.This());
+    hid->setInputQueue(args[0]->Uint32Value());
+    NanReturnUndefined();
+  }
+  catch (const JSException& e) {
+    e.throwAsV8Exception();
+    NanReturnUndefined();
+  }
+}
+
+// Reads the argument of setThreadPolicy(): an object with any of
+// realtime, priority and cpus
+static void
+readThreadPolicy(Local<Value> value, ThreadPolicy& policy)
+{
+  if (!value->IsObject()) {
+    throw JSException("need thread policy object as argument in setThreadPolicy");
+  }
+  Local<Object> object = value->ToObject();
+  policy._realtime = object->Get(NanNew<String>("realtime"))->BooleanValue();
+  Local<Value> priority = object->Get(NanNew<String>("priority"));
+  if (!priority->IsUndefined()) {
+    if (!priority->IsNumber()) {
+      throw JSException("thread priority must be a number");
+    }
+    policy._priority = priority->Int32Value();
+  }
+  Local<Value> cpus = object->Get(NanNew<String>("cpus"));
+  if (!cpus->IsUndefined()) {
+    if (!cpus->IsArray()) {
+      throw JSException("cpus must be an array of CPU numbers");
+    }
+    Local<Array> array = Local<Array>::Cast(cpus);
+    for (unsigned int i = 0; i < array->Length(); i++) {
+      Local<Value> cpu = array->Get(i);
+      if (!cpu->IsNumber() || cpu->Int32Value() < 0) {
+        throw JSException("cpus must be an array of CPU numbers");
+      }
+      policy._cpus.push_back(cpu->Uint32Value());
+    }
+  }
+}
+
+void
+HID::scheduleThread(uv_thread_t thread)
+{
+  string error;
+  if (!_threadPolicy.isDefault() && !applyThreadPolicy(thread, _threadPolicy, ThreadPolicy(), error)) {
+    throw JSException(error);
+  }
+}
+
+// Applies the policy to the threads running now, or tries it out if
+// there are none, and keeps it for threads started later.  Fails
+// without keeping the policy.
+NAN_METHOD(HID::setThreadPolicy)
+{
+  NanScope();
+
+  if (args.Length() != 1) {
+    NanThrowError("need thread policy object as argument in setThreadPolicy");
+    NanReturnUndefined();
+  }
+
+  try {
+    HID* hid = ObjectWrap::Unwrap<HID>(args.This());
+    ThreadPolicy policy;
+    readThreadPolicy(args[0], policy);
+
+    vector<uv_thread_t> threads;
+    Reader* reader = hid->_reader;
+#ifdef HID_DRIVER_HIDRAW
+    if (reader && reader->_fd < 0 && !reader->_error)
+#else
+    if (reader && !reader->_error)
+#endif
+    {
+      threads.push_back(reader->_thread);
+    }
+    if (hid->_writer) {
+      threads.push_back(hid->_writer->_thread);
+    }
+    if (hid->prefetching()) {
+      threads.push_back(hid->_prefetcher->_thread);
+    }
+
+    string error;
+    bool applied = threads.empty()
+      ? checkThreadPolicy(policy, error)
+      : applyThreadPolicy(threads, policy, hid->_threadPolicy, error);
+    if (!applied) {
+      throw JSException(error);
+    }
+    hid->_threadPolicy = policy;
+    NanReturnUndefined();
+  }
+  catch (const JSException& e) {
+    e.throwAsV8Exception();
+    NanReturnUndefined();
+  }
+}
+
+NAN_METHOD(HID::readPause)
+{
+  NanScope();
+
+  // Reports pile up in the ring, after which the overflow policy
+  // applies; under "pause" the reader thread stops reading
+  HID* hid = ObjectWrap::Unwrap<HID>(args.This());
+  if (hid->_reader) {
+    hid->_reader->_held = true;
+  }
+  NanReturnUndefined();
+}
+
+NAN_METHOD(HID::readResume)
+{
+  NanScope();
+
+  HID* hid = ObjectWrap::Unwrap<HID>(args.This());
+  if (hid->_reader && hid->_reader->_held) {
+    hid->_reader->_held = false;
+    // Deliver what has been held back from the next loop iteration,
+    // not from within the caller
+    uv_async_send(&hid->_reader->_async);
+  }
+  NanReturnUndefined();
+}
+
+HID::Priority
+HID::priorityFromJS(Handle<Value> value)
+{
+  if (value->IsUndefined()) {
+    return priorityNormal;
+  }
+  string name = *NanUtf8String(value);
+  if (name == "control") {
+    return priorityControl;
+  } else if (name == "bulk") {
+    return priorityBulk;
+  } else if (name != "normal") {
+    throw JSException("priority must be \"control\", \"normal\" or \"bulk\"");
+  }
+  return priorityNormal;
+}
+
+// Deadlines are passed in milliseconds from now
+uint64_t
+HID::deadlineFromJS(Handle<Value> value)
+{
+  if (value->IsUndefined()) {
+    return 0;
+  }
+  if (!value->IsNumber() || value->NumberValue() < 0) {
+    throw JSException("deadline must be a number of milliseconds");
+  }
+  return uv_hrtime() + (uint64_t) (value->NumberValue() * 1e6);
+}
+
+HID::Writer*
+HID::startWriter()
+{
+  if (!_hidHandle) {
+    throw JSException("cannot write to a closed device");
+  }
+
+  Writer* writer = _writer;
+  if (!writer) {
+    writer = new Writer(this, acquireHandle());
+    uv_async_init(uv_default_loop(), &writer->_async, writerWakeup);
+    writer->_async.data = writer;
+    // Referenced only while commands are queued, see queueCommand()
+    uv_unref((uv_handle_t*) &writer->_async);
+    if (uv_thread_create(&writer->_thread, writerThread, writer)) {
+      releaseHandle();
+      uv_close((uv_handle_t*) &writer->_async, writerClosed);
+      throw JSException("cannot create writer thread");
+    }
+    _writer = writer;
+    try {
+      scheduleThread(writer->_thread);
+    }
+    catch (const JSException&) {
+      stopWriter();
+      throw;
+    }
+  }
+  return writer;
+}
+
+HID::WriteRequest*
+HID::newCommand(CommandKind kind, const ReportData& message, Priority priority,
+                uint64_t deadline, Local<Function> callback)
+{
+  Writer* writer = startWriter();
+  WriteRequest* request;
+  if (writer->_free.empty()) {
+    request = new WriteRequest;
+  } else {
+    request = writer->_free.back();
+    writer->_free.pop_back();
+  }
+  request->_kind = kind;
+  request->_priority = priority;
+  request->_data.assign(message.data(), message.data() + message.length());
+  request->_callback = new NanCallback(callback);
+  request->_result = 0;
+  request->_failure = 0;
+  request->_cancelled = false;
+  request->_expired = false;
+  request->_timedOut = false;
+  request->_deadline = deadline;
+  request->_timeout = 0;
+  request->_transaction = ReplyMatcher::Transaction();
+  return request;
+}
+
+size_t
+HID::queueCommand(WriteRequest* request)
+{
+  Writer* writer = _writer;
+  request->_queued = uv_hrtime();
+
+  uv_mutex_lock(&writer->_lock);
+  writer->_pending[request->_priority].push_back(request);
+  uv_cond_signal(&writer->_wakeup);
+  uv_mutex_unlock(&writer->_lock);
+
+  // An idle writer, even one sending periodic outputs, does not keep
+  // the event loop running or the object from being collected
+  if (!writer->_depth) {
+    uv_ref((uv_handle_t*) &writer->_async);
+    Ref();
+  }
+  return ++writer->_depth;
+}
+
+bool
+HID::Writer::hasPending() const
+{
+  for (int i = 0; i < priorityClasses; i++) {
+    if (!_pending[i].empty()) {
+      return true;
+    }
+  }
+  return false;
+}
+
+HID::WriteRequest*
+HID::Writer::next(uint64_t now, size_t pipelineDepth, DeviceStats& stats)
+{
+  for (int i = 0; i < priorityClasses; i++) {
+    deque<WriteRequest*>& queue = _pending[i];
+    while (!queue.empty() && queue.front()->_deadline && queue.front()->_deadline <= now) {
+      queue.front()->_expired = true;
+      stats._expiredCommands++;
+      _done.push_back(queue.front());
+      queue.pop_front();
+    }
+    // A transaction waiting for room in the pipeline holds up its
+    // class, but not the ones below
+    if (queue.empty()
+        || (queue.front()->_kind == transaction && _outstanding.size() >= pipelineDepth)) {
+      continue;
+    }
+    WriteRequest* request = queue.front();
+    queue.pop_front();
+    return request;
+  }
+  return 0;
+}
+
+uint64_t
+HID::Writer::nextDue() const
+{
+  uint64_t due = noneDue;
+  for (map<unsigned int, PeriodicOutput>::const_iterator i = _periodic.begin(); i != _periodic.end(); i++) {
+    if (i->second.waiting() && i->second._due < due) {
+      due = i->second._due;
+    }
+  }
+  return due;
+}
+
+uint64_t
+HID::Writer::takeDue(uint64_t now, vector<unsigned char>& data, DeviceStats& stats)
+{
+  PeriodicOutput* output = 0;
+  for (map<unsigned int, PeriodicOutput>::iterator i = _periodic.begin(); i != _periodic.end(); i++) {
+    if (i->second.waiting() && i->second._due <= now && (!output || i->second._due < output->_due)) {
+      output = &i->second;
+    }
+  }
+  if (!output) {
+    return 0;
+  }
+  // Sends that could not be made in time are skipped, keeping the
+  // phase of the schedule
+  uint64_t due = output->_due;
+  uint64_t late = (now - due) / output->_interval;
+  stats._periodicMissed += late;
+  output->_due += (late + 1) * output->_interval;
+  data = output->_data;
+  output->_changed = false;
+  return due;
+}
+
+void
+HID::stopWriter()
+{
+  Writer* writer = _writer;
+  if (!writer) {
+    return;
+  }
+
+  // The command being sent is completed, queued ones and
+  // transactions waiting for their reply are cancelled.  The thread
+  // may be blocked in hidapi for as long as the backend lets a write
+  // take, so it is joined on the threadpool.
+  _writer = 0;
+  uv_mutex_lock(&writer->_lock);
+  writer->_stopping = true;
+  uv_cond_signal(&writer->_wakeup);
+  uv_mutex_unlock(&writer->_lock);
+  joinLater(new ExitingThread(writer->_thread, 0, 0, writer));
+}
+
+void
+HID::cancelQueued(Writer* writer)
+{
+  // Their callbacks are called from the async handle, which closes
+  // itself afterwards
+  writer->_joined = true;
+  for (int i = 0; i < priorityClasses; i++) {
+    deque<WriteRequest*>& queue = writer->_pending[i];
+    for (deque<WriteRequest*>::iterator j = queue.begin(); j != queue.end(); j++) {
+      (*j)->_cancelled = true;
+      writer->_done.push_back(*j);
+    }
+    queue.clear();
+  }
+  if (writer->_depth) {
+    uv_async_send(&writer->_async);
+  } else {
+    // Nothing to call back, and the object may be going away
+    uv_close((uv_handle_t*) &writer->_async, writerClosed);
+  }
+}
+
+void
+HID::writerThread(void* arg)
+{
+  Writer* writer = static_cast<Writer*>(arg);
+  HID* hid = writer->_hid;
+  vector<unsigned char> periodic;
+
+  uv_mutex_lock(&writer->_lock);
+  while (true) {
+    // Sleep unless there is something to send, a reply to wait for or
+    // a periodic output due
+    uint64_t now = uv_hrtime();
+    uint64_t due;
+    while (writer->_outstanding.empty() && !writer->hasPending() && !writer->_stopping
+           && (due = writer->nextDue()) > now) {
+      if (due == Writer::noneDue) {
+        uv_cond_wait(&writer->_wakeup, &writer->_lock);
+      } else {
+        uv_cond_timedwait(&writer->_wakeup, &writer->_lock, due - now);
+      }
+      now = uv_hrtime();
+    }
+    if (writer->_stopping) {
+      break;
+    }
+    if ((due = writer->takeDue(now, periodic, hid->_stats))) {
+      uv_mutex_unlock(&writer->_lock);
+      uint64_t sent = uv_hrtime();
+      hid->_capture.record(CaptureFormat::output, periodic.empty() ? 0 : &periodic[0], periodic.size());
+      uv_mutex_lock(&hid->_outputLock);
+      int result = hid_write(writer->_handle, periodic.empty() ? 0 : &periodic[0], periodic.size());
+      uv_mutex_unlock(&hid->_outputLock);
+      hid->_stats.countWrite(result);
+      hid->_stats._periodicWrites++;
+      hid->_stats._periodicJitter.record(sent - due);
+      uv_mutex_lock(&writer->_lock);
+      continue;
+    }
+    size_t pipelineDepth = hid->_pipelineDepth;
+    WriteRequest* request = writer->next(uv_hrtime(), pipelineDepth, hid->_stats);
+    uv_mutex_unlock(&writer->_lock);
+
+    if (request) {
+      hid->sendCommand(writer, request);
+    } else if (!writer->_outstanding.empty()) {
+      hid->awaitReplies(writer);
+    }
+    hid->finishTransactions(writer, false);
+
+    uv_mutex_lock(&writer->_lock);
+    if (!writer->_done.empty()) {
+      uv_async_send(&writer->_async);
+    }
+  }
+  uv_mutex_unlock(&writer->_lock);
+  hid->finishTransactions(writer, true);
+  // The last thing touching the device, which may be destroyed as
+  // soon as it is released
+  hid->releaseHandle();
+}
+
+void
+HID::sendCommand(Writer* writer, WriteRequest* request)
+{
+  const unsigned char* data = request->_data.empty() ? 0 : &request->_data[0];
+  if (request->_kind == featureReport) {
+    _capture.record(CaptureFormat::feature, data, request->_data.size());
+    uv_mutex_lock(&_outputLock);
+    request->_result = hid_send_feature_report(writer->_handle, data, request->_data.size());
+    uv_mutex_unlock(&_outputLock);
+    _stats.countWrite(request->_result);
+    if (request->_result < 0) {
+      request->_failure = "could not send feature report to device";
+    }
+  } else {
+    // Transactions are registered before writing, as the reply may
+    // be read by another thread before hid_write() even returns
+    if (request->_kind == transaction) {
+      _replies.add(&request->_transaction);
+    }
+    _capture.record(CaptureFormat::output, data, request->_data.size());
+    uv_mutex_lock(&_outputLock);
+    request->_result = hid_write(writer->_handle, data, request->_data.size());
+    uv_mutex_unlock(&_outputLock);
+    _stats.countWrite(request->_result);
+    if (request->_result < 0) {
+      request->_failure = request->_kind == transaction
+        ? "could not write transaction request to HID device"
+        : "Cannot write to HID device";
+    }
+  }
+
+  if (request->_kind == transaction && !request->_failure) {
+    request->_sent = uv_hrtime();
+    request->_replyDeadline = request->_sent + (uint64_t) request->_timeout * 1000000;
+    writer->_outstanding.push_back(request);
+    return;
+  }
+  if (request->_kind == transaction) {
+    _replies.remove(&request->_transaction);
+  }
+  uv_mutex_lock(&writer->_lock);
+  writer->_done.push_back(request);
+  uv_mutex_unlock(&writer->_lock);
+}
+
+void
+HID::awaitReplies(Writer* writer)
+{
+  // The streaming reader or the prefetcher reads the replies, as two
+  // threads reading one hidapi device lose reports.  Once the
+  // prefetcher has failed, nobody is left to read them.
+  if (!_streaming && _prefetchFailed) {
+    for (deque<WriteRequest*>::iterator i = writer->_outstanding.begin(); i != writer->_outstanding.end(); i++) {
+      (*i)->_failure = "could not read transaction reply from HID device";
+    }
+    return;
+  }
+  _replies.wait(&writer->_outstanding.front()->_transaction,
+                uv_hrtime() + (uint64_t) replyPollInterval * 1000000);
+}
+
+void
+HID::finishTransactions(Writer* writer, bool cancel)
+{
+  deque<WriteRequest*> finished;
+  uint64_t now = uv_hrtime();
+  deque<WriteRequest*>& outstanding = writer->_outstanding;
+  for (deque<WriteRequest*>::iterator i = outstanding.begin(); i != outstanding.end(); ) {
+    WriteRequest* request = *i;
+    ReplyMatcher::Transaction& transaction = request->_transaction;
+    if (!cancel && !request->_failure && now < request->_replyDeadline && !_replies.completed(&transaction)) {
+      i++;
+      continue;
+    }
+    _replies.remove(&transaction);
+    // The reply may have come in just as the transaction gave up
+    if (transaction._completed) {
+      request->_failure = 0;
+      _stats.countRead(transaction._reply.size());
+      _stats._transactionLatency.record(transaction._time - request->_sent);
+    } else if (cancel) {
+      request->_cancelled = true;
+    } else if (!request->_failure) {
+      request->_timedOut = true;
+      _stats._transactionTimeouts++;
+    }
+    finished.push_back(request);
+    i = outstanding.erase(i);
+  }
+
+  if (!finished.empty()) {
+    uv_mutex_lock(&writer->_lock);
+    writer->_done.insert(writer->_done.end(), finished.begin(), finished.end());
+    uv_mutex_unlock(&writer->_lock);
+  }
+}
+
+NAUV_WORK_CB(HID::writerWakeup)
+{
+  Writer* writer = static_cast<Writer*>(async->data);
+  writer->_hid->deliverWriteResults(writer);
+}
+
+void
+HID::writerClosed(uv_handle_t* handle)
+{
+  delete static_cast<Writer*>(handle->data);
+}
+
+void
+HID::deliverWriteResults(Writer* writer)
+{
+  NanScope();
+
+  // Callbacks may close the device, which moves the writes still
+  // queued to _done, so keep going until nothing is left
+  while (true) {
+    deque<WriteRequest*> done;
+    uv_mutex_lock(&writer->_lock);
+    done.swap(writer->_done);
+    uv_mutex_unlock(&writer->_lock);
+    if (done.empty()) {
+      break;
+    }
+
+    for (deque<WriteRequest*>::iterator i = done.begin(); i != done.end(); i++) {
+      WriteRequest* request = *i;
+      NanCallback* callback = request->_callback;
+      // Transactions are called back with the reply and its timestamp
+      Local<Value> argv[3];
+      argv[0] = NanUndefined();
+      argv[1] = NanUndefined();
+      argv[2] = NanUndefined();
+      if (request->_cancelled) {
+        Local<Object> error = Exception::Error(NanNew<String>(request->_kind == transaction
+                                                              ? "device closed before the transaction completed"
+                                                              : "device closed before the report was written"))->ToObject();
+        error->Set(NanNew<String>("cancelled"), NanNew<Boolean>(true));
+        argv[0] = error;
+      } else if (request->_expired) {
+        Local<Object> error = Exception::Error(NanNew<String>("command expired before it was sent"))->ToObject();
+        error->Set(NanNew<String>("expired"), NanNew<Boolean>(true));
+        argv[0] = error;
+      } else if (request->_timedOut) {
+        Local<Object> error = Exception::Error(NanNew<String>("transaction timed out"))->ToObject();
+        error->Set(NanNew<String>("timeout"), NanNew<Boolean>(true));
+        argv[0] = error;
+      } else if (request->_failure) {
+        argv[0] = Exception::Error(NanNew<String>(request->_failure));
+      } else if (request->_kind == transaction) {
+        const vector<unsigned char>& reply = request->_transaction._reply;
+        argv[1] = newReportBuffer(reply.empty() ? 0 : &reply[0], reply.size());
+        argv[2] = timestampToJS(request->_transaction._time);
+      } else {
+        argv[1] = NanNew<Integer>(request->_result);
+      }
+      if (!request->_cancelled && !request->_expired) {
+        _stats._writeLatency.record(uv_hrtime() - request->_queued);
+      }
+      writer->_free.push_back(request);
+      if (!--writer->_depth) {
+        uv_unref((uv_handle_t*) &writer->_async);
+        Unref();
+      }
+
+      TryCatch tryCatch;
+      callback->Call(request->_kind == transaction ? 3 : 2, argv);
+      delete callback;
+
+      if (tryCatch.HasCaught()) {
+        FatalException(tryCatch);
+      }
+    }
+  }
+
+  if (writer->_joined) {
+    // Stopped, and all results have been delivered
+    uv_close((uv_handle_t*) &writer->_async, writerClosed);
+  }
+}
+
+NAN_METHOD(HID::writeAsync)
+{
+  NanScope();
+
+  if (args.Length() < 2 || args.Length() > 5
+      || !args[1]->IsFunction()) {
+    NanThrowError("need report and callback function and optional priority, deadline and feature report arguments in writeAsync");
+    NanReturnUndefined();
+  }
+
+  try {
+    HID* hid = ObjectWrap::Unwrap<HID>(args.This());
+    ReportData message(args[0]);
+    Priority priority = priorityFromJS(args[2]);
+    uint64_t deadline = deadlineFromJS(args[3]);
+    CommandKind kind = args.Length() > 4 && args[4]->BooleanValue() ? featureReport : outputReport;
+    WriteRequest* request = hid->newCommand(kind, message, priority, deadline, Local<Function>::Cast(args[1]));
+    NanReturnValue(NanNew<Integer>((unsigned int) hid->queueCommand(request)));
+  }
+  catch (const JSException& e) {
+    e.throwAsV8Exception();
+    NanReturnUndefined();
+  }
+}
+
+NAN_METHOD(HID::writeQueueDepth)
+{
+  NanScope();
+
+  HID* hid = ObjectWrap::Unwrap<HID>(args.This());
+  NanReturnValue(NanNew<Integer>((unsigned int) (hid->_writer ? hid->_writer->_depth : 0)));
+}
+
+// periodicStart(report, interval[, changesOnly]): returns an id for
+// periodicUpdate() and periodicStop()
+NAN_METHOD(HID::periodicStart)
+{
+  NanScope();
+
+  if (args.Length() < 2 || args.Length() > 3
+      || !args[1]->IsNumber()
+      || !(args[1]->NumberValue() > 0)) {
+    NanThrowError("need report, positive interval in milliseconds and optional changes only flag in periodicStart");
+    NanReturnUndefined();
+  }
+
+  try {
+    HID* hid = ObjectWrap::Unwrap<HID>(args.This());
+    ReportData message(args[0]);
+    Writer* writer = hid->startWriter();
+
+    uv_mutex_lock(&writer->_lock);
+    unsigned int id = ++writer->_lastPeriodicId;
+    PeriodicOutput& output = writer->_periodic[id];
+    output._data.assign(message.data(), message.data() + message.length());
+    output._interval = (uint64_t) (args[1]->NumberValue() * 1e6);
+    if (!output._interval) {
+      output._interval = 1;
+    }
+    output._due = uv_hrtime();
+    output._changesOnly = args[2]->BooleanValue();
+    output._changed = true;
+    uv_cond_signal(&writer->_wakeup);
+    uv_mutex_unlock(&writer->_lock);
+
+    NanReturnValue(NanNew<Integer>(id));
+  }
+  catch (const JSException& e) {
+    e.throwAsV8Exception();
+    NanReturnUndefined();
+  }
+}
+
+NAN_METHOD(HID::periodicUpdate)
+{
+  NanScope();
+
+  if (args.Length() != 2
+      || !args[0]->IsUint32()) {
+    NanThrowError("need periodic output id and report arguments in periodicUpdate");
+    NanReturnUndefined();
+  }
+
+  try {
+    HID* hid = ObjectWrap::Unwrap<HID>(args.This());
+    ReportData message(args[1]);
+    Writer* writer = hid->_writer;
+    bool found = false;
+    if (writer) {
+      uv_mutex_lock(&writer->_lock);
+      map<unsigned int, PeriodicOutput>::iterator i = writer->_periodic.find(args[0]->Uint32Value());
+      if (i != writer->_periodic.end()) {
+        PeriodicOutput& output = i->second;
+        bool idle = !output.waiting();
+        output._changed = output._changed
+          || output._data.size() != message.length()
+          || (message.length() && memcmp(&output._data[0], message.data(), message.length()));
+        output._data.assign(message.data(), message.data() + message.length());
+        if (idle && output._changed) {
+          // Periods passed while idle were not missed: send in the
+          // next one still to come
+          uint64_t now = uv_hrtime();
+          if (output._due < now) {
+            output._due += (now - output._due + output._interval - 1) / output._interval * output._interval;
+          }
+          uv_cond_signal(&writer->_wakeup);
+        }
+        found = true;
+      }
+      uv_mutex_unlock(&writer->_lock);
+    }
+    if (!found) {
+      throw JSException("no such periodic output");
+    }
+    NanReturnUndefined();
+  }
+  catch (const JSException& e) {
+    e.throwAsV8Exception();
+    NanReturnUndefined();
+  }
+}
+
+NAN_METHOD(HID::periodicStop)
+{
+  NanScope();
+
+  if (args.Length() != 1
+      || !args[0]->IsUint32()) {
+    NanThrowError("need periodic output id argument in periodicStop");
+    NanReturnUndefined();
+  }
+
+  HID* hid = ObjectWrap::Unwrap<HID>(args.This());
+  Writer* writer = hid->_writer;
+  if (writer) {
+    uv_mutex_lock(&writer->_lock);
+    writer->_periodic.erase(args[0]->Uint32Value());
+    uv_mutex_unlock(&writer->_lock);
+  }
+  NanReturnUndefined();
+}
+
+NAN_METHOD(HID::setPipelineDepth)
+{
+  NanScope();
+
+  if (args.Length() != 1
+      || !args[0]->IsUint32()
+      || args[0]->Uint32Value() < 1) {
+    NanThrowError("need a positive number of transactions as argument in setPipelineDepth");
+    NanReturnUndefined();
+  }
+
+  HID* hid = ObjectWrap::Unwrap<HID>(args.This());
+  hid->_pipelineDepth = args[0]->Uint32Value();
+  NanReturnUndefined();
+}
+
+static Local<Object>
+histogramToJS(const LatencyHistogram& histogram)
+{
+  NanEscapableScope();
+
+  // Latencies are reported in microseconds
+  Local<Object> result = NanNew<Object>();
+  result->Set(NanNew<String>("count"), NanNew<Number>((double) histogram.count()));
+  result->Set(NanNew<String>("mean"), NanNew<Number>(histogram.mean() / 1e3));
+  result->Set(NanNew<String>("max"), NanNew<Number>(histogram.max() / 1e3));
+  result->Set(NanNew<String>("p50"), NanNew<Number>(histogram.percentile(0.5) / 1e3));
+  result->Set(NanNew<String>("p90"), NanNew<Number>(histogram.percentile(0.9) / 1e3));
+  result->Set(NanNew<String>("p99"), NanNew<Number>(histogram.percentile(0.99) / 1e3));
+  result->Set(NanNew<String>("p999"), NanNew<Number>(histogram.percentile(0.999) / 1e3));
+  return NanEscapeScope(result);
+}
+
+NAN_METHOD(HID::stats)
+{
+  NanScope();
+
+  HID* hid = ObjectWrap::Unwrap<HID>(args.This());
+  DeviceStats& stats = hid->_stats;
+
+  Local<Object> result = NanNew<Object>();
+  result->Set(NanNew<String>("reportsRead"), NanNew<Number>((double) stats._reportsRead));
+  result->Set(NanNew<String>("bytesRead"), NanNew<Number>((double) stats._bytesRead));
+  result->Set(NanNew<String>("readErrors"), NanNew<Number>((double) stats._readErrors));
+  result->Set(NanNew<String>("droppedReports"), NanNew<Number>((double) stats._droppedReports));
+  result->Set(NanNew<String>("filteredReports"), NanNew<Number>((double) stats._filteredReports));
+  result->Set(NanNew<String>("readerPauses"), NanNew<Number>((double) stats._readerPauses));
+  result->Set(NanNew<String>("transactions"), NanNew<Number>((double) stats._transactions));
+  result->Set(NanNew<String>("transactionTimeouts"), NanNew<Number>((double) stats._transactionTimeouts));
+  result->Set(NanNew<String>("expiredCommands"), NanNew<Number>((double) stats._expiredCommands));
+  result->Set(NanNew<String>("periodicWrites"), NanNew<Number>((double) stats._periodicWrites));
+  result->Set(NanNew<String>("periodicMissed"), NanNew<Number>((double) stats._periodicMissed));
+  result->Set(NanNew<String>("writes"), NanNew<Number>((double) stats._writes));
+  result->Set(NanNew<String>("bytesWritten"), NanNew<Number>((double) stats._bytesWritten));
+  result->Set(NanNew<String>("writeErrors"), NanNew<Number>((double) stats._writeErrors));
+  result->Set(NanNew<String>("writeQueueDepth"), NanNew<Integer>((unsigned int) (hid->_writer ? hid->_writer->_depth : 0)));
+  result->Set(NanNew<String>("readQueueDepth"), NanNew<Integer>((unsigned int) (hid->_reader ? hid->_reader->_ring.size() : 0)));
+  result->Set(NanNew<String>("inputQueueDepth"), NanNew<Integer>((unsigned int) (hid->_inputQueue ? hid->_inputQueue->size() : 0)));
+  result->Set(NanNew<String>("deliveryLatency"), histogramToJS(stats._deliveryLatency));
+  result->Set(NanNew<String>("queueWait"), histogramToJS(stats._queueWait));
+  result->Set(NanNew<String>("writeLatency"), histogramToJS(stats._writeLatency));
+  result->Set(NanNew<String>("transactionLatency"), histogramToJS(stats._transactionLatency));
+  result->Set(NanNew<String>("periodicJitter"), histogramToJS(stats._periodicJitter));
+
+  // stats(true) starts over after taking the snapshot
+  if (args.Length() > 0 && args[0]->BooleanValue()) {
+    stats.reset();
+  }
+
+  NanReturnValue(result);
+}
+
+NAN_METHOD(HID::setFilter)
+{
+  NanScope();
+
+  if (args.Length() != 1
+      || !(args[0]->IsObject() || args[0]->IsNull() || args[0]->IsUndefined())) {
+    NanThrowError("need filter object or null argument in setFilter");
+    NanReturnUndefined();
+  }
+
+  HID* hid = ObjectWrap::Unwrap<HID>(args.This());
+  if (!args[0]->IsObject()) {
+    hid->_filter.clear();
+    NanReturnUndefined();
+  }
+
+  try {
+    Local<Object> options = args[0]->ToObject();
+    ReportFilter::Settings settings;
+    settings._changesOnly = options->Get(NanNew<String>("changesOnly"))->BooleanValue();
+    settings._numberedReports = options->Get(NanNew<String>("numberedReports"))->BooleanValue();
+
+    Local<Value> mask = options->Get(NanNew<String>("mask"));
+    if (!mask->IsUndefined()) {
+      ReportData maskData(mask);
+      settings._mask.assign(maskData.data(), maskData.data() + maskData.length());
+    }
+
+    Local<Value> reportIds = options->Get(NanNew<String>("reportIds"));
+    if (!reportIds->IsUndefined()) {
+      ReportData reportIdData(reportIds);
+      settings._reportIds.assign(reportIdData.data(), reportIdData.data() + reportIdData.length());
+    }
+
+    hid->_filter.configure(settings);
+    NanReturnUndefined();
+  }
+  catch (const JSException& e) {
+    e.throwAsV8Exception();
+    NanReturnUndefined();
+  }
+}
+
+NAN_METHOD(HID::getFeatureReport)
+{
+  NanScope();
+
+  if (args.Length() != 2
+      || args[1]->ToUint32()->Value() == 0) {
+    NanThrowError("need report ID and non-zero length parameter in getFeatureReport");
+  }
+
+  const uint8_t reportId = args[0]->ToUint32()->Value();
+  HID* hid = ObjectWrap::Unwrap<HID>(args.This());
+  const int bufSize = args[1]->ToUint32()->Value();
   //unsigned char buf[bufSize];
   unsigned char* buf = new unsigned char[bufSize];
   buf[0] = reportId;
 
-  int returnedLength = hid_get_feature_report(hid->_hidHandle, buf, bufSize);
+  uv_mutex_lock(&hid->_outputLock);
+  int returnedLength = hid_get_feature_report(hid->_hidHandle, buf, bufSize);
+  uv_mutex_unlock(&hid->_outputLock);
+
+  if (returnedLength == -1) {
+    delete[] buf;
+    NanThrowError("could not get feature report from device");
+    NanReturnUndefined();
+  }
+  hid->_capture.record(CaptureFormat::input, buf, returnedLength);
+  Local<Array> retval = NanNew<Array>();
+
+  for (int i = 0; i < returnedLength; i++) {
+    retval->Set(i, NanNew<Integer>(buf[i]));
+  }
+  delete[] buf;
+  NanReturnValue(retval);
+}
+
+
+NAN_METHOD(HID::sendFeatureReport)
+{
+  NanScope();
+
+  if (args.Length() != 1){
+    NanThrowError("need report (including id in first byte) only in sendFeatureReport");
+  }
+
+
+  try {
+    HID* hid = ObjectWrap::Unwrap<HID>(args.This());
+
+    ReportData message(args[0]);
+    hid->_capture.record(CaptureFormat::feature, message.data(), message.length());
+    uv_mutex_lock(&hid->_outputLock);
+    int returnedLength = hid_send_feature_report(hid->_hidHandle, message.data(), message.length());
+    uv_mutex_unlock(&hid->_outputLock);
+    if (returnedLength == -1) { // Not sure if there would ever be a valid return value of 0. 
+      throw JSException("could not send feature report to device");
+    }
+
+    NanReturnValue(NanNew<Integer>(returnedLength));
+  }
+  catch (const JSException& e) {
+    e.throwAsV8Exception();
+    NanReturnUndefined();
+  }
+}
+
+
+
+
+void
+HID::getFeatureReportAsync(uv_work_t* req)
+{
+  FeatureReportIOCB* iocb = static_cast<FeatureReportIOCB*>(req->data);
+  if (hid_device* handle = iocb->_hid->acquireHandle()) {
+    uv_mutex_lock(&iocb->_hid->_outputLock);
+    iocb->_result = hid_get_feature_report(handle, (unsigned char*) iocb->_report, iocb->_length);
+    uv_mutex_unlock(&iocb->_hid->_outputLock);
+    if (iocb->_result >= 0) {
+      iocb->_hid->_capture.record(CaptureFormat::input, (const unsigned char*) iocb->_report, iocb->_result);
+    }
+    iocb->_hid->releaseHandle();
+  } else {
+    iocb->_result = -1;
+  }
+}
+
+void
+HID::sendFeatureReportAsync(uv_work_t* req)
+{
+  FeatureReportIOCB* iocb = static_cast<FeatureReportIOCB*>(req->data);
+  if (hid_device* handle = iocb->_hid->acquireHandle()) {
+    iocb->_hid->_capture.record(CaptureFormat::feature, iocb->_data.empty() ? 0 : &iocb->_data[0], iocb->_data.size());
+    uv_mutex_lock(&iocb->_hid->_outputLock);
+    iocb->_result = hid_send_feature_report(handle, iocb->_data.empty() ? 0 : &iocb->_data[0], iocb->_data.size());
+    uv_mutex_unlock(&iocb->_hid->_outputLock);
+    iocb->_hid->releaseHandle();
+  } else {
+    iocb->_result = -1;
+  }
+}
+
+void
+HID::featureReportAsyncDone(uv_work_t* req)
+{
+  NanScope();
+  FeatureReportIOCB* iocb = static_cast<FeatureReportIOCB*>(req->data);
+
+  Local<Value> argv[2];
+  argv[0] = NanUndefined();
+  argv[1] = NanUndefined();
+
+  if (iocb->_result < 0) {
+    argv[0] = Exception::Error(NanNew<String>(iocb->_report
+                                              ? "could not get feature report from device"
+                                              : "could not send feature report to device"));
+    if (iocb->_report) {
+      BufferPool::release(iocb->_report, iocb->_hint);
+    }
+  } else if (iocb->_report) {
+    // The report was read straight into pooled memory
+    argv[1] = NanNewBufferHandle(iocb->_report, iocb->_result, BufferPool::release, iocb->_hint);
+  } else {
+    argv[1] = NanNew<Integer>(iocb->_result);
+  }
+  iocb->_hid->Unref();
+
+  TryCatch tryCatch;
+  iocb->_callback->Call(2, argv);
+
+  if (tryCatch.HasCaught()) {
+    FatalException(tryCatch);
+  }
+
+  delete iocb->_callback;
+  delete iocb;
+  delete req;
+}
+
+NAN_METHOD(HID::getFeatureReportAsync)
+{
+  NanScope();
+
+  if (args.Length() != 3
+      || args[1]->ToUint32()->Value() == 0
+      || !args[2]->IsFunction()) {
+    NanThrowError("need report ID, non-zero length and callback function arguments in getFeatureReportAsync");
+    NanReturnUndefined();
+  }
+
+  HID* hid = ObjectWrap::Unwrap<HID>(args.This());
+  if (!hid->_hidHandle) {
+    NanThrowError("cannot get feature report from a closed device");
+    NanReturnUndefined();
+  }
+  hid->Ref();
+
+  FeatureReportIOCB* iocb = new FeatureReportIOCB(hid, new NanCallback(Local<Function>::Cast(args[2])));
+  iocb->_length = args[1]->ToUint32()->Value();
+  iocb->_report = addonState->_reportPool->allocate(iocb->_length, iocb->_hint);
+  iocb->_report[0] = args[0]->ToUint32()->Value();
+
+  uv_work_t* req = new uv_work_t;
+  req->data = iocb;
+  uv_queue_work(uv_default_loop(), req, getFeatureReportAsync, (uv_after_work_cb)featureReportAsyncDone);
+
+  NanReturnUndefined();
+}
+
+NAN_METHOD(HID::sendFeatureReportAsync)
+{
+  NanScope();
+
+  if (args.Length() != 2
+      || !args[1]->IsFunction()) {
+    NanThrowError("need report (including id in first byte) and callback function arguments in sendFeatureReportAsync");
+    NanReturnUndefined();
+  }
+
+  try {
+    HID* hid = ObjectWrap::Unwrap<HID>(args.This());
+    if (!hid->_hidHandle) {
+      throw JSException("cannot send feature report to a closed device");
+    }
+    ReportData message(args[0]);
+    hid->Ref();
+
+    FeatureReportIOCB* iocb = new FeatureReportIOCB(hid, new NanCallback(Local<Function>::Cast(args[1])));
+    iocb->_data.assign(message.data(), message.data() + message.length());
+
+    uv_work_t* req = new uv_work_t;
+    req->data = iocb;
+    uv_queue_work(uv_default_loop(), req, sendFeatureReportAsync, (uv_after_work_cb)featureReportAsyncDone);
+
+    NanReturnUndefined();
+  }
+  catch (const JSException& e) {
+    e.throwAsV8Exception();
+    NanReturnUndefined();
+  }
+}
+
+NAN_METHOD(HID::transact)
+{
+  NanScope();
+
+  if (args.Length() < 5 || args.Length() > 7
+      || !args[1]->IsInt32()
+      || !args[3]->IsUint32()
+      || !args[4]->IsFunction()) {
+    NanThrowError("need request, report ID or -1, prefix, timeout and callback function and optional priority and deadline arguments in transact");
+    NanReturnUndefined();
+  }
+
+  try {
+    HID* hid = ObjectWrap::Unwrap<HID>(args.This());
+    ReportData request(args[0]);
+    int reportId = args[1]->Int32Value();
+    if (reportId > 255) {
+      throw JSException("report ID to match must be between 0 and 255");
+    }
+    vector<unsigned char> prefix;
+    if (!args[2]->IsUndefined() && !args[2]->IsNull()) {
+      ReportData prefixData(args[2]);
+      prefix.assign(prefixData.data(), prefixData.data() + prefixData.length());
+    }
+    Priority priority = priorityFromJS(args[5]);
+    uint64_t deadline = deadlineFromJS(args[6]);
+    // The replies are read by the streaming reader or the input
+    // queue's thread, see awaitReplies().  Setting up a queue here
+    // would change how the device is read for good.
+    if (!hid->_inputQueue && !hid->_reader && hid->_hidHandle) {
+      throw JSException("transactions need an input queue or a streaming reader, see setInputQueue()");
+    }
+
+    WriteRequest* command = hid->newCommand(transaction, request, priority, deadline, Local<Function>::Cast(args[4]));
+    command->_timeout = args[3]->Uint32Value();
+    command->_transaction._reportId = reportId < 0 ? -1 : reportId;
+    command->_transaction._prefix.swap(prefix);
+    hid->_stats._transactions++;
+    NanReturnValue(NanNew<Integer>((unsigned int) hid->queueCommand(command)));
+  }
+  catch (const JSException& e) {
+    e.throwAsV8Exception();
+    NanReturnUndefined();
+  }
+}
+
+NAN_METHOD(HID::New)
+{
+  NanScope();
+
+  if (!args.IsConstructCall()) {
+    NanThrowError("HID function can only be used as a constructor");
+  }
+
+  if (args.Length() < 1) {
+    NanThrowError("HID constructor requires at least one argument");
+  }
+
+  try {
+    HID* hid;
+    if (args.Length() == 1 && args[0]->IsNumber()) {
+      // take over a device opened by HID.openAsync()
+      uv_mutex_lock(hidapiMutex());
+      map<unsigned int, ParkedDevice>::iterator i = parkedDevices.find(args[0]->Uint32Value());
+      ParkedDevice device = { 0, string() };
+      if (i != parkedDevices.end()) {
+        device = i->second;
+        parkedDevices.erase(i);
+      }
+      uv_mutex_unlock(hidapiMutex());
+      if (!device._handle) {
+        throw JSException("no such opened device, or it has already been taken over");
+      }
+      hid = new HID(device._handle, device._path);
+    } else if (args.Length() == 1) {
+      // open by path
+      hid = new HID(*NanUtf8String(args[0]));
+    } else {
+      int32_t vendorId = args[0]->Int32Value();
+      int32_t productId = args[1]->Int32Value();
+      Handle<Value> serial;
+      wchar_t* serialPointer = 0;
+      if (args.Length() > 2) {
+        serialPointer = (wchar_t*) *NanUcs2String(args[2]);
+      }
+      hid = new HID(vendorId, productId, serialPointer);
+    }
+    hid->Wrap(args.This());
+    NanReturnValue(args.This());
+  }
+  catch (const JSException& e) {
+    e.throwAsV8Exception();
+    NanReturnUndefined(); // make the compiler happy
+  }
+}
+
+NAN_METHOD(HID::close)
+{
+  NanScope();
+
+  try {
+    HID* hid = ObjectWrap::Unwrap<HID>(args.This());
+    hid->close();
+    NanReturnUndefined();
+  }
+  catch (const JSException& e) {
+    e.throwAsV8Exception();
+    NanReturnUndefined();
+  }
+}
+
+// //////////////////////////////////////////////////////////////////
+// HID.openAsync() opens a device on the threadpool, as hid_open()
+// enumerates the bus and may take a long time during bus resets.  The
+// device is parked, and the callback gets the id to construct the HID
+// object with.
+// //////////////////////////////////////////////////////////////////
+struct OpenIOCB {
+  OpenIOCB(NanCallback* callback)
+    : _callback(callback),
+      _vendorId(0),
+      _productId(0),
+      _bySerialNumber(false),
+      _handle(0)
+  {}
+
+  NanCallback* _callback;
+  string _path; // empty if opening by vendor and product ID
+  unsigned short _vendorId;
+  unsigned short _productId;
+  bool _bySerialNumber;
+  wstring _serialNumber;
+  hid_device* _handle;
+};
+
+static void
+openAsyncWork(uv_work_t* req)
+{
+  OpenIOCB* iocb = static_cast<OpenIOCB*>(req->data);
+  if (!iocb->_path.empty()) {
+    iocb->_handle = openDevice(iocb->_path.c_str());
+  } else {
+    iocb->_handle = openDevice(iocb->_vendorId, iocb->_productId,
+                               iocb->_bySerialNumber ? iocb->_serialNumber.c_str() : 0);
+  }
+}
+
+static void
+openAsyncDone(uv_work_t* req)
+{
+  NanScope();
+  OpenIOCB* iocb = static_cast<OpenIOCB*>(req->data);
+
+  Local<Value> argv[2];
+  argv[0] = NanUndefined();
+  argv[1] = NanUndefined();
+  if (iocb->_handle) {
+    argv[1] = NanNew<Integer>(parkDevice(iocb->_handle, iocb->_path));
+  } else {
+    ostringstream os;
+    if (iocb->_path.empty()) {
+      os << "cannot open device with vendor id 0x" << hex << iocb->_vendorId << " and product id 0x" << iocb->_productId;
+    } else {
+      os << "cannot open device with path " << iocb->_path;
+    }
+    argv[0] = Exception::Error(NanNew<String>(os.str().c_str()));
+  }
+
+  TryCatch tryCatch;
+  iocb->_callback->Call(2, argv);
+
+  if (tryCatch.HasCaught()) {
+    FatalException(tryCatch);
+  }
+
+  delete iocb->_callback;
+  delete iocb;
+  delete req;
+}
+
+NAN_METHOD(HID::openAsync)
+{
+  NanScope();
+
+  if (args.Length() < 2 || args.Length() > 4
+      || !args[args.Length() - 1]->IsFunction()) {
+    NanThrowError("need path or vendor and product ID, optional serial number and callback function arguments in HID.openAsync()");
+    NanReturnUndefined();
+  }
+
+  OpenIOCB* iocb = new OpenIOCB(new NanCallback(Local<Function>::Cast(args[args.Length() - 1])));
+  if (args.Length() == 2) {
+    iocb->_path = *NanUtf8String(args[0]);
+  } else {
+    iocb->_vendorId = args[0]->Int32Value();
+    iocb->_productId = args[1]->Int32Value();
+    if (args.Length() > 3) {
+      // hidapi wants wchar_t, which is not UTF-16 everywhere
+      NanUcs2String serialNumber(args[2]);
+      iocb->_serialNumber.assign(*serialNumber, *serialNumber + serialNumber.length());
+      iocb->_bySerialNumber = true;
+    }
+  }
+
+  uv_work_t* req = new uv_work_t;
+  req->data = iocb;
+  uv_queue_work(uv_default_loop(), req, openAsyncWork, (uv_after_work_cb)openAsyncDone);
+
+  NanReturnUndefined();
+}
+
+NAN_METHOD(HID::setNonBlocking)
+{
+  NanScope();
+
+  if (args.Length() != 1) {
+    NanThrowError("Expecting a 1 to enable, 0 to disable as the first argument.");
+  }
+  int blockStatus = 0;
+  blockStatus = args[0]->Int32Value();
+  try {
+    HID* hid = ObjectWrap::Unwrap<HID>(args.This());
+    hid->setNonBlocking(blockStatus);
+    NanReturnUndefined();
+  }
+  catch (const JSException& e) {
+    e.throwAsV8Exception();
+    NanReturnUndefined();
+  }
+}
+
+NAN_METHOD(HID::write)
+{
+  NanScope();
+
+  if (args.Length() != 1) {
+    NanThrowError("HID write requires one argument");
+  }
+
+  try {
+    HID* hid = ObjectWrap::Unwrap<HID>(args.This());
+
+    ReportData message(args[0]);
+    hid->write(message.data(), message.length());
+
+    NanReturnUndefined();
+  }
+  catch (const JSException& e) {
+    e.throwAsV8Exception();
+    NanReturnUndefined();
+  }
+}
+
+// //////////////////////////////////////////////////////////////////
+// Device info objects are made from one template with the IDs and
+// usages preset, so that filling them in never changes their shape.
+// The strings of each device are packed into a small Buffer, and only
+// become JS strings when first read through accessors.  As before,
+// properties for a path or strings hidapi did not report are left
+// out.  A pass over the results that only looks at IDs and usages
+// costs one object and one Buffer per device.
+// //////////////////////////////////////////////////////////////////
+static const char* const deviceInfoFieldNames[deviceInfoFields] = {
+  "vendorId",
+  "productId",
+  "path",
+  "release",
+  "interface",
+  "usagePage",
+  "usage",
+  "serialNumber",
+  "manufacturer",
+  "product"
+};
+
+// Internal fields of device info objects: the packed strings of the
+// device, a bit mask of the strings read or assigned so far, and their
+// values.  The packed strings are let go once all have been read.
+enum {
+  stringsSlot,
+  loadedSlot,
+  firstCachedSlot,
+  deviceInfoSlots = firstCachedSlot + deviceInfoFields - firstStringField
+};
+
+// In the packed strings, each is its length followed by its UTF-8
+// encoding, or just this for strings hidapi did not report
+static const uint32_t absentString = ~(uint32_t) 0;
+
+static void
+packString(string& strings, bool present, const string& value)
+{
+  uint32_t length = present ? (uint32_t) value.size() : absentString;
+  strings.append((const char*) &length, sizeof length);
+  if (present) {
+    strings.append(value);
+  }
+}
+
+static const uint32_t allStringsLoaded = (1 << (deviceInfoFields - firstStringField)) - 1;
+
+static void
+setDeviceInfoLoaded(Local<Object> info, int field)
+{
+  uint32_t loaded = info->GetInternalField(loadedSlot)->Uint32Value() | (1 << field);
+  info->SetInternalField(loadedSlot, NanNew<Integer>(loaded));
+  if (loaded == allStringsLoaded) {
+    info->SetInternalField(stringsSlot, NanUndefined());
+  }
+}
+
+static NAN_GETTER(deviceInfoString)
+{
+  NanScope();
+
+  Local<Object> info = args.Holder();
+  int field = args.Data()->Int32Value();
+  if (!(info->GetInternalField(loadedSlot)->Uint32Value() & (1 << field))) {
+    const char* data = node::Buffer::Data(info->GetInternalField(stringsSlot)->ToObject());
+    uint32_t length;
+    for (int i = 0; ; i++) {
+      memcpy(&length, data, sizeof length);
+      data += sizeof length;
+      if (i == field) {
+        break;
+      }
+      if (length != absentString) {
+        data += length;
+      }
+    }
+    if (length != absentString) {
+      info->SetInternalField(firstCachedSlot + field, NanNew<String>(data, length));
+    }
+    setDeviceInfoLoaded(info, field);
+  }
+  NanReturnValue(info->GetInternalField(firstCachedSlot + field));
+}
+
+// Device info objects stay as writable as plain objects
+static NAN_SETTER(setDeviceInfoString)
+{
+  NanScope();
+
+  int field = args.Data()->Int32Value();
+  args.Holder()->SetInternalField(firstCachedSlot + field, value);
+  setDeviceInfoLoaded(args.Holder(), field);
+}
+
+static void
+initDeviceInfoTemplate(AddonState* state)
+{
+  NanScope();
+
+  Local<ObjectTemplate> deviceInfoTemplate = NanNew<ObjectTemplate>();
+  deviceInfoTemplate->SetInternalFieldCount(deviceInfoSlots);
+  for (int i = 0; i < deviceInfoFields; i++) {
+    Local<String> key = NanNew<String>(deviceInfoFieldNames[i]);
+    NanAssignPersistent(state->_deviceInfoKeys[i], key);
+    if (i < firstStringField && i != pathField) {
+      deviceInfoTemplate->Set(key, NanUndefined());
+    }
+  }
+  NanAssignPersistent(state->_deviceInfoTemplate, deviceInfoTemplate);
+}
+
+static void
+disposeDeviceInfoTemplate(AddonState* state)
+{
+  for (int i = 0; i < deviceInfoFields; i++) {
+    NanDisposePersistent(state->_deviceInfoKeys[i]);
+  }
+  NanDisposePersistent(state->_deviceInfoTemplate);
+}
+
+static Local<Array>
+deviceInfosToJS(const vector<DeviceInfo>& devices)
+{
+  NanEscapableScope();
+
+  Local<ObjectTemplate> deviceInfoTemplate = NanNew(addonState->_deviceInfoTemplate);
+  Local<String> keys[deviceInfoFields];
+  for (int i = 0; i < deviceInfoFields; i++) {
+    keys[i] = NanNew(addonState->_deviceInfoKeys[i]);
+  }
+
+  Local<Array> retval = NanNew<Array>(devices.size());
+  string strings;
+  for (size_t i = 0; i < devices.size(); i++) {
+    const DeviceInfo& dev = devices[i];
+    // Per device, so that keeping one device info doesn't keep the
+    // strings of the whole enumeration
+    strings.clear();
+    packString(strings, dev._hasSerialNumber, dev._serialNumber);
+    packString(strings, dev._hasManufacturer, dev._manufacturer);
+    packString(strings, dev._hasProduct, dev._product);
+    Local<Object> deviceInfo = deviceInfoTemplate->NewInstance();
+    deviceInfo->Set(keys[vendorIdField], NanNew<Integer>(dev._vendorId));
+    deviceInfo->Set(keys[productIdField], NanNew<Integer>(dev._productId));
+    if (!dev._path.empty()) {
+      deviceInfo->Set(keys[pathField], NanNew<String>(dev._path.c_str()));
+    }
+    deviceInfo->Set(keys[releaseField], NanNew<Integer>(dev._release));
+    deviceInfo->Set(keys[interfaceField], NanNew<Integer>(dev._interface));
+    deviceInfo->Set(keys[usagePageField], NanNew<Integer>(dev._usagePage));
+    deviceInfo->Set(keys[usageField], NanNew<Integer>(dev._usage));
+    deviceInfo->SetInternalField(stringsSlot, NanNewBufferHandle(strings.data(), (uint32_t) strings.size()));
+    // Absent strings count as loaded, so that the packed strings are
+    // let go once the others have been read
+    bool present[deviceInfoFields - firstStringField] = {
+      dev._hasSerialNumber, dev._hasManufacturer, dev._hasProduct
+    };
+    uint32_t loaded = 0;
+    for (int j = firstStringField; j < deviceInfoFields; j++) {
+      if (present[j - firstStringField]) {
+        deviceInfo->SetAccessor(keys[j], deviceInfoString, setDeviceInfoString, NanNew<Integer>(j - firstStringField));
+      } else {
+        loaded |= 1 << (j - firstStringField);
+      }
+    }
+    deviceInfo->SetInternalField(loadedSlot, NanNew<Integer>(loaded));
+    retval->Set(i, deviceInfo);
+  }
+  return NanEscapeScope(retval);
+}
+
+static Local<Object>
+deviceInfoToJS(const DeviceInfo& dev)
+{
+  NanEscapableScope();
+
+  return NanEscapeScope(deviceInfosToJS(vector<DeviceInfo>(1, dev))->Get(0)->ToObject());
+}
+
+// //////////////////////////////////////////////////////////////////
+// All enumeration goes through one cache, see DeviceCache.h
+// //////////////////////////////////////////////////////////////////
+static DeviceCache deviceCache;
+
+// Reads the first count arguments of HID.devices() or
+// HID.devicesAsync(): nothing, a vendor and product ID, or an object
+// with any of vendorId, productId, usagePage, usage and path
+static void
+readDeviceFilter(_NAN_METHOD_ARGS_TYPE args, int count, DeviceFilter& filter)
+{
+  switch (count) {
+  case 0:
+    break;
+  case 1: {
+    if (!args[0]->IsObject()) {
+      throw JSException("unexpected device filter, expecting an object");
+    }
+    Local<Object> object = args[0]->ToObject();
+    Local<Value> value;
+    if (!(value = object->Get(NanNew<String>("vendorId")))->IsUndefined()) {
+      filter._vendorId = value->Int32Value();
+    }
+    if (!(value = object->Get(NanNew<String>("productId")))->IsUndefined()) {
+      filter._productId = value->Int32Value();
+    }
+    if (!(value = object->Get(NanNew<String>("usagePage")))->IsUndefined()) {
+      filter._usagePage = value->Int32Value();
+    }
+    if (!(value = object->Get(NanNew<String>("usage")))->IsUndefined()) {
+      filter._usage = value->Int32Value();
+    }
+    if (!(value = object->Get(NanNew<String>("path")))->IsUndefined()) {
+      filter._path = *NanUtf8String(value);
+    }
+    break;
+  }
+  case 2:
+    filter._vendorId = args[0]->Int32Value();
+    filter._productId = args[1]->Int32Value();
+    break;
+  default:
+    throw JSException("unexpected number of arguments, expecting either no arguments, vendor and product ID or a filter object");
+  }
+}
+
+NAN_METHOD(HID::devices)
+{
+  NanScope();
+
+  try {
+    DeviceFilter filter;
+    readDeviceFilter(args, args.Length(), filter);
+
+    vector<DeviceInfo> devices;
+    deviceCache.lookup(filter, devices);
+    NanReturnValue(deviceInfosToJS(devices));
+  }
+  catch (JSException& e) {
+    e.throwAsV8Exception();
+    NanReturnUndefined();
+  }
+}
+
+struct EnumerateIOCB {
+  EnumerateIOCB(const DeviceFilter& filter, NanCallback* callback)
+    : _filter(filter),
+      _callback(callback)
+  {}
+
+  DeviceFilter _filter;
+  NanCallback* _callback;
+  vector<DeviceInfo> _devices;
+};
+
+static void
+enumerateAsync(uv_work_t* req)
+{
+  EnumerateIOCB* iocb = static_cast<EnumerateIOCB*>(req->data);
+  deviceCache.lookup(iocb->_filter, iocb->_devices);
+}
+
+static void
+enumerateAsyncDone(uv_work_t* req)
+{
+  NanScope();
+  EnumerateIOCB* iocb = static_cast<EnumerateIOCB*>(req->data);
+
+  Local<Value> argv[2];
+  argv[0] = NanUndefined();
+  argv[1] = deviceInfosToJS(iocb->_devices);
+
+  TryCatch tryCatch;
+  iocb->_callback->Call(2, argv);
+
+  if (tryCatch.HasCaught()) {
+    FatalException(tryCatch);
+  }
+
+  delete iocb->_callback;
+  delete iocb;
+  delete req;
+}
+
+NAN_METHOD(HID::devicesAsync)
+{
+  NanScope();
+
+  if (args.Length() < 1
+      || !args[args.Length() - 1]->IsFunction()) {
+    NanThrowError("need callback function as last argument in HID.devicesAsync()");
+    NanReturnUndefined();
+  }
+
+  try {
+    DeviceFilter filter;
+    readDeviceFilter(args, args.Length() - 1, filter);
+
+    uv_work_t* req = new uv_work_t;
+    req->data = new EnumerateIOCB(filter, new NanCallback(Local<Function>::Cast(args[args.Length() - 1])));
+    uv_queue_work(uv_default_loop(), req, enumerateAsync, (uv_after_work_cb)enumerateAsyncDone);
+
+    NanReturnUndefined();
+  }
+  catch (JSException& e) {
+    e.throwAsV8Exception();
+    NanReturnUndefined();
+  }
+}
+
+// //////////////////////////////////////////////////////////////////
+// Report descriptors and decoding of report fields
+// //////////////////////////////////////////////////////////////////
+void
+HID::getReportDescriptor(vector<unsigned char>& descriptor)
+{
+  if (!_hidHandle) {
+    throw JSException("cannot get the report descriptor of a closed device");
+  }
+#ifdef HID_DRIVER_HIDRAW
+  // hidapi does not expose descriptors, but hidraw nodes do
+  if (_path.empty()) {
+    throw JSException("report descriptors are only available for devices opened by path");
+  }
+  int fd = ::open(_path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    throw JSException("cannot open device to get the report descriptor");
+  }
+  int size = 0;
+  struct hidraw_report_descriptor report;
+  if (ioctl(fd, HIDIOCGRDESCSIZE, &size) < 0 || size < 0 || size > HID_MAX_DESCRIPTOR_SIZE) {
+    ::close(fd);
+    throw JSException("cannot get the report descriptor size");
+  }
+  report.size = size;
+  if (ioctl(fd, HIDIOCGRDESC, &report) < 0) {
+    ::close(fd);
+    throw JSException("cannot get the report descriptor");
+  }
+  ::close(fd);
+  descriptor.assign(report.value, report.value + report.size);
+#else
+  throw JSException("report descriptors cannot be read with this driver, pass one to HID.parseReportDescriptor()");
+#endif
+}
+
+static const char*
+reportTypeName(ReportField::Type type)
+{
+  switch (type) {
+  case ReportField::output:
+    return "output";
+  case ReportField::feature:
+    return "feature";
+  default:
+    return "input";
+  }
+}
+
+static Local<Object>
+reportFieldToJS(const ReportField& field)
+{
+  NanEscapableScope();
+
+  Local<Object> result = NanNew<Object>();
+  result->Set(NanNew<String>("type"), NanNew<String>(reportTypeName(field._type)));
+  result->Set(NanNew<String>("reportId"), NanNew<Integer>(field._reportId));
+  result->Set(NanNew<String>("bitOffset"), NanNew<Integer>((unsigned int) field._bitOffset));
+  result->Set(NanNew<String>("bitSize"), NanNew<Integer>((unsigned int) field._bitSize));
+  result->Set(NanNew<String>("count"), NanNew<Integer>((unsigned int) field._count));
+  result->Set(NanNew<String>("variable"), NanNew<Boolean>((field._flags & ReportField::variable) != 0));
+  result->Set(NanNew<String>("relative"), NanNew<Boolean>((field._flags & ReportField::relative) != 0));
+  result->Set(NanNew<String>("signed"), NanNew<Boolean>(field.isSigned()));
+  result->Set(NanNew<String>("logicalMinimum"), NanNew<Integer>(field._logicalMinimum));
+  result->Set(NanNew<String>("logicalMaximum"), NanNew<Integer>(field._logicalMaximum));
+  result->Set(NanNew<String>("usagePage"), NanNew<Integer>((field._usages.empty() ? field._usageMinimum : field._usages[0]) >> 16));
+  Local<Array> usages = NanNew<Array>(field._usages.size());
+  for (size_t i = 0; i < field._usages.size(); i++) {
+    usages->Set(i, NanNew<Number>(field._usages[i]));
+  }
+  result->Set(NanNew<String>("usages"), usages);
+  result->Set(NanNew<String>("usageMinimum"), NanNew<Number>(field._usageMinimum));
+  result->Set(NanNew<String>("usageMaximum"), NanNew<Number>(field._usageMaximum));
+  return NanEscapeScope(result);
+}
+
+NAN_METHOD(HID::parseReportDescriptor)
+{
+  NanScope();
+
+  if (args.Length() != 1) {
+    NanThrowError("need report descriptor argument in HID.parseReportDescriptor()");
+    NanReturnUndefined();
+  }
+
+  try {
+    ReportData descriptor(args[0]);
+    vector<ReportField> fields;
+    if (!::parseReportDescriptor(descriptor.data(), descriptor.length(), fields)) {
+      throw JSException("malformed report descriptor");
+    }
+    Local<Array> result = NanNew<Array>(fields.size());
+    for (size_t i = 0; i < fields.size(); i++) {
+      result->Set(i, reportFieldToJS(fields[i]));
+    }
+    NanReturnValue(result);
+  }
+  catch (const JSException& e) {
+    e.throwAsV8Exception();
+    NanReturnUndefined();
+  }
+}
+
+NAN_METHOD(HID::getReportDescriptor)
+{
+  NanScope();
+
+  try {
+    HID* hid = ObjectWrap::Unwrap<HID>(args.This());
+    vector<unsigned char> descriptor;
+    hid->getReportDescriptor(descriptor);
+    NanReturnValue(newReportBuffer(descriptor.empty() ? 0 : &descriptor[0], descriptor.size()));
+  }
+  catch (const JSException& e) {
+    e.throwAsV8Exception();
+    NanReturnUndefined();
+  }
+}
+
+// Decodes reports into a Float64Array with the values of the fields
+// it was constructed with, see FieldExtractor
+class ReportDecoder
+  : public ObjectWrap
+{
+public:
+  static void Initialize(Handle<Object> target);
+
+private:
+  ReportDecoder(const vector<ReportField>& fields) : _extractor(fields) {}
+
+  static NAN_METHOD(New);
+  static NAN_METHOD(decode);
+
+  FieldExtractor _extractor;
+};
+
+NAN_METHOD(ReportDecoder::New)
+{
+  NanScope();
+
+  if (args.Length() != 1
+      || !args[0]->IsArray()) {
+    NanThrowError("need array of report fields as argument to ReportDecoder constructor");
+    NanReturnUndefined();
+  }
+
+  // Takes the fields as returned by HID.parseReportDescriptor(), or
+  // written by hand
+  Local<Array> fieldArray = Local<Array>::Cast(args[0]);
+  vector<ReportField> fields;
+  for (unsigned i = 0; i < fieldArray->Length(); i++) {
+    if (!fieldArray->Get(i)->IsObject()) {
+      NanThrowError("unexpected element in array of report fields, expecting only objects");
+      NanReturnUndefined();
+    }
+    Local<Object> object = fieldArray->Get(i)->ToObject();
+    ReportField field;
+    field._reportId = object->Get(NanNew<String>("reportId"))->Uint32Value();
+    field._bitOffset = object->Get(NanNew<String>("bitOffset"))->Uint32Value();
+    field._bitSize = object->Get(NanNew<String>("bitSize"))->Uint32Value();
+    Local<Value> count = object->Get(NanNew<String>("count"));
+    field._count = count->IsUndefined() ? 1 : count->Uint32Value();
+    Local<Value> isSigned = object->Get(NanNew<String>("signed"));
+    field._logicalMinimum = isSigned->IsUndefined()
+      ? object->Get(NanNew<String>("logicalMinimum"))->Int32Value()
+      : (isSigned->BooleanValue() ? -1 : 0);
+    if (!field._bitSize || field._bitSize > 32) {
+      NanThrowError("report fields must be 1 to 32 bits wide");
+      NanReturnUndefined();
+    }
+    fields.push_back(field);
+  }
+
+  ReportDecoder* decoder = new ReportDecoder(fields);
+  decoder->Wrap(args.This());
+  args.This()->Set(NanNew<String>("valueCount"), NanNew<Integer>((unsigned int) decoder->_extractor.valueCount()));
+  NanReturnValue(args.This());
+}
+
+NAN_METHOD(ReportDecoder::decode)
+{
+  NanScope();
+
+  if (args.Length() < 1 || args.Length() > 2
+      || (args.Length() == 2 && !args[1]->IsArray())) {
+    NanThrowError("need report and optional offsets array arguments in decode");
+    NanReturnUndefined();
+  }
+
+  try {
+    ReportDecoder* decoder = ObjectWrap::Unwrap<ReportDecoder>(args.This());
+    ReportData reports(args[0]);
+
+    // A batch as delivered with the "reports" event, or one report
+    vector<size_t> offsets;
+    if (args.Length() == 2) {
+      Local<Array> offsetArray = Local<Array>::Cast(args[1]);
+      for (unsigned i = 0; i < offsetArray->Length(); i++) {
+        size_t offset = offsetArray->Get(i)->Uint32Value();
+        if (offset > reports.length() || (!offsets.empty() && offset < offsets.back())) {
+          throw JSException("report offsets must be ascending and within the reports");
+        }
+        offsets.push_back(offset);
+      }
+    } else {
+      offsets.push_back(0);
+      offsets.push_back(reports.length());
+    }
+    size_t count = offsets.empty() ? 0 : offsets.size() - 1;
+    size_t valueCount = decoder->_extractor.valueCount();
+
+    if (addonState->_float64Array.IsEmpty()) {
+      throw JSException("decoding reports needs Float64Array");
+    }
+    Local<Function> constructor = NanNew(addonState->_float64Array);
+    Local<Value> argv[1];
+    argv[0] = NanNew<Integer>((unsigned int) (count * valueCount));
+    Local<Object> values = constructor->NewInstance(1, argv);
+    double* data = static_cast<double*>(values->GetIndexedPropertiesExternalArrayData());
+
+    for (size_t i = 0; i < count; i++) {
+      decoder->_extractor.decode(reports.data() + offsets[i], offsets[i + 1] - offsets[i], data + i * valueCount);
+    }
+    NanReturnValue(values);
+  }
+  catch (const JSException& e) {
+    e.throwAsV8Exception();
+    NanReturnUndefined();
+  }
+}
+
+void
+ReportDecoder::Initialize(Handle<Object> target)
+{
+  NanScope();
+
+  if (addonState->_float64Array.IsEmpty()) {
+    Local<Value> constructor = NanGetCurrentContext()->Global()->Get(NanNew<String>("Float64Array"));
+    if (constructor->IsFunction()) {
+      NanAssignPersistent(addonState->_float64Array, Local<Function>::Cast(constructor));
+    }
+  }
+
+  Local<FunctionTemplate> decoderTemplate = NanNew<FunctionTemplate>(ReportDecoder::New);
+  decoderTemplate->InstanceTemplate()->SetInternalFieldCount(1);
+  decoderTemplate->SetClassName(NanNew<String>("ReportDecoder"));
+
+  NODE_SET_PROTOTYPE_METHOD(decoderTemplate, "decode", decode);
+
+  target->Set(NanNew<String>("ReportDecoder"), decoderTemplate->GetFunction());
+}
+
+// //////////////////////////////////////////////////////////////////
+// Several devices read into one ring, which hands the reports of all
+// of them to a single callback in batches, tagged with the index of
+// the device they came from.  JavaScript is woken up once per batch
+// through a single uv_async_t, however many devices there are.  Only
+// the hidraw poller reads them without a thread per device.
+// //////////////////////////////////////////////////////////////////
+class DeviceGroup
+  : public ObjectWrap
+{
+public:
+  static void Initialize(Handle<Object> target);
+
+  void close();
+  // Waits until the device threads still finishing after close() are
+  // done
+  void waitForHandleUsers();
+
+private:
+  struct Reader;
+
+#ifdef HID_DRIVER_HIDRAW
+  // One member's descriptor, polled on the shared epoll thread.  All
+  // clients are called from that thread, so the ring still has a
+  // single producer.
+  struct PolledInput
+    : public HidrawPoller::Client
+  {
+    PolledInput(Reader* reader, unsigned int device) : _reader(reader), _device(device), _fd(-1) {}
+    bool readable(int fd);
+
+    Reader* _reader;
+    unsigned int _device;
+    int _fd;
+  };
+#endif
+
+  // One member read through hidapi by a blocking thread of its own
+  struct DeviceThread {
+    Reader* _reader;
+    unsigned int _device;
+    hid_device* _handle; // acquired for _thread
+    uv_thread_t _thread;
+  };
+
+  // Deleted when its async handle has been closed
+  struct Reader {
+    Reader(DeviceGroup* group, NanCallback* callback, size_t maxBatch)
+      : _group(group),
+        _callback(callback),
+        _maxBatch(maxBatch),
+        _ring(ringCapacity, slotSize),
+        _running(true)
+    {
+      uv_mutex_init(&_lock);
+      _join.data = this;
+    }
+
+    ~Reader()
+    {
+      delete _callback;
+      uv_mutex_destroy(&_lock);
+    }
+
+    // Called from the reading thread for each report read into slot,
+    // which is 0 if the ring was full and the report was read into
+    // data instead.  Returns whether JS needs waking up.
+    bool received(unsigned char* slot, const unsigned char* data, unsigned int device, size_t length);
+    // Like received(), for a device thread's report in data.  The
+    // device threads take turns producing into the ring.
+    bool push(const unsigned char* data, unsigned int device, size_t length);
+    // Called from the reading thread once a device can't be read
+    void failed(unsigned int device);
+    vector<uv_thread_t> threads() const;
+#ifdef HID_DRIVER_HIDRAW
+    void removeInputs();
+#endif
+
+    static const size_t ringCapacity = 1024;
+    static const size_t slotSize = 1024;
+    // hidapi cannot interrupt a blocked read, so device threads wait
+    // for reports in slices of this length, checking whether to stop
+    // in between.  Stopped threads are joined on the threadpool.
+    static const int readPollInterval = 50; // ms
+
+    DeviceGroup* _group;
+    NanCallback* _callback;
+    size_t _maxBatch;
+    // One per member, or empty if the poller reads the devices.  Not
+    // resized once the threads are running.
+    vector<DeviceThread> _threads;
+    uv_work_t _join;
+    uv_async_t _async;
+    ReportRing _ring;
+    std::atomic<bool> _running;
+    // Protects _failed and, for the device threads, the producer side
+    // of _ring
+    uv_mutex_t _lock;
+    // Devices that could not be read
+    vector<unsigned int> _failed;
+#ifdef HID_DRIVER_HIDRAW
+    // Polled descriptors of all devices, or empty if _threads read
+    // them through hidapi
+    vector<PolledInput*> _inputs;
+#endif
+  };
+
+  DeviceGroup()
+    : _reader(0),
+      _handleUsers(0)
+  {
+    uv_mutex_init(&_handleLock);
+    uv_cond_init(&_handleReleased);
+    uv_cond_init(&_inputReleased);
+    addonState->_groups.insert(this);
+  }
+  ~DeviceGroup();
+
+  void startReader(NanCallback* callback, size_t maxBatch);
+  void stopReader();
+  void deliverReports();
+  bool deliverBatch(Reader* reader);
+
+  // Like the HID methods of the same names, for all members at once
+  // and for the input of a single one
+  void acquireHandles(size_t users);
+  void releaseHandle();
+  bool claimInput(unsigned int device, int timeout);
+  void releaseInput(unsigned int device);
+
+  static void deviceThread(void* arg);
+  static void joinThreads(uv_work_t* req);
+  static void threadsJoined(uv_work_t* req);
+  static NAUV_WORK_CB(readerWakeup);
+  static void readerClosed(uv_handle_t* handle);
+
+  static NAN_METHOD(New);
+  static NAN_METHOD(readStart);
+  static NAN_METHOD(readStop);
+  static NAN_METHOD(write);
+  static NAN_METHOD(close);
+  static NAN_METHOD(stats);
+  static NAN_METHOD(setThreadPolicy);
+
+  vector<hid_device*> _handles;
+  vector<string> _paths;
+  // One per member, kept until the group is destroyed
+  vector<CaptureSource*> _captures;
+  DeviceStats _stats;
+  Reader* _reader;
+  // Scheduling of the device threads
+  ThreadPolicy _threadPolicy;
+  // Device threads still finishing their last read keep the handles
+  // open; close() leaves them to the last of them
+  uv_mutex_t _handleLock;
+  uv_cond_t _handleReleased;
+  unsigned int _handleUsers;
+  vector<hid_device*> _orphanedHandles;
+  // Set while a device thread reads the member, protected by
+  // _handleLock
+  vector<bool> _inputClaimed;
+  uv_cond_t _inputReleased;
+};
+
+DeviceGroup::~DeviceGroup()
+{
+  close();
+  waitForHandleUsers();
+  for (size_t i = 0; i < _captures.size(); i++) {
+    delete _captures[i];
+  }
+  if (addonState) {
+    addonState->_groups.erase(this);
+  }
+  uv_cond_destroy(&_inputReleased);
+  uv_cond_destroy(&_handleReleased);
+  uv_mutex_destroy(&_handleLock);
+}
+
+void
+DeviceGroup::close()
+{
+  stopReader();
+  uv_mutex_lock(&_handleLock);
+  if (_handleUsers) {
+    _orphanedHandles.insert(_orphanedHandles.end(), _handles.begin(), _handles.end());
+    _handles.clear();
+  }
+  uv_mutex_unlock(&_handleLock);
+  for (size_t i = 0; i < _handles.size(); i++) {
+    hid_close(_handles[i]);
+  }
+  _handles.clear();
+}
+
+void
+DeviceGroup::acquireHandles(size_t users)
+{
+  uv_mutex_lock(&_handleLock);
+  _handleUsers += users;
+  uv_mutex_unlock(&_handleLock);
+}
+
+void
+DeviceGroup::releaseHandle()
+{
+  vector<hid_device*> orphaned;
+  uv_mutex_lock(&_handleLock);
+  if (!--_handleUsers) {
+    uv_cond_signal(&_handleReleased);
+    orphaned.swap(_orphanedHandles);
+  }
+  uv_mutex_unlock(&_handleLock);
+  for (size_t i = 0; i < orphaned.size(); i++) {
+    hid_close(orphaned[i]);
+  }
+}
+
+void
+DeviceGroup::waitForHandleUsers()
+{
+  uv_mutex_lock(&_handleLock);
+  while (_handleUsers) {
+    uv_cond_wait(&_handleReleased, &_handleLock);
+  }
+  uv_mutex_unlock(&_handleLock);
+}
+
+bool
+DeviceGroup::claimInput(unsigned int device, int timeout)
+{
+  uv_mutex_lock(&_handleLock);
+  if (_inputClaimed[device] && timeout > 0) {
+    uv_cond_timedwait(&_inputReleased, &_handleLock, (uint64_t) timeout * 1000000);
+  }
+  bool claimed = !_inputClaimed[device];
+  _inputClaimed[device] = true;
+  uv_mutex_unlock(&_handleLock);
+  return claimed;
+}
+
+void
+DeviceGroup::releaseInput(unsigned int device)
+{
+  uv_mutex_lock(&_handleLock);
+  _inputClaimed[device] = false;
+  uv_cond_broadcast(&_inputReleased);
+  uv_mutex_unlock(&_handleLock);
+}
+
+void
+DeviceGroup::startReader(NanCallback* callback, size_t maxBatch)
+{
+  if (_handles.empty() || _reader) {
+    delete callback;
+    throw JSException(_reader ? "device group is already being read" : "cannot read from a closed device group");
+  }
+
+  Reader* reader = new Reader(this, callback, maxBatch ? maxBatch : 1);
+  uv_async_init(uv_default_loop(), &reader->_async, readerWakeup);
+  reader->_async.data = reader;
+
+#ifdef HID_DRIVER_HIDRAW
+  // The poller is used only if it can take every device, otherwise
+  // the threads read them all.  A thread policy needs the threads.
+  for (unsigned int i = 0; _threadPolicy.isDefault() && i < _paths.size(); i++) {
+    PolledInput* input = new PolledInput(reader, i);
+    input->_fd = ::open(_paths[i].c_str(), O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+    if (input->_fd < 0 || !hidrawPoller.add(input->_fd, input)) {
+      if (input->_fd >= 0) {
+        ::close(input->_fd);
+      }
+      delete input;
+      reader->removeInputs();
+      break;
+    }
+    reader->_inputs.push_back(input);
+  }
+  if (reader->_inputs.empty())
+#endif
+  {
+    reader->_threads.resize(_handles.size());
+    acquireHandles(_handles.size());
+    for (unsigned int i = 0; i < _handles.size(); i++) {
+      DeviceThread& thread = reader->_threads[i];
+      thread._reader = reader;
+      thread._device = i;
+      thread._handle = _handles[i];
+      if (uv_thread_create(&thread._thread, deviceThread, &thread)) {
+        // Stopped along with the threads already running
+        for (unsigned int j = i; j < _handles.size(); j++) {
+          releaseHandle();
+        }
+        reader->_threads.resize(i);
+        _reader = reader;
+        Ref();
+        stopReader();
+        throw JSException("cannot create reader thread");
+      }
+    }
+  }
+
+  _reader = reader;
+  Ref();
+  string error;
+  if (!reader->_threads.empty() && !_threadPolicy.isDefault()
+      && !applyThreadPolicy(reader->threads(), _threadPolicy, ThreadPolicy(), error)) {
+    stopReader();
+    throw JSException(error);
+  }
+}
+
+void
+DeviceGroup::stopReader()
+{
+  Reader* reader = _reader;
+  if (!reader) {
+    return;
+  }
 
-  if (returnedLength == -1) {
-    delete[] buf;
-    NanThrowError("could not get feature report from device");
+  // Reports still in the ring are discarded along with the reader
+  _reader = 0;
+  reader->_running = false;
+#ifdef HID_DRIVER_HIDRAW
+  reader->removeInputs();
+#endif
+  if (reader->_threads.empty()) {
+    uv_close((uv_handle_t*) &reader->_async, readerClosed);
+    Unref();
+  } else {
+    // The threads notice within one poll interval, and may still wake
+    // up the loop until then.  The group stays referenced until they
+    // have been joined.
+    uv_queue_work(uv_default_loop(), &reader->_join, joinThreads, (uv_after_work_cb)threadsJoined);
   }
-  Local<Array> retval = NanNew<Array>();
+}
 
-  for (int i = 0; i < returnedLength; i++) {
-    retval->Set(i, NanNew<Integer>(buf[i]));
+void
+DeviceGroup::deviceThread(void* arg)
+{
+  DeviceThread* thread = static_cast<DeviceThread*>(arg);
+  Reader* reader = thread->_reader;
+  DeviceGroup* group = reader->_group;
+  unsigned char report[Reader::slotSize];
+
+  // A stopped reader's thread may still be in its last read
+  bool claimed = false;
+  while (reader->_running && !(claimed = group->claimInput(thread->_device, Reader::readPollInterval)))
+    ;
+  while (claimed && reader->_running) {
+    int len = hid_read_timeout(thread->_handle, report, sizeof report, Reader::readPollInterval);
+    if (len < 0) {
+      // The other devices keep being read
+      reader->failed(thread->_device);
+      break;
+    }
+    if (len > 0 && reader->push(report, thread->_device, len)) {
+      uv_async_send(&reader->_async);
+    }
   }
-  delete[] buf;
-  NanReturnValue(retval);
+  if (claimed) {
+    group->releaseInput(thread->_device);
+  }
+  group->releaseHandle();
 }
 
+void
+DeviceGroup::joinThreads(uv_work_t* req)
+{
+  Reader* reader = static_cast<Reader*>(req->data);
+  for (size_t i = 0; i < reader->_threads.size(); i++) {
+    uv_thread_join(&reader->_threads[i]._thread);
+  }
+}
 
-NAN_METHOD(HID::sendFeatureReport)
+void
+DeviceGroup::threadsJoined(uv_work_t* req)
 {
-  NanScope();
+  Reader* reader = static_cast<Reader*>(req->data);
+  DeviceGroup* group = reader->_group;
+  uv_close((uv_handle_t*) &reader->_async, readerClosed);
+  group->Unref();
+}
 
-  if (args.Length() != 1){
-    NanThrowError("need report (including id in first byte) only in sendFeatureReport");
+bool
+DeviceGroup::Reader::received(unsigned char* slot, const unsigned char* data, unsigned int device, size_t length)
+{
+  _group->_captures[device]->record(CaptureFormat::input, data, length);
+  if (!slot) {
+    _group->_stats._droppedReports++;
+    return false;
   }
+  _ring.commit(length, uv_hrtime(), device);
+  _group->_stats.countRead(length);
+  return true;
+}
 
+bool
+DeviceGroup::Reader::push(const unsigned char* data, unsigned int device, size_t length)
+{
+  uv_mutex_lock(&_lock);
+  unsigned char* slot = _ring.reserve();
+  if (slot) {
+    memcpy(slot, data, length);
+  }
+  bool wake = received(slot, data, device, length);
+  uv_mutex_unlock(&_lock);
+  return wake;
+}
 
-  HID* hid = ObjectWrap::Unwrap<HID>(args.This());
+void
+DeviceGroup::Reader::failed(unsigned int device)
+{
+  _group->_stats._readErrors++;
+  uv_mutex_lock(&_lock);
+  _failed.push_back(device);
+  uv_mutex_unlock(&_lock);
+  uv_async_send(&_async);
+}
 
-  vector<unsigned char> message;
-  Local<Array> messageArray = Local<Array>::Cast(args[0]);
-  for (unsigned i = 0; i < messageArray->Length(); i++) {
-    if (!messageArray->Get(i)->IsNumber()) {
-      throw JSException("unexpected array element in array to send, expecting only integers");
+vector<uv_thread_t>
+DeviceGroup::Reader::threads() const
+{
+  vector<uv_thread_t> threads;
+  for (size_t i = 0; i < _threads.size(); i++) {
+    threads.push_back(_threads[i]._thread);
+  }
+  return threads;
+}
+
+#ifdef HID_DRIVER_HIDRAW
+void
+DeviceGroup::Reader::removeInputs()
+{
+  for (size_t i = 0; i < _inputs.size(); i++) {
+    hidrawPoller.remove(_inputs[i]);
+    ::close(_inputs[i]->_fd);
+    delete _inputs[i];
+  }
+  _inputs.clear();
+}
+
+bool
+DeviceGroup::PolledInput::readable(int fd)
+{
+  Reader* reader = _reader;
+  unsigned char overflow[Reader::slotSize];
+  bool wake = false;
+
+  while (true) {
+    unsigned char* slot = reader->_ring.reserve();
+    ssize_t len = ::read(fd, slot ? slot : overflow, Reader::slotSize);
+    if (len < 0 && errno == EINTR) {
+      continue;
+    }
+    if (len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      break;
+    }
+    if (len <= 0) {
+      reader->failed(_device);
+      return false;
     }
-    message.push_back((unsigned char) messageArray->Get(i)->Int32Value());
+    wake = reader->received(slot, slot ? slot : overflow, _device, len) || wake;
   }
 
-  // Convert vector to char array
-  //unsigned char buf[message.size()];
-  unsigned char* buf = new unsigned char[message.size()];
-  unsigned char* p = buf;
-  for (vector<unsigned char>::const_iterator i = message.begin(); i != message.end(); i++) {
-    *p++ = *i;
+  if (wake) {
+    uv_async_send(&reader->_async);
   }
+  return true;
+}
+#endif
 
-  int returnedLength = hid_send_feature_report(hid->_hidHandle, buf, message.size());
-  delete[] buf;
-  if (returnedLength == -1) { // Not sure if there would ever be a valid return value of 0. 
-    NanThrowError("could not send feature report to device");
+NAUV_WORK_CB(DeviceGroup::readerWakeup)
+{
+  Reader* reader = static_cast<Reader*>(async->data);
+  reader->_group->deliverReports();
+}
+
+void
+DeviceGroup::readerClosed(uv_handle_t* handle)
+{
+  delete static_cast<Reader*>(handle->data);
+}
+
+void
+DeviceGroup::deliverReports()
+{
+  NanScope();
+  Reader* reader = _reader;
+
+  // Callbacks may stop reading or close the group
+  while (_reader == reader && deliverBatch(reader))
+    ;
+
+  vector<unsigned int> failed;
+  if (_reader == reader) {
+    uv_mutex_lock(&reader->_lock);
+    failed.swap(reader->_failed);
+    uv_mutex_unlock(&reader->_lock);
   }
+  for (size_t i = 0; i < failed.size() && _reader == reader; i++) {
+    // The other devices keep being read
+    Local<Object> error = Exception::Error(NanNew<String>("could not read from HID device"))->ToObject();
+    error->Set(NanNew<String>("device"), NanNew<Integer>(failed[i]));
+    Local<Value> argv[1];
+    argv[0] = error;
 
-  NanReturnValue(NanNew<Integer>(returnedLength));
+    TryCatch tryCatch;
+    reader->_callback->Call(1, argv);
+
+    if (tryCatch.HasCaught()) {
+      FatalException(tryCatch);
+    }
+  }
 }
 
+bool
+DeviceGroup::deliverBatch(Reader* reader)
+{
+  NanScope();
+
+  size_t count = 0;
+  size_t total = 0;
+  size_t length;
+  while (count < reader->_maxBatch && reader->_ring.peek(count, length)) {
+    total += length;
+    count++;
+  }
+  if (!count) {
+    return false;
+  }
+
+  char* p;
+  Local<Object> buf = newReportBuffer(total, p);
+  Local<Array> offsets = NanNew<Array>(count + 1);
+  Local<Array> timestamps = NanNew<Array>(count);
+  Local<Array> devices = NanNew<Array>(count);
+  size_t offset = 0;
+  uint64_t now = uv_hrtime();
+  uint64_t received;
+  unsigned int device;
+  for (size_t i = 0; i < count; i++) {
+    const unsigned char* data = reader->_ring.peek(i, length, received, device);
+    memcpy(p + offset, data, length);
+    offsets->Set(i, NanNew<Integer>((unsigned int) offset));
+    timestamps->Set(i, timestampToJS(received));
+    devices->Set(i, NanNew<Integer>(device));
+    offset += length;
+    _stats._deliveryLatency.record(now - received);
+  }
+  offsets->Set(count, NanNew<Integer>((unsigned int) offset));
+  reader->_ring.release(count);
 
+  Local<Value> argv[5];
+  argv[0] = NanUndefined();
+  argv[1] = buf;
+  argv[2] = offsets;
+  argv[3] = timestamps;
+  argv[4] = devices;
 
+  TryCatch tryCatch;
+  reader->_callback->Call(5, argv);
 
-NAN_METHOD(HID::New)
+  if (tryCatch.HasCaught()) {
+    FatalException(tryCatch);
+  }
+  return true;
+}
+
+NAN_METHOD(DeviceGroup::New)
 {
   NanScope();
 
   if (!args.IsConstructCall()) {
-    NanThrowError("HID function can only be used as a constructor");
+    NanThrowError("DeviceGroup function can only be used as a constructor");
+    NanReturnUndefined();
   }
-
-  if (args.Length() < 1) {
-    NanThrowError("HID constructor requires at least one argument");
+  if (args.Length() != 1
+      || !args[0]->IsArray()) {
+    NanThrowError("need array of device paths as argument to DeviceGroup constructor");
+    NanReturnUndefined();
   }
 
-  try {
-    HID* hid;
-    if (args.Length() == 1) {
-      // open by path
-      hid = new HID(*NanUtf8String(args[0]));
-    } else {
-      int32_t vendorId = args[0]->Int32Value();
-      int32_t productId = args[1]->Int32Value();
-      Handle<Value> serial;
-      wchar_t* serialPointer = 0;
-      if (args.Length() > 2) {
-        serialPointer = (wchar_t*) *NanUcs2String(args[2]);
-      }
-      hid = new HID(vendorId, productId, serialPointer);
+  Local<Array> paths = Local<Array>::Cast(args[0]);
+  DeviceGroup* group = new DeviceGroup;
+  for (unsigned i = 0; i < paths->Length(); i++) {
+    string path = *NanUtf8String(paths->Get(i));
+    hid_device* handle = openDevice(path.c_str());
+    if (!handle) {
+      delete group;
+      ostringstream os;
+      os << "cannot open device with path " << path;
+      NanThrowError(os.str().c_str());
+      NanReturnUndefined();
     }
-    hid->Wrap(args.This());
-    NanReturnValue(args.This());
-  }
-  catch (const JSException& e) {
-    e.throwAsV8Exception();
-    NanReturnUndefined(); // make the compiler happy
+    group->_handles.push_back(handle);
+    group->_paths.push_back(path);
+    group->_captures.push_back(new CaptureSource(path));
+    group->_inputClaimed.push_back(false);
   }
+  group->Wrap(args.This());
+  NanReturnValue(args.This());
 }
 
-NAN_METHOD(HID::close)
+NAN_METHOD(DeviceGroup::readStart)
 {
   NanScope();
 
+  if (args.Length() < 1 || args.Length() > 2
+      || !args[0]->IsFunction()) {
+    NanThrowError("need callback function and optional batch size arguments in readStart");
+    NanReturnUndefined();
+  }
+
   try {
-    HID* hid = ObjectWrap::Unwrap<HID>(args.This());
-    hid->close();
+    DeviceGroup* group = ObjectWrap::Unwrap<DeviceGroup>(args.This());
+    size_t maxBatch = args.Length() > 1 ? args[1]->ToUint32()->Value() : 64;
+    group->startReader(new NanCallback(Local<Function>::Cast(args[0])), maxBatch);
     NanReturnUndefined();
   }
   catch (const JSException& e) {
@@ -378,18 +4538,37 @@ NAN_METHOD(HID::close)
   }
 }
 
-NAN_METHOD(HID::setNonBlocking)
+NAN_METHOD(DeviceGroup::readStop)
 {
   NanScope();
 
-  if (args.Length() != 1) {
-    NanThrowError("Expecting a 1 to enable, 0 to disable as the first argument.");
+  DeviceGroup* group = ObjectWrap::Unwrap<DeviceGroup>(args.This());
+  group->stopReader();
+  NanReturnUndefined();
+}
+
+NAN_METHOD(DeviceGroup::write)
+{
+  NanScope();
+
+  if (args.Length() != 2) {
+    NanThrowError("need device index and report arguments in write");
+    NanReturnUndefined();
   }
-  int blockStatus = 0;
-  blockStatus = args[0]->Int32Value();
+
   try {
-    HID* hid = ObjectWrap::Unwrap<HID>(args.This());
-    hid->setNonBlocking(blockStatus);
+    DeviceGroup* group = ObjectWrap::Unwrap<DeviceGroup>(args.This());
+    unsigned int device = args[0]->Uint32Value();
+    if (device >= group->_handles.size()) {
+      throw JSException(group->_handles.empty() ? "cannot write to a closed device group" : "device index out of range");
+    }
+    ReportData message(args[1]);
+    group->_captures[device]->record(CaptureFormat::output, message.data(), message.length());
+    int res = hid_write(group->_handles[device], message.data(), message.length());
+    group->_stats.countWrite(res);
+    if (res < 0) {
+      throw JSException("Cannot write to HID device");
+    }
     NanReturnUndefined();
   }
   catch (const JSException& e) {
@@ -398,27 +4577,64 @@ NAN_METHOD(HID::setNonBlocking)
   }
 }
 
-NAN_METHOD(HID::write)
+NAN_METHOD(DeviceGroup::close)
+{
+  NanScope();
+
+  DeviceGroup* group = ObjectWrap::Unwrap<DeviceGroup>(args.This());
+  group->close();
+  NanReturnUndefined();
+}
+
+NAN_METHOD(DeviceGroup::stats)
+{
+  NanScope();
+
+  DeviceGroup* group = ObjectWrap::Unwrap<DeviceGroup>(args.This());
+  DeviceStats& stats = group->_stats;
+
+  Local<Object> result = NanNew<Object>();
+  result->Set(NanNew<String>("reportsRead"), NanNew<Number>((double) stats._reportsRead));
+  result->Set(NanNew<String>("bytesRead"), NanNew<Number>((double) stats._bytesRead));
+  result->Set(NanNew<String>("readErrors"), NanNew<Number>((double) stats._readErrors));
+  result->Set(NanNew<String>("droppedReports"), NanNew<Number>((double) stats._droppedReports));
+  result->Set(NanNew<String>("writes"), NanNew<Number>((double) stats._writes));
+  result->Set(NanNew<String>("bytesWritten"), NanNew<Number>((double) stats._bytesWritten));
+  result->Set(NanNew<String>("writeErrors"), NanNew<Number>((double) stats._writeErrors));
+  result->Set(NanNew<String>("readQueueDepth"), NanNew<Integer>((unsigned int) (group->_reader ? group->_reader->_ring.size() : 0)));
+  result->Set(NanNew<String>("deliveryLatency"), histogramToJS(stats._deliveryLatency));
+
+  if (args.Length() > 0 && args[0]->BooleanValue()) {
+    stats.reset();
+  }
+
+  NanReturnValue(result);
+}
+
+// Like HID::setThreadPolicy()
+NAN_METHOD(DeviceGroup::setThreadPolicy)
 {
   NanScope();
 
   if (args.Length() != 1) {
-    NanThrowError("HID write requires one argument");
+    NanThrowError("need thread policy object as argument in setThreadPolicy");
+    NanReturnUndefined();
   }
 
   try {
-    HID* hid = ObjectWrap::Unwrap<HID>(args.This());
+    DeviceGroup* group = ObjectWrap::Unwrap<DeviceGroup>(args.This());
+    ThreadPolicy policy;
+    readThreadPolicy(args[0], policy);
 
-    vector<unsigned char> message;
-    Local<Array> messageArray = Local<Array>::Cast(args[0]);
-    for (unsigned i = 0; i < messageArray->Length(); i++) {
-      if (!messageArray->Get(i)->IsNumber()) {
-        throw JSException("unexpected array element in array to send, expecting only integers");
-      }
-      message.push_back((unsigned char) messageArray->Get(i)->Int32Value());
+    string error;
+    Reader* reader = group->_reader;
+    bool applied = reader && !reader->_threads.empty()
+      ? applyThreadPolicy(reader->threads(), policy, group->_threadPolicy, error)
+      : checkThreadPolicy(policy, error);
+    if (!applied) {
+      throw JSException(error);
     }
-    hid->write(message);
-
+    group->_threadPolicy = policy;
     NanReturnUndefined();
   }
   catch (const JSException& e) {
@@ -427,76 +4643,206 @@ NAN_METHOD(HID::write)
   }
 }
 
-static string
-narrow(wchar_t* wide)
+void
+DeviceGroup::Initialize(Handle<Object> target)
+{
+  NanScope();
+
+  Local<FunctionTemplate> groupTemplate = NanNew<FunctionTemplate>(DeviceGroup::New);
+  groupTemplate->InstanceTemplate()->SetInternalFieldCount(1);
+  groupTemplate->SetClassName(NanNew<String>("DeviceGroup"));
+
+  NODE_SET_PROTOTYPE_METHOD(groupTemplate, "readStart", readStart);
+  NODE_SET_PROTOTYPE_METHOD(groupTemplate, "readStop", readStop);
+  NODE_SET_PROTOTYPE_METHOD(groupTemplate, "write", write);
+  NODE_SET_PROTOTYPE_METHOD(groupTemplate, "close", close);
+  NODE_SET_PROTOTYPE_METHOD(groupTemplate, "stats", stats);
+  NODE_SET_PROTOTYPE_METHOD(groupTemplate, "setThreadPolicy", setThreadPolicy);
+
+  target->Set(NanNew<String>("DeviceGroup"), groupTemplate->GetFunction());
+}
+
+NAN_METHOD(HID::setDevicesCacheTimeout)
 {
-  wstring ws(wide);
-  ostringstream os;
-  for (size_t i = 0; i < ws.size(); i++) {
-    os << os.narrow(ws[i], '?');
+  NanScope();
+
+  if (args.Length() != 1
+      || !args[0]->IsNumber()) {
+    NanThrowError("need timeout in milliseconds as argument in HID.setDevicesCacheTimeout()");
+    NanReturnUndefined();
   }
-  return os.str();
+
+  deviceCache.setTimeout(args[0]->Uint32Value());
+  NanReturnUndefined();
 }
 
-NAN_METHOD(HID::devices)
+// //////////////////////////////////////////////////////////////////
+// One capture log holds the reports of all devices in the process
+// //////////////////////////////////////////////////////////////////
+NAN_METHOD(HID::captureStart)
 {
   NanScope();
 
-  int vendorId = 0;
-  int productId = 0;
+  if (args.Length() != 1
+      || !args[0]->IsString()) {
+    NanThrowError("need file name as argument in HID.captureStart()");
+    NanReturnUndefined();
+  }
 
-  try {
-    switch (args.Length()) {
-    case 0:
-      break;
-    case 2:
-      vendorId = args[0]->Int32Value();
-      productId = args[1]->Int32Value();
-      break;
-    default:
-      throw JSException("unexpected number of arguments to HID.devices() call, expecting either no arguments or vendor and product ID");
+  string error;
+  if (!captureLog.start(*NanUtf8String(args[0]), error)) {
+    NanThrowError(error.c_str());
+  }
+  NanReturnUndefined();
+}
+
+NAN_METHOD(HID::captureStop)
+{
+  NanScope();
+
+  CaptureLog::Totals totals;
+  if (!captureLog.stop(totals)) {
+    NanReturnUndefined();
+  }
+  if (totals._writeFailed) {
+    NanThrowError("could not write all of the capture log");
+    NanReturnUndefined();
+  }
+  Local<Object> result = NanNew<Object>();
+  result->Set(NanNew<String>("records"), NanNew<Number>((double) totals._records));
+  result->Set(NanNew<String>("bytes"), NanNew<Number>((double) totals._bytes));
+  result->Set(NanNew<String>("dropped"), NanNew<Number>((double) totals._dropped));
+  NanReturnValue(result);
+}
+
+// //////////////////////////////////////////////////////////////////
+// The hotplug monitor delivers its notifications through one
+// callback
+// //////////////////////////////////////////////////////////////////
+static void
+hotplugNotify(void* data)
+{
+  deviceCache.invalidate();
+  uv_async_send(static_cast<AddonState*>(data)->_hotplugAsync);
+}
+
+static void
+hotplugClosed(uv_handle_t* handle)
+{
+  delete (uv_async_t*) handle;
+}
+
+static NAUV_WORK_CB(hotplugWakeup)
+{
+  NanScope();
+  AddonState* state = static_cast<AddonState*>(async->data);
+
+  vector<HotplugMonitor::Change> changes;
+  state->_hotplugMonitor->takeChanges(changes);
+
+  // The callback may stop the monitor
+  for (size_t i = 0; i < changes.size() && state->_hotplugCallback; i++) {
+    Local<Value> argv[2];
+    argv[0] = NanNew<String>(changes[i]._attached ? "attach" : "detach");
+    argv[1] = deviceInfoToJS(changes[i]._device);
+
+    TryCatch tryCatch;
+    state->_hotplugCallback->Call(2, argv);
+
+    if (tryCatch.HasCaught()) {
+      FatalException(tryCatch);
     }
   }
-  catch (JSException& e) {
-    e.throwAsV8Exception();
+}
+
+static void
+stopHotplug(AddonState* state)
+{
+  if (!state->_hotplugCallback) {
+    return;
   }
-  
-  hid_device_info* devs = hid_enumerate(vendorId, productId);
-  Local<Array> retval = NanNew<Array>();
-  int count = 0;
-  for (hid_device_info* dev = devs; dev; dev = dev->next) {
-    Local<Object> deviceInfo = NanNew<Object>();
-    deviceInfo->Set(NanNew<String>("vendorId"), NanNew<Integer>(dev->vendor_id));
-    deviceInfo->Set(NanNew<String>("productId"), NanNew<Integer>(dev->product_id));
-    if (dev->path) {
-      deviceInfo->Set(NanNew<String>("path"), NanNew<String>(dev->path));
-    }
-    if (dev->serial_number) {
-      deviceInfo->Set(NanNew<String>("serialNumber"), NanNew<String>(narrow(dev->serial_number).c_str()));
-    }
-    if (dev->manufacturer_string) {
-      deviceInfo->Set(NanNew<String>("manufacturer"), NanNew<String>(narrow(dev->manufacturer_string).c_str()));
-    }
-    if (dev->product_string) {
-      deviceInfo->Set(NanNew<String>("product"), NanNew<String>(narrow(dev->product_string).c_str()));
-    }
-    deviceInfo->Set(NanNew<String>("release"), NanNew<Integer>(dev->release_number));
-    deviceInfo->Set(NanNew<String>("interface"), NanNew<Integer>(dev->interface_number));
-    deviceInfo->Set(NanNew<String>("usagePage"), NanNew<Integer>(dev->usage_page));
-    deviceInfo->Set(NanNew<String>("usage"), NanNew<Integer>(dev->usage));
-    retval->Set(count++, deviceInfo);
-  }
-  hid_free_enumeration(devs);
-  NanReturnValue(retval);
+  state->_hotplugMonitor->stop();
+  deviceCache.setWatched(false);
+  uv_close((uv_handle_t*) state->_hotplugAsync, hotplugClosed);
+  state->_hotplugAsync = 0;
+  delete state->_hotplugCallback;
+  state->_hotplugCallback = 0;
+}
+
+NAN_METHOD(HID::hotplugStart)
+{
+  NanScope();
+  AddonState* state = addonState;
+
+  if (args.Length() != 1
+      || !args[0]->IsFunction()) {
+    NanThrowError("need one callback function argument in HID.hotplugStart()");
+    NanReturnUndefined();
+  }
+  if (state->_hotplugCallback) {
+    NanThrowError("hotplug notifications have already been started");
+    NanReturnUndefined();
+  }
+
+  if (!state->_hotplugMonitor) {
+    state->_hotplugMonitor = new HotplugMonitor(hotplugNotify, state);
+  }
+  state->_hotplugAsync = new uv_async_t;
+  uv_async_init(uv_default_loop(), state->_hotplugAsync, hotplugWakeup);
+  state->_hotplugAsync->data = state;
+  state->_hotplugCallback = new NanCallback(Local<Function>::Cast(args[0]));
+
+  if (!state->_hotplugMonitor->start()) {
+    uv_close((uv_handle_t*) state->_hotplugAsync, hotplugClosed);
+    state->_hotplugAsync = 0;
+    delete state->_hotplugCallback;
+    state->_hotplugCallback = 0;
+    NanThrowError("hotplug notifications are not available on this system");
+    NanReturnUndefined();
+  }
+  deviceCache.setWatched(true);
+
+  NanReturnUndefined();
+}
+
+NAN_METHOD(HID::hotplugStop)
+{
+  NanScope();
+
+  stopHotplug(addonState);
+  NanReturnUndefined();
 }
 
 static void
-deinitialize(void*)
+deinitialize(void* data)
 {
-  if (hid_exit()) {
-    cerr << "cannot initialize hidapi (hid_init failed)" << endl;
-    abort();
+  AddonState* state = static_cast<AddonState*>(data);
+
+  stopHotplug(state);
+  delete state->_hotplugMonitor;
+  // Closing erases them from the sets
+  set<HID*> devices(state->_devices);
+  for (set<HID*>::iterator i = devices.begin(); i != devices.end(); i++) {
+    (*i)->close();
+  }
+  // hidapi must not go away under reads still finishing
+  for (set<HID*>::iterator i = devices.begin(); i != devices.end(); i++) {
+    (*i)->waitForHandleUsers();
+  }
+  set<DeviceGroup*> groups(state->_groups);
+  for (set<DeviceGroup*>::iterator i = groups.begin(); i != groups.end(); i++) {
+    (*i)->close();
   }
+  for (set<DeviceGroup*>::iterator i = groups.begin(); i != groups.end(); i++) {
+    (*i)->waitForHandleUsers();
+  }
+
+  disposeDeviceInfoTemplate(state);
+  NanDisposePersistent(state->_float64Array);
+  state->_reportPool->dispose();
+  addonState = 0;
+  delete state;
+  exitHidapi();
 }
 
 void
@@ -507,7 +4853,9 @@ HID::Initialize(Handle<Object> target)
     abort();
   }
 
-  node::AtExit(deinitialize, 0);
+  addonState = new AddonState;
+  node::AtExit(deinitialize, addonState);
+  initDeviceInfoTemplate(addonState);
 
   NanScope();
 
@@ -517,14 +4865,47 @@ HID::Initialize(Handle<Object> target)
 
   NODE_SET_PROTOTYPE_METHOD(hidTemplate, "close", close);
   NODE_SET_PROTOTYPE_METHOD(hidTemplate, "read", read);
+  NODE_SET_PROTOTYPE_METHOD(hidTemplate, "readBatch", readBatch);
+  NODE_SET_PROTOTYPE_METHOD(hidTemplate, "cancelReads", cancelReads);
   NODE_SET_PROTOTYPE_METHOD(hidTemplate, "write", write);
   NODE_SET_PROTOTYPE_METHOD(hidTemplate, "getFeatureReport", getFeatureReport);
   NODE_SET_PROTOTYPE_METHOD(hidTemplate, "sendFeatureReport", sendFeatureReport);
+  NODE_SET_PROTOTYPE_METHOD(hidTemplate, "getFeatureReportAsync", getFeatureReportAsync);
+  NODE_SET_PROTOTYPE_METHOD(hidTemplate, "sendFeatureReportAsync", sendFeatureReportAsync);
+  NODE_SET_PROTOTYPE_METHOD(hidTemplate, "transact", transact);
   NODE_SET_PROTOTYPE_METHOD(hidTemplate, "setNonBlocking", setNonBlocking);
+  NODE_SET_PROTOTYPE_METHOD(hidTemplate, "readStart", readStart);
+  NODE_SET_PROTOTYPE_METHOD(hidTemplate, "readStop", readStop);
+  NODE_SET_PROTOTYPE_METHOD(hidTemplate, "readPause", readPause);
+  NODE_SET_PROTOTYPE_METHOD(hidTemplate, "readResume", readResume);
+  NODE_SET_PROTOTYPE_METHOD(hidTemplate, "readLatestStart", readLatestStart);
+  NODE_SET_PROTOTYPE_METHOD(hidTemplate, "readLatest", readLatest);
+  NODE_SET_PROTOTYPE_METHOD(hidTemplate, "writeAsync", writeAsync);
+  NODE_SET_PROTOTYPE_METHOD(hidTemplate, "writeQueueDepth", writeQueueDepth);
+  NODE_SET_PROTOTYPE_METHOD(hidTemplate, "setPipelineDepth", setPipelineDepth);
+  NODE_SET_PROTOTYPE_METHOD(hidTemplate, "periodicStart", periodicStart);
+  NODE_SET_PROTOTYPE_METHOD(hidTemplate, "periodicUpdate", periodicUpdate);
+  NODE_SET_PROTOTYPE_METHOD(hidTemplate, "periodicStop", periodicStop);
+  NODE_SET_PROTOTYPE_METHOD(hidTemplate, "setInputQueue", setInputQueue);
+  NODE_SET_PROTOTYPE_METHOD(hidTemplate, "setThreadPolicy", setThreadPolicy);
+  NODE_SET_PROTOTYPE_METHOD(hidTemplate, "stats", stats);
+  NODE_SET_PROTOTYPE_METHOD(hidTemplate, "setFilter", setFilter);
+  NODE_SET_PROTOTYPE_METHOD(hidTemplate, "getReportDescriptor", getReportDescriptor);
 
   target->Set(NanNew<String>("HID"), hidTemplate->GetFunction());
 
   target->Set(NanNew<String>("devices"), NanNew<FunctionTemplate>(HID::devices)->GetFunction());
+  target->Set(NanNew<String>("devicesAsync"), NanNew<FunctionTemplate>(HID::devicesAsync)->GetFunction());
+  target->Set(NanNew<String>("openAsync"), NanNew<FunctionTemplate>(HID::openAsync)->GetFunction());
+  target->Set(NanNew<String>("setDevicesCacheTimeout"), NanNew<FunctionTemplate>(HID::setDevicesCacheTimeout)->GetFunction());
+  target->Set(NanNew<String>("captureStart"), NanNew<FunctionTemplate>(HID::captureStart)->GetFunction());
+  target->Set(NanNew<String>("captureStop"), NanNew<FunctionTemplate>(HID::captureStop)->GetFunction());
+  target->Set(NanNew<String>("hotplugStart"), NanNew<FunctionTemplate>(HID::hotplugStart)->GetFunction());
+  target->Set(NanNew<String>("hotplugStop"), NanNew<FunctionTemplate>(HID::hotplugStop)->GetFunction());
+  target->Set(NanNew<String>("parseReportDescriptor"), NanNew<FunctionTemplate>(HID::parseReportDescriptor)->GetFunction());
+
+  ReportDecoder::Initialize(target);
+  DeviceGroup::Initialize(target);
 }
 
 
@@ -539,4 +4920,3 @@ extern "C" {
 
   NODE_MODULE(HID, init);
 }
-
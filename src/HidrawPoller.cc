@@ -0,0 +1,159 @@
+// -*- C++ -*-
+
+// Copyright Hans Huebner and contributors. All rights reserved.
+// Permission is hereby granted, free of charge, to any person
+// obtaining a copy of this software and associated documentation
+// files (the "Software"), to deal in the Software without
+// restriction, including without limitation the rights to use, copy,
+// modify, merge, publish, distribute, sublicense, and/or sell copies
+// of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be
+// included in all copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <unistd.h>
+
+#include "HidrawPoller.h"
+
+using namespace std;
+
+HidrawPoller::HidrawPoller()
+  : _epoll(-1),
+    _running(false)
+{
+  _pipe[0] = _pipe[1] = -1;
+  uv_mutex_init(&_lock);
+}
+
+HidrawPoller::~HidrawPoller()
+{
+  stop();
+  uv_mutex_destroy(&_lock);
+}
+
+bool
+HidrawPoller::add(int fd, Client* client)
+{
+  if (!_running) {
+    // Started on first use, the thread then waits in epoll_wait()
+    // until the process exits
+    // Neither descriptor leaks into child processes
+    _epoll = epoll_create1(EPOLL_CLOEXEC);
+    if (_epoll < 0) {
+      return false;
+    }
+    if (pipe2(_pipe, O_CLOEXEC)) {
+      ::close(_epoll);
+      return false;
+    }
+    // A null client wakes the thread up to stop
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.ptr = 0;
+    epoll_ctl(_epoll, EPOLL_CTL_ADD, _pipe[0], &event);
+    if (uv_thread_create(&_thread, pollerThread, this)) {
+      ::close(_epoll);
+      ::close(_pipe[0]);
+      ::close(_pipe[1]);
+      return false;
+    }
+    _running = true;
+  }
+
+  client->_fd = fd;
+  uv_mutex_lock(&_lock);
+  _clients.insert(client);
+  uv_mutex_unlock(&_lock);
+
+  struct epoll_event event;
+  event.events = EPOLLIN;
+  event.data.ptr = client;
+  if (epoll_ctl(_epoll, EPOLL_CTL_ADD, fd, &event)) {
+    uv_mutex_lock(&_lock);
+    _clients.erase(client);
+    uv_mutex_unlock(&_lock);
+    return false;
+  }
+  return true;
+}
+
+void
+HidrawPoller::remove(Client* client)
+{
+  // The thread may already have picked up an event for the client,
+  // which it only acts upon if the client is still registered
+  uv_mutex_lock(&_lock);
+  if (_clients.erase(client)) {
+    epoll_ctl(_epoll, EPOLL_CTL_DEL, client->_fd, 0);
+  }
+  uv_mutex_unlock(&_lock);
+}
+
+void
+HidrawPoller::stop()
+{
+  if (!_running) {
+    return;
+  }
+  if (write(_pipe[1], "", 1) < 0) {
+    // cannot happen with an empty pipe
+  }
+  uv_thread_join(&_thread);
+  ::close(_epoll);
+  ::close(_pipe[0]);
+  ::close(_pipe[1]);
+  _running = false;
+}
+
+void
+HidrawPoller::pollerThread(void* arg)
+{
+  static_cast<HidrawPoller*>(arg)->run();
+}
+
+void
+HidrawPoller::run()
+{
+  struct epoll_event events[64];
+  while (true) {
+    int count = epoll_wait(_epoll, events, sizeof events / sizeof events[0], -1);
+    if (count < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return;
+    }
+
+    uv_mutex_lock(&_lock);
+    for (int i = 0; i < count; i++) {
+      Client* client = static_cast<Client*>(events[i].data.ptr);
+      if (!client) {
+        // stop()
+        uv_mutex_unlock(&_lock);
+        return;
+      }
+      if (_clients.find(client) == _clients.end()) {
+        continue;
+      }
+      // Error and hangup conditions show up as failing reads
+      if (!client->readable(client->_fd)) {
+        epoll_ctl(_epoll, EPOLL_CTL_DEL, client->_fd, 0);
+        _clients.erase(client);
+      }
+    }
+    uv_mutex_unlock(&_lock);
+  }
+}
@@ -0,0 +1,80 @@
+// -*- C++ -*-
+
+// Copyright Hans Huebner and contributors. All rights reserved.
+// Permission is hereby granted, free of charge, to any person
+// obtaining a copy of this software and associated documentation
+// files (the "Software"), to deal in the Software without
+// restriction, including without limitation the rights to use, copy,
+// modify, merge, publish, distribute, sublicense, and/or sell copies
+// of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be
+// included in all copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+
+
+#ifndef HIDRAW_POLLER_H
+#define HIDRAW_POLLER_H
+
+#include <set>
+
+#include <uv.h>
+
+// //////////////////////////////////////////////////////////////////
+// With the hidraw driver, every device is a file descriptor.  The
+// poller waits on the descriptors of all streaming devices with a
+// single epoll thread instead of blocking one thread per device.
+// //////////////////////////////////////////////////////////////////
+class HidrawPoller
+{
+public:
+  class Client {
+  public:
+    Client() : _fd(-1) {}
+    virtual ~Client() {}
+
+    // Called on the poller thread when the descriptor can be read
+    // without blocking.  Returning false stops polling it, as after
+    // errors.
+    virtual bool readable(int fd) = 0;
+
+  private:
+    friend class HidrawPoller;
+    int _fd;
+  };
+
+  HidrawPoller();
+  ~HidrawPoller();
+
+  // Both must be called from the same thread.  Once remove()
+  // returns, the client is no longer called.
+  bool add(int fd, Client* client);
+  void remove(Client* client);
+
+  void stop();
+
+private:
+  static void pollerThread(void* arg);
+  void run();
+
+  HidrawPoller(const HidrawPoller&);
+  HidrawPoller& operator=(const HidrawPoller&);
+
+  int _epoll;
+  int _pipe[2];
+  bool _running;
+  uv_thread_t _thread;
+  uv_mutex_t _lock;
+  // protected by _lock, held by the thread while calling clients
+  std::set<Client*> _clients;
+};
+
+#endif
@@ -0,0 +1,589 @@
+// -*- C++ -*-
+
+// Copyright Hans Huebner and contributors. All rights reserved.
+// Permission is hereby granted, free of charge, to any person
+// obtaining a copy of this software and associated documentation
+// files (the "Software"), to deal in the Software without
+// restriction, including without limitation the rights to use, copy,
+// modify, merge, publish, distribute, sublicense, and/or sell copies
+// of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be
+// included in all copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+
+
+#include <algorithm>
+
+#include "Hotplug.h"
+
+#if defined(_WIN32)
+#include <windows.h>
+#include <dbt.h>
+#elif defined(__APPLE__)
+#include <CoreFoundation/CoreFoundation.h>
+#include <IOKit/hid/IOHIDManager.h>
+#elif defined(HID_DRIVER_HIDRAW)
+#include <fcntl.h>
+#include <libudev.h>
+#include <poll.h>
+#include <unistd.h>
+#elif defined(HID_DRIVER_LIBUSB)
+#include <libusb.h>
+#endif
+
+using namespace std;
+
+// Time to wait for more events after a change before enumerating,
+// as attaching a single device usually produces several events
+static const int settleInterval = 100; // ms
+
+// //////////////////////////////////////////////////////////////////
+// Platform specific source of change notifications.  Opened, waited
+// on and deleted by the monitor thread; interrupt() may be called
+// from any thread.
+// //////////////////////////////////////////////////////////////////
+class HotplugMonitor::ChangeSource
+{
+public:
+  ChangeSource()
+    : _changed(false),
+      _interrupted(false)
+  {}
+  virtual ~ChangeSource() {}
+
+  virtual bool open() = 0;
+
+  // Waits until devices may have changed (true), or until
+  // interrupted or timeoutMs milliseconds have passed (false).  A
+  // negative timeout waits indefinitely.
+  virtual bool wait(int timeoutMs) = 0;
+
+  virtual void interrupt()
+  {
+    _interrupted = true;
+  }
+
+protected:
+  // For sources that can only wait in slices: runs waitSlice() until
+  // a change has been flagged, interrupt() has been called or the
+  // timeout has passed
+  bool waitInSlices(int timeoutMs)
+  {
+    const int maxSlice = 500; // ms
+    uint64_t deadline = uv_hrtime() / 1000000 + timeoutMs;
+    while (true) {
+      int slice = maxSlice;
+      if (timeoutMs >= 0) {
+        int64_t remaining = (int64_t) (deadline - uv_hrtime() / 1000000);
+        if (remaining <= 0) {
+          return _changed.exchange(false);
+        }
+        slice = min((int64_t) maxSlice, remaining);
+      }
+      waitSlice(slice);
+      if (_changed.exchange(false)) {
+        return true;
+      }
+      if (_interrupted.exchange(false)) {
+        return false;
+      }
+    }
+  }
+
+  virtual void waitSlice(int) {}
+
+  std::atomic<bool> _changed;
+  std::atomic<bool> _interrupted;
+};
+
+#if defined(_WIN32)
+
+class WindowsChangeSource
+  : public HotplugMonitor::ChangeSource
+{
+public:
+  WindowsChangeSource()
+    : _window(0),
+      _notification(0)
+  {}
+
+  ~WindowsChangeSource()
+  {
+    if (_notification) {
+      UnregisterDeviceNotification(_notification);
+    }
+    if (_window) {
+      DestroyWindow(_window);
+    }
+  }
+
+  bool open()
+  {
+    static const wchar_t className[] = L"node-hid-hotplug";
+    HINSTANCE instance = GetModuleHandleW(0);
+
+    WNDCLASSEXW windowClass;
+    ZeroMemory(&windowClass, sizeof windowClass);
+    windowClass.cbSize = sizeof windowClass;
+    windowClass.lpfnWndProc = windowProc;
+    windowClass.hInstance = instance;
+    windowClass.lpszClassName = className;
+    if (!RegisterClassExW(&windowClass) && GetLastError() != ERROR_CLASS_ALREADY_EXISTS) {
+      return false;
+    }
+
+    // A message-only window receives the device notifications
+    _window = CreateWindowExW(0, className, L"", 0, 0, 0, 0, 0, HWND_MESSAGE, 0, instance, 0);
+    if (!_window) {
+      return false;
+    }
+    SetWindowLongPtrW(_window, GWLP_USERDATA, (LONG_PTR) this);
+
+    // GUID_DEVINTERFACE_HID, as returned by HidD_GetHidGuid()
+    static const GUID hidGuid = { 0x4d1e55b2, 0xf16f, 0x11cf, { 0x88, 0xcb, 0x00, 0x11, 0x11, 0x00, 0x00, 0x30 } };
+    DEV_BROADCAST_DEVICEINTERFACE_W filter;
+    ZeroMemory(&filter, sizeof filter);
+    filter.dbcc_size = sizeof filter;
+    filter.dbcc_devicetype = DBT_DEVTYP_DEVICEINTERFACE;
+    filter.dbcc_classguid = hidGuid;
+    _notification = RegisterDeviceNotificationW(_window, &filter, DEVICE_NOTIFY_WINDOW_HANDLE);
+    return _notification != 0;
+  }
+
+  bool wait(int timeoutMs)
+  {
+    return waitInSlices(timeoutMs);
+  }
+
+  void interrupt()
+  {
+    ChangeSource::interrupt();
+    if (_window) {
+      PostMessageW(_window, WM_NULL, 0, 0);
+    }
+  }
+
+private:
+  void waitSlice(int slice)
+  {
+    MsgWaitForMultipleObjects(0, 0, FALSE, slice, QS_ALLINPUT);
+    MSG message;
+    while (PeekMessageW(&message, 0, 0, 0, PM_REMOVE)) {
+      DispatchMessageW(&message);
+    }
+  }
+
+  static LRESULT CALLBACK windowProc(HWND window, UINT message, WPARAM wParam, LPARAM lParam)
+  {
+    if (message == WM_DEVICECHANGE
+        && (wParam == DBT_DEVICEARRIVAL || wParam == DBT_DEVICEREMOVECOMPLETE)) {
+      WindowsChangeSource* source = (WindowsChangeSource*) GetWindowLongPtrW(window, GWLP_USERDATA);
+      if (source) {
+        source->_changed = true;
+      }
+    }
+    return DefWindowProcW(window, message, wParam, lParam);
+  }
+
+  HWND _window;
+  HDEVNOTIFY _notification;
+};
+
+typedef WindowsChangeSource PlatformChangeSource;
+
+#elif defined(__APPLE__)
+
+class IOKitChangeSource
+  : public HotplugMonitor::ChangeSource
+{
+public:
+  IOKitChangeSource()
+    : _manager(0),
+      _runLoop(0)
+  {}
+
+  ~IOKitChangeSource()
+  {
+    if (_manager) {
+      IOHIDManagerUnscheduleFromRunLoop(_manager, _runLoop, kCFRunLoopDefaultMode);
+      CFRelease(_manager);
+    }
+  }
+
+  bool open()
+  {
+    _manager = IOHIDManagerCreate(kCFAllocatorDefault, kIOHIDOptionsTypeNone);
+    if (!_manager) {
+      return false;
+    }
+    IOHIDManagerSetDeviceMatching(_manager, 0);
+    IOHIDManagerRegisterDeviceMatchingCallback(_manager, deviceChanged, this);
+    IOHIDManagerRegisterDeviceRemovalCallback(_manager, deviceChanged, this);
+    _runLoop = CFRunLoopGetCurrent();
+    IOHIDManagerScheduleWithRunLoop(_manager, _runLoop, kCFRunLoopDefaultMode);
+
+    // The matching callback is called for every device present when
+    // the manager is scheduled, swallow those
+    while (CFRunLoopRunInMode(kCFRunLoopDefaultMode, 0, true) == kCFRunLoopRunHandledSource)
+      ;
+    _changed = false;
+    return true;
+  }
+
+  bool wait(int timeoutMs)
+  {
+    return waitInSlices(timeoutMs);
+  }
+
+  void interrupt()
+  {
+    ChangeSource::interrupt();
+    if (_runLoop) {
+      CFRunLoopStop(_runLoop);
+    }
+  }
+
+private:
+  void waitSlice(int slice)
+  {
+    CFRunLoopRunInMode(kCFRunLoopDefaultMode, slice / 1000.0, true);
+  }
+
+  static void deviceChanged(void* context, IOReturn, void*, IOHIDDeviceRef)
+  {
+    static_cast<IOKitChangeSource*>(context)->_changed = true;
+  }
+
+  IOHIDManagerRef _manager;
+  CFRunLoopRef _runLoop;
+};
+
+typedef IOKitChangeSource PlatformChangeSource;
+
+#elif defined(HID_DRIVER_HIDRAW)
+
+class UdevChangeSource
+  : public HotplugMonitor::ChangeSource
+{
+public:
+  UdevChangeSource()
+    : _udev(0),
+      _monitor(0)
+  {
+    _pipe[0] = _pipe[1] = -1;
+  }
+
+  ~UdevChangeSource()
+  {
+    if (_monitor) {
+      udev_monitor_unref(_monitor);
+    }
+    if (_udev) {
+      udev_unref(_udev);
+    }
+    if (_pipe[0] != -1) {
+      ::close(_pipe[0]);
+      ::close(_pipe[1]);
+    }
+  }
+
+  bool open()
+  {
+    if (pipe2(_pipe, O_CLOEXEC)) {
+      _pipe[0] = _pipe[1] = -1;
+      return false;
+    }
+    _udev = udev_new();
+    if (!_udev) {
+      return false;
+    }
+    _monitor = udev_monitor_new_from_netlink(_udev, "udev");
+    if (!_monitor) {
+      return false;
+    }
+    udev_monitor_filter_add_match_subsystem_devtype(_monitor, "hidraw", 0);
+    return udev_monitor_enable_receiving(_monitor) == 0;
+  }
+
+  bool wait(int timeoutMs)
+  {
+    struct pollfd fds[2];
+    fds[0].fd = udev_monitor_get_fd(_monitor);
+    fds[0].events = POLLIN;
+    fds[1].fd = _pipe[0];
+    fds[1].events = POLLIN;
+    if (poll(fds, 2, timeoutMs) <= 0) {
+      return false;
+    }
+    if (fds[1].revents) {
+      char buf[16];
+      if (read(_pipe[0], buf, sizeof buf) < 0) {
+        // nothing to do, interrupted either way
+      }
+      return false;
+    }
+    udev_device* device = udev_monitor_receive_device(_monitor);
+    if (device) {
+      udev_device_unref(device);
+    }
+    return true;
+  }
+
+  void interrupt()
+  {
+    if (write(_pipe[1], "", 1) < 0) {
+      // the pipe is full, so the monitor will wake up anyway
+    }
+  }
+
+private:
+  udev* _udev;
+  udev_monitor* _monitor;
+  // written to by interrupt() to wake up poll()
+  int _pipe[2];
+};
+
+typedef UdevChangeSource PlatformChangeSource;
+
+#elif defined(HID_DRIVER_LIBUSB)
+
+class LibusbChangeSource
+  : public HotplugMonitor::ChangeSource
+{
+public:
+  LibusbChangeSource()
+    : _context(0),
+      _registered(false)
+  {}
+
+  ~LibusbChangeSource()
+  {
+    if (_registered) {
+      libusb_hotplug_deregister_callback(_context, _callback);
+    }
+    if (_context) {
+      libusb_exit(_context);
+    }
+  }
+
+  bool open()
+  {
+    // hidapi keeps its libusb context to itself, use our own
+    if (libusb_init(&_context)) {
+      _context = 0;
+      return false;
+    }
+    if (!libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG)) {
+      return false;
+    }
+    _registered = libusb_hotplug_register_callback(_context,
+                                                   (libusb_hotplug_event) (LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED
+                                                                           | LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT),
+                                                   (libusb_hotplug_flag) 0,
+                                                   LIBUSB_HOTPLUG_MATCH_ANY,
+                                                   LIBUSB_HOTPLUG_MATCH_ANY,
+                                                   LIBUSB_HOTPLUG_MATCH_ANY,
+                                                   deviceChanged, this, &_callback) == LIBUSB_SUCCESS;
+    return _registered;
+  }
+
+  bool wait(int timeoutMs)
+  {
+    return waitInSlices(timeoutMs);
+  }
+
+private:
+  void waitSlice(int slice)
+  {
+    struct timeval tv;
+    tv.tv_sec = slice / 1000;
+    tv.tv_usec = (slice % 1000) * 1000;
+    libusb_handle_events_timeout_completed(_context, &tv, 0);
+  }
+
+  static int LIBUSB_CALL deviceChanged(libusb_context*, libusb_device*, libusb_hotplug_event, void* data)
+  {
+    static_cast<LibusbChangeSource*>(data)->_changed = true;
+    return 0;
+  }
+
+  libusb_context* _context;
+  libusb_hotplug_callback_handle _callback;
+  bool _registered;
+};
+
+typedef LibusbChangeSource PlatformChangeSource;
+
+#else
+
+#define PLATFORM_CHANGE_SOURCE_MISSING
+
+#endif
+
+HotplugMonitor::HotplugMonitor(Notify notify, void* data)
+  : _notify(notify),
+    _data(data),
+    _running(false),
+    _startFailed(false),
+    _source(0),
+    _stopping(false)
+{
+  uv_mutex_init(&_lock);
+  uv_cond_init(&_started);
+}
+
+HotplugMonitor::~HotplugMonitor()
+{
+  stop();
+  uv_cond_destroy(&_started);
+  uv_mutex_destroy(&_lock);
+}
+
+bool
+HotplugMonitor::start()
+{
+#ifdef PLATFORM_CHANGE_SOURCE_MISSING
+  return false;
+#else
+  uv_mutex_lock(&_lock);
+  bool running = _running;
+  uv_mutex_unlock(&_lock);
+  if (running) {
+    return true;
+  }
+
+  _stopping = false;
+  _startFailed = false;
+  if (uv_thread_create(&_thread, monitorThread, this)) {
+    return false;
+  }
+
+  // Wait for the thread to report whether notifications work
+  uv_mutex_lock(&_lock);
+  while (!_running && !_startFailed) {
+    uv_cond_wait(&_started, &_lock);
+  }
+  running = _running;
+  uv_mutex_unlock(&_lock);
+
+  if (!running) {
+    uv_thread_join(&_thread);
+  }
+  return running;
+#endif
+}
+
+void
+HotplugMonitor::stop()
+{
+  uv_mutex_lock(&_lock);
+  if (!_running) {
+    uv_mutex_unlock(&_lock);
+    return;
+  }
+  _stopping = true;
+  if (_source) {
+    _source->interrupt();
+  }
+  uv_mutex_unlock(&_lock);
+
+  uv_thread_join(&_thread);
+  uv_mutex_lock(&_lock);
+  _running = false;
+  uv_mutex_unlock(&_lock);
+}
+
+void
+HotplugMonitor::takeChanges(vector<Change>& changes)
+{
+  uv_mutex_lock(&_lock);
+  changes.swap(_changes);
+  _changes.clear();
+  uv_mutex_unlock(&_lock);
+}
+
+void
+HotplugMonitor::monitorThread(void* arg)
+{
+  static_cast<HotplugMonitor*>(arg)->run();
+}
+
+void
+HotplugMonitor::run()
+{
+#ifndef PLATFORM_CHANGE_SOURCE_MISSING
+  ChangeSource* source = new PlatformChangeSource;
+  bool opened = source->open();
+
+  uv_mutex_lock(&_lock);
+  if (opened) {
+    _source = source;
+    _running = true;
+  } else {
+    _startFailed = true;
+  }
+  uv_cond_signal(&_started);
+  uv_mutex_unlock(&_lock);
+
+  if (!opened) {
+    delete source;
+    return;
+  }
+
+  vector<DeviceInfo> known;
+  enumerateDevices(0, 0, known);
+  sort(known.begin(), known.end());
+
+  while (!_stopping) {
+    if (!source->wait(-1)) {
+      continue;
+    }
+    while (!_stopping && source->wait(settleInterval))
+      ;
+    if (_stopping) {
+      break;
+    }
+
+    vector<DeviceInfo> current;
+    enumerateDevices(0, 0, current);
+    sort(current.begin(), current.end());
+
+    // Both lists are sorted by path
+    vector<Change> changes;
+    vector<DeviceInfo>::const_iterator k = known.begin();
+    vector<DeviceInfo>::const_iterator c = current.begin();
+    while (k != known.end() || c != current.end()) {
+      if (c == current.end() || (k != known.end() && *k < *c)) {
+        changes.push_back(Change(false, *k++));
+      } else if (k == known.end() || *c < *k) {
+        changes.push_back(Change(true, *c++));
+      } else {
+        k++;
+        c++;
+      }
+    }
+    known.swap(current);
+
+    if (!changes.empty()) {
+      uv_mutex_lock(&_lock);
+      _changes.insert(_changes.end(), changes.begin(), changes.end());
+      uv_mutex_unlock(&_lock);
+      _notify(_data);
+    }
+  }
+
+  uv_mutex_lock(&_lock);
+  _source = 0;
+  uv_mutex_unlock(&_lock);
+  delete source;
+#endif
+}
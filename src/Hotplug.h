@@ -0,0 +1,90 @@
+// -*- C++ -*-
+
+// Copyright Hans Huebner and contributors. All rights reserved.
+// Permission is hereby granted, free of charge, to any person
+// obtaining a copy of this software and associated documentation
+// files (the "Software"), to deal in the Software without
+// restriction, including without limitation the rights to use, copy,
+// modify, merge, publish, distribute, sublicense, and/or sell copies
+// of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be
+// included in all copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+
+
+#ifndef HOTPLUG_H
+#define HOTPLUG_H
+
+#include <atomic>
+#include <vector>
+
+#include <uv.h>
+
+#include "DeviceInfo.h"
+
+// //////////////////////////////////////////////////////////////////
+// Watches for HID devices being attached and detached.  A native
+// thread waits for the operating system to announce a change (udev
+// for hidraw, hotplug callbacks for libusb, IOKit notifications on
+// Mac OS and device notifications on Windows), then enumerates and
+// reports the difference to the previous enumeration.  Nothing is
+// enumerated while no devices change.
+// //////////////////////////////////////////////////////////////////
+class HotplugMonitor
+{
+public:
+  struct Change {
+    Change(bool attached, const DeviceInfo& device)
+      : _attached(attached),
+        _device(device)
+    {}
+
+    bool _attached;
+    DeviceInfo _device;
+  };
+
+  // Called on the monitor thread whenever changes are ready to be
+  // picked up with takeChanges()
+  typedef void (*Notify)(void* data);
+
+  HotplugMonitor(Notify notify, void* data);
+  ~HotplugMonitor();
+
+  // Returns false if hotplug notifications are not available
+  bool start();
+  void stop();
+
+  void takeChanges(std::vector<Change>& changes);
+
+  class ChangeSource;
+
+private:
+  static void monitorThread(void* arg);
+  void run();
+
+  HotplugMonitor(const HotplugMonitor&);
+  HotplugMonitor& operator=(const HotplugMonitor&);
+
+  Notify _notify;
+  void* _data;
+  uv_thread_t _thread;
+  uv_mutex_t _lock;
+  uv_cond_t _started;
+  // protected by _lock
+  bool _running;
+  bool _startFailed;
+  ChangeSource* _source;
+  std::vector<Change> _changes;
+  std::atomic<bool> _stopping;
+};
+
+#endif
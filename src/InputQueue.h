@@ -0,0 +1,120 @@
+// -*- C++ -*-
+
+// Copyright Hans Huebner and contributors. All rights reserved.
+// Permission is hereby granted, free of charge, to any person
+// obtaining a copy of this software and associated documentation
+// files (the "Software"), to deal in the Software without
+// restriction, including without limitation the rights to use, copy,
+// modify, merge, publish, distribute, sublicense, and/or sell copies
+// of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be
+// included in all copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+
+
+#ifndef INPUT_QUEUE_H
+#define INPUT_QUEUE_H
+
+#include <atomic>
+
+#include <stdint.h>
+#include <string.h>
+
+#include <uv.h>
+
+#include "ReportRing.h"
+
+// //////////////////////////////////////////////////////////////////
+// Bounded queue of input reports read ahead of JavaScript asking for
+// them, filled by one thread and emptied by any number of threadpool
+// reads.  Once full, the oldest report makes room for the newest.
+// All memory is allocated up front.
+// //////////////////////////////////////////////////////////////////
+class InputQueue
+{
+public:
+  InputQueue(size_t capacity, size_t slotSize)
+    : _ring(capacity, slotSize)
+  {
+    uv_mutex_init(&_lock);
+    uv_cond_init(&_available);
+  }
+
+  ~InputQueue()
+  {
+    uv_cond_destroy(&_available);
+    uv_mutex_destroy(&_lock);
+  }
+
+  size_t capacity() const { return _ring.capacity(); }
+  size_t size() const { return _ring.size(); }
+
+  // Producer side: queues a report received at uv_hrtime() time,
+  // returns false if the oldest report was discarded to make room
+  bool push(const unsigned char* data, size_t length, uint64_t time)
+  {
+    if (length > _ring.slotSize()) {
+      length = _ring.slotSize();
+    }
+    uv_mutex_lock(&_lock);
+    bool dropped = _ring.dropOldest();
+    memcpy(_ring.reserve(), data, length);
+    _ring.commit(length, time);
+    uv_cond_signal(&_available);
+    uv_mutex_unlock(&_lock);
+    return !dropped;
+  }
+
+  // Consumer side: copies the oldest report to data and the time it
+  // was received to time, waiting for up to timeout milliseconds for
+  // one to arrive while generation is still expected.  Returns its
+  // length, or 0 if there was none.
+  int pop(unsigned char* data, size_t length, int timeout, uint64_t& time,
+          const std::atomic<unsigned int>* generation = 0, unsigned int expected = 0)
+  {
+    uv_mutex_lock(&_lock);
+    size_t queued;
+    const unsigned char* report = _ring.peek(0, queued, time);
+    if (!report && timeout > 0 && (!generation || *generation == expected)) {
+      uv_cond_timedwait(&_available, &_lock, (uint64_t) timeout * 1000000);
+      report = _ring.peek(0, queued, time);
+    }
+    if (report) {
+      if (length > queued) {
+        length = queued;
+      }
+      memcpy(data, report, length);
+      _ring.release();
+    }
+    uv_mutex_unlock(&_lock);
+    return report ? (int) length : 0;
+  }
+
+  // Wakes up all waiting consumers, e.g. after changing the
+  // generation they wait for
+  void interrupt()
+  {
+    uv_mutex_lock(&_lock);
+    uv_cond_broadcast(&_available);
+    uv_mutex_unlock(&_lock);
+  }
+
+private:
+  InputQueue(const InputQueue&);
+  InputQueue& operator=(const InputQueue&);
+
+  ReportRing _ring;
+  uv_mutex_t _lock;
+  uv_cond_t _available;
+};
+
+#endif
@@ -0,0 +1,141 @@
+// -*- C++ -*-
+
+// Copyright Hans Huebner and contributors. All rights reserved.
+// Permission is hereby granted, free of charge, to any person
+// obtaining a copy of this software and associated documentation
+// files (the "Software"), to deal in the Software without
+// restriction, including without limitation the rights to use, copy,
+// modify, merge, publish, distribute, sublicense, and/or sell copies
+// of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be
+// included in all copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+
+
+#ifndef LATEST_REPORTS_H
+#define LATEST_REPORTS_H
+
+#include <vector>
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <uv.h>
+
+// //////////////////////////////////////////////////////////////////
+// Most recent input report of each report ID, for consumers that
+// only care about the current state of a device.  A new report
+// overwrites the previous one of its ID, so memory is bounded and a
+// slow consumer only ever sees fresh data.  Safe to use from any
+// thread.
+// //////////////////////////////////////////////////////////////////
+class LatestReports
+{
+public:
+  // Without numbered reports, all reports share one slot
+  LatestReports(bool numberedReports, size_t slotSize)
+    : _numberedReports(numberedReports),
+      _slots(numberedReports ? 256 : 1, Slot(slotSize))
+  {
+    uv_mutex_init(&_lock);
+    _changed.reserve(_slots.size());
+  }
+
+  ~LatestReports()
+  {
+    uv_mutex_destroy(&_lock);
+  }
+
+  bool numberedReports() const { return _numberedReports; }
+
+  void store(const unsigned char* data, size_t length, uint64_t time)
+  {
+    Slot& slot = _slots[slotIndex(length ? data[0] : 0)];
+    uv_mutex_lock(&_lock);
+    if (length > slot._data.size()) {
+      length = slot._data.size();
+    }
+    memcpy(&slot._data[0], data, length);
+    slot._length = length;
+    slot._time = time;
+    slot._valid = true;
+    if (!slot._changed) {
+      slot._changed = true;
+      _changed.push_back(&slot - &_slots[0]);
+    }
+    uv_mutex_unlock(&_lock);
+  }
+
+  // Copies the latest report with the given ID; returns false if
+  // there has been none yet
+  bool get(unsigned char reportId, std::vector<unsigned char>& data, uint64_t& time) const
+  {
+    const Slot& slot = _slots[slotIndex(reportId)];
+    uv_mutex_lock(&_lock);
+    bool valid = slot._valid;
+    if (valid) {
+      data.assign(slot._data.begin(), slot._data.begin() + slot._length);
+      time = slot._time;
+    }
+    uv_mutex_unlock(&_lock);
+    return valid;
+  }
+
+  // Returns the report IDs stored since the last call, in the order
+  // in which they first changed
+  void takeChanged(std::vector<unsigned char>& reportIds)
+  {
+    reportIds.clear();
+    uv_mutex_lock(&_lock);
+    for (size_t i = 0; i < _changed.size(); i++) {
+      _slots[_changed[i]]._changed = false;
+      reportIds.push_back((unsigned char) _changed[i]);
+    }
+    _changed.clear();
+    uv_mutex_unlock(&_lock);
+  }
+
+private:
+  struct Slot
+  {
+    Slot(size_t size)
+      : _data(size),
+        _length(0),
+        _time(0),
+        _valid(false),
+        _changed(false)
+    {}
+
+    std::vector<unsigned char> _data;
+    size_t _length;
+    uint64_t _time;
+    bool _valid;
+    bool _changed;
+  };
+
+  size_t slotIndex(unsigned char reportId) const
+  {
+    return _numberedReports ? reportId : 0;
+  }
+
+  LatestReports(const LatestReports&);
+  LatestReports& operator=(const LatestReports&);
+
+  const bool _numberedReports;
+  mutable uv_mutex_t _lock;
+  // protected by _lock
+  std::vector<Slot> _slots;
+  std::vector<size_t> _changed;
+};
+
+#endif
@@ -0,0 +1,119 @@
+// -*- C++ -*-
+
+// Copyright Hans Huebner and contributors. All rights reserved.
+// Permission is hereby granted, free of charge, to any person
+// obtaining a copy of this software and associated documentation
+// files (the "Software"), to deal in the Software without
+// restriction, including without limitation the rights to use, copy,
+// modify, merge, publish, distribute, sublicense, and/or sell copies
+// of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be
+// included in all copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+
+
+#include <string.h>
+
+#include "ReplyMatcher.h"
+
+using namespace std;
+
+bool
+ReplyMatcher::Transaction::matches(const unsigned char* data, size_t length) const
+{
+  if (_reportId >= 0 && (!length || data[0] != _reportId)) {
+    return false;
+  }
+  return length >= _prefix.size()
+    && (_prefix.empty() || !memcmp(data, &_prefix[0], _prefix.size()));
+}
+
+ReplyMatcher::ReplyMatcher()
+  : _transactionCount(0)
+{
+  uv_mutex_init(&_lock);
+  uv_cond_init(&_completion);
+}
+
+ReplyMatcher::~ReplyMatcher()
+{
+  uv_cond_destroy(&_completion);
+  uv_mutex_destroy(&_lock);
+}
+
+void
+ReplyMatcher::add(Transaction* transaction)
+{
+  uv_mutex_lock(&_lock);
+  _transactions.push_back(transaction);
+  _transactionCount = _transactions.size();
+  uv_mutex_unlock(&_lock);
+}
+
+void
+ReplyMatcher::remove(Transaction* transaction)
+{
+  uv_mutex_lock(&_lock);
+  for (deque<Transaction*>::iterator i = _transactions.begin(); i != _transactions.end(); i++) {
+    if (*i == transaction) {
+      _transactions.erase(i);
+      break;
+    }
+  }
+  _transactionCount = _transactions.size();
+  uv_mutex_unlock(&_lock);
+}
+
+bool
+ReplyMatcher::offer(const unsigned char* data, size_t length, uint64_t time)
+{
+  if (!_transactionCount) {
+    return false;
+  }
+  bool taken = false;
+  uv_mutex_lock(&_lock);
+  for (deque<Transaction*>::iterator i = _transactions.begin(); i != _transactions.end(); i++) {
+    Transaction* transaction = *i;
+    if (!transaction->_completed && transaction->matches(data, length)) {
+      transaction->_reply.assign(data, data + length);
+      transaction->_time = time;
+      transaction->_completed = true;
+      uv_cond_broadcast(&_completion);
+      taken = true;
+      break;
+    }
+  }
+  uv_mutex_unlock(&_lock);
+  return taken;
+}
+
+bool
+ReplyMatcher::wait(Transaction* transaction, uint64_t until)
+{
+  uv_mutex_lock(&_lock);
+  uint64_t now;
+  while (!transaction->_completed && (now = uv_hrtime()) < until) {
+    uv_cond_timedwait(&_completion, &_lock, until - now);
+  }
+  bool result = transaction->_completed;
+  uv_mutex_unlock(&_lock);
+  return result;
+}
+
+bool
+ReplyMatcher::completed(Transaction* transaction)
+{
+  uv_mutex_lock(&_lock);
+  bool result = transaction->_completed;
+  uv_mutex_unlock(&_lock);
+  return result;
+}
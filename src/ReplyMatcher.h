@@ -0,0 +1,96 @@
+// -*- C++ -*-
+
+// Copyright Hans Huebner and contributors. All rights reserved.
+// Permission is hereby granted, free of charge, to any person
+// obtaining a copy of this software and associated documentation
+// files (the "Software"), to deal in the Software without
+// restriction, including without limitation the rights to use, copy,
+// modify, merge, publish, distribute, sublicense, and/or sell copies
+// of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be
+// included in all copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+
+
+#ifndef REPLY_MATCHER_H
+#define REPLY_MATCHER_H
+
+#include <atomic>
+#include <deque>
+#include <vector>
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <uv.h>
+
+// //////////////////////////////////////////////////////////////////
+// Pairs input reports with the transactions of one device that are
+// waiting for a reply.  Whichever thread reads the device offers each
+// report here first, so the reply is found no matter whether it comes
+// in through the streaming reader, the prefetcher or read().  The
+// transactions never read the device themselves, they wait for one
+// of those to pass the reply on.  Safe to use from any thread; with
+// no transaction in flight, reading costs one atomic load.
+// //////////////////////////////////////////////////////////////////
+class ReplyMatcher
+{
+public:
+  struct Transaction
+  {
+    Transaction()
+      : _reportId(-1),
+        _completed(false),
+        _time(0)
+    {}
+
+    bool matches(const unsigned char* data, size_t length) const;
+
+    // The reply starts with this report ID unless it is -1, and with
+    // _prefix
+    int _reportId;
+    std::vector<unsigned char> _prefix;
+    // Set along with the reply and the uv_hrtime() of its arrival
+    bool _completed;
+    std::vector<unsigned char> _reply;
+    uint64_t _time;
+  };
+
+  ReplyMatcher();
+  ~ReplyMatcher();
+
+  // Transactions are matched in the order they were added
+  void add(Transaction* transaction);
+  void remove(Transaction* transaction);
+
+  // Returns whether the report was taken as the reply of a
+  // transaction
+  bool offer(const unsigned char* data, size_t length, uint64_t time);
+
+  // Waits for the transaction to complete until the given uv_hrtime()
+  // and returns whether it has
+  bool wait(Transaction* transaction, uint64_t until);
+  bool completed(Transaction* transaction);
+
+private:
+  ReplyMatcher(const ReplyMatcher&);
+  ReplyMatcher& operator=(const ReplyMatcher&);
+
+  // Size of the queue below, read without taking the lock
+  std::atomic<size_t> _transactionCount;
+  uv_mutex_t _lock;
+  uv_cond_t _completion;
+  // everything below is protected by _lock
+  std::deque<Transaction*> _transactions;
+};
+
+#endif
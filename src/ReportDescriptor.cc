@@ -0,0 +1,295 @@
+// -*- C++ -*-
+
+// Copyright Hans Huebner and contributors. All rights reserved.
+// Permission is hereby granted, free of charge, to any person
+// obtaining a copy of this software and associated documentation
+// files (the "Software"), to deal in the Software without
+// restriction, including without limitation the rights to use, copy,
+// modify, merge, publish, distribute, sublicense, and/or sell copies
+// of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be
+// included in all copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+
+
+#include <limits>
+#include <map>
+
+#include "ReportDescriptor.h"
+
+using namespace std;
+
+namespace {
+
+// Item types and tags from the Device Class Definition for HID 1.11,
+// section 6.2.2
+enum ItemType { mainItem = 0, globalItem = 1, localItem = 2 };
+
+enum MainTag { inputTag = 0x8, outputTag = 0x9, collectionTag = 0xa, featureTag = 0xb, endCollectionTag = 0xc };
+
+enum GlobalTag {
+  usagePageTag = 0x0,
+  logicalMinimumTag = 0x1,
+  logicalMaximumTag = 0x2,
+  reportSizeTag = 0x7,
+  reportIdTag = 0x8,
+  reportCountTag = 0x9,
+  pushTag = 0xa,
+  popTag = 0xb
+};
+
+enum LocalTag { usageTag = 0x0, usageMinimumTag = 0x1, usageMaximumTag = 0x2 };
+
+const unsigned char longItemPrefix = 0xfe;
+
+struct GlobalState
+{
+  GlobalState()
+    : _usagePage(0),
+      _logicalMinimum(0),
+      _logicalMaximum(0),
+      _reportSize(0),
+      _reportId(0),
+      _reportCount(0)
+  {}
+
+  uint32_t _usagePage;
+  int32_t _logicalMinimum;
+  int32_t _logicalMaximum;
+  uint32_t _reportSize;
+  unsigned char _reportId;
+  uint32_t _reportCount;
+};
+
+struct LocalState
+{
+  LocalState()
+    : _hasUsageMinimum(false),
+      _hasUsageMaximum(false),
+      _usageMinimum(0),
+      _usageMaximum(0)
+  {}
+
+  vector<uint32_t> _usages;
+  bool _hasUsageMinimum;
+  bool _hasUsageMaximum;
+  uint32_t _usageMinimum;
+  uint32_t _usageMaximum;
+};
+
+// Usages of one or two bytes are relative to the current usage page
+uint32_t
+extendedUsage(uint32_t value, size_t size, const GlobalState& global)
+{
+  return size == 4 ? value : (global._usagePage << 16) | (value & 0xffff);
+}
+
+}
+
+bool
+parseReportDescriptor(const unsigned char* descriptor, size_t length, vector<ReportField>& fields)
+{
+  GlobalState global;
+  vector<GlobalState> globalStack;
+  LocalState local;
+  // Next free bit of each report, by type and report ID
+  map<pair<int, unsigned char>, size_t> offsets;
+  bool usesReportIds = false;
+
+  size_t i = 0;
+  while (i < length) {
+    unsigned char prefix = descriptor[i++];
+    if (prefix == longItemPrefix) {
+      // Long items carry no information we need
+      if (i + 1 >= length) {
+        return false;
+      }
+      i += 2 + descriptor[i];
+      continue;
+    }
+
+    size_t size = prefix & 0x3;
+    if (size == 3) {
+      size = 4;
+    }
+    if (i + size > length) {
+      return false;
+    }
+    uint32_t value = 0;
+    for (size_t j = 0; j < size; j++) {
+      value |= (uint32_t) descriptor[i + j] << (8 * j);
+    }
+    i += size;
+    // Logical extents are signed in the size given
+    int32_t signedValue = size == 1 ? (int8_t) value : size == 2 ? (int16_t) value : (int32_t) value;
+
+    unsigned type = (prefix >> 2) & 0x3;
+    unsigned tag = prefix >> 4;
+
+    switch (type) {
+    case mainItem:
+      if (tag == inputTag || tag == outputTag || tag == featureTag) {
+        ReportField field;
+        field._type = tag == inputTag ? ReportField::input : tag == outputTag ? ReportField::output : ReportField::feature;
+        field._reportId = global._reportId;
+        field._bitSize = global._reportSize;
+        field._count = global._reportCount;
+        field._flags = value;
+        field._logicalMinimum = global._logicalMinimum;
+        field._logicalMaximum = global._logicalMaximum;
+
+        size_t& offset = offsets[make_pair((int) field._type, field._reportId)];
+        field._bitOffset = offset;
+        offset += field._bitSize * field._count;
+
+        if (local._hasUsageMinimum) {
+          field._usageMinimum = local._usageMinimum;
+          field._usageMaximum = local._hasUsageMaximum ? local._usageMaximum : local._usageMinimum;
+        } else if (!local._usages.empty()) {
+          field._usageMinimum = local._usages.front();
+          field._usageMaximum = local._usages.back();
+        }
+        if ((field._flags & ReportField::variable) && field._count) {
+          // Assign usages to elements in order, repeating the last one
+          for (size_t j = 0; j < field._count; j++) {
+            if (j < local._usages.size()) {
+              field._usages.push_back(local._usages[j]);
+            } else if (local._hasUsageMinimum && field._usageMinimum + j <= field._usageMaximum) {
+              field._usages.push_back(field._usageMinimum + j);
+            } else if (!field._usages.empty()) {
+              field._usages.push_back(field._usages.back());
+            } else {
+              field._usages.push_back(0);
+            }
+          }
+        } else {
+          field._usages = local._usages;
+        }
+
+        // Padding is skipped but still takes up space
+        if (!(field._flags & ReportField::constant)) {
+          fields.push_back(field);
+        }
+      }
+      local = LocalState();
+      break;
+
+    case globalItem:
+      switch (tag) {
+      case usagePageTag:
+        global._usagePage = value & 0xffff;
+        break;
+      case logicalMinimumTag:
+        global._logicalMinimum = signedValue;
+        break;
+      case logicalMaximumTag:
+        global._logicalMaximum = signedValue;
+        break;
+      case reportSizeTag:
+        global._reportSize = value;
+        break;
+      case reportIdTag:
+        if (!value || value > 0xff) {
+          return false;
+        }
+        global._reportId = (unsigned char) value;
+        usesReportIds = true;
+        break;
+      case reportCountTag:
+        global._reportCount = value;
+        break;
+      case pushTag:
+        globalStack.push_back(global);
+        break;
+      case popTag:
+        if (globalStack.empty()) {
+          return false;
+        }
+        global = globalStack.back();
+        globalStack.pop_back();
+        break;
+      }
+      break;
+
+    case localItem:
+      switch (tag) {
+      case usageTag:
+        local._usages.push_back(extendedUsage(value, size, global));
+        break;
+      case usageMinimumTag:
+        local._usageMinimum = extendedUsage(value, size, global);
+        local._hasUsageMinimum = true;
+        break;
+      case usageMaximumTag:
+        local._usageMaximum = extendedUsage(value, size, global);
+        local._hasUsageMaximum = true;
+        break;
+      }
+      break;
+    }
+  }
+
+  // hidapi returns numbered reports with the report ID byte first
+  if (usesReportIds) {
+    for (size_t j = 0; j < fields.size(); j++) {
+      fields[j]._bitOffset += 8;
+    }
+  }
+  return true;
+}
+
+FieldExtractor::FieldExtractor(const vector<ReportField>& fields)
+{
+  for (size_t i = 0; i < fields.size(); i++) {
+    const ReportField& field = fields[i];
+    // Wider elements do not fit the 64 bit window read in decode()
+    if (!field._bitSize || field._bitSize > 32) {
+      continue;
+    }
+    for (size_t j = 0; j < field._count; j++) {
+      size_t bitOffset = field._bitOffset + j * field._bitSize;
+      Element element;
+      element._numbered = field._reportId != 0;
+      element._reportId = field._reportId;
+      element._byteOffset = bitOffset / 8;
+      element._shift = bitOffset % 8;
+      element._bitSize = field._bitSize;
+      element._signed = field.isSigned();
+      _elements.push_back(element);
+    }
+  }
+}
+
+void
+FieldExtractor::decode(const unsigned char* report, size_t length, double* values) const
+{
+  for (size_t i = 0; i < _elements.size(); i++) {
+    const Element& element = _elements[i];
+    size_t bytes = (element._shift + element._bitSize + 7) / 8;
+    if ((element._numbered && (!length || report[0] != element._reportId))
+        || element._byteOffset + bytes > length) {
+      values[i] = numeric_limits<double>::quiet_NaN();
+      continue;
+    }
+    uint64_t window = 0;
+    for (size_t j = 0; j < bytes; j++) {
+      window |= (uint64_t) report[element._byteOffset + j] << (8 * j);
+    }
+    uint64_t mask = ((uint64_t) 1 << element._bitSize) - 1;
+    uint64_t raw = (window >> element._shift) & mask;
+    if (element._signed && (raw >> (element._bitSize - 1))) {
+      values[i] = (double) (int64_t) (raw | ~mask);
+    } else {
+      values[i] = (double) raw;
+    }
+  }
+}
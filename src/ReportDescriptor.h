@@ -0,0 +1,118 @@
+// -*- C++ -*-
+
+// Copyright Hans Huebner and contributors. All rights reserved.
+// Permission is hereby granted, free of charge, to any person
+// obtaining a copy of this software and associated documentation
+// files (the "Software"), to deal in the Software without
+// restriction, including without limitation the rights to use, copy,
+// modify, merge, publish, distribute, sublicense, and/or sell copies
+// of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be
+// included in all copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+
+
+#ifndef REPORT_DESCRIPTOR_H
+#define REPORT_DESCRIPTOR_H
+
+#include <vector>
+
+#include <stddef.h>
+#include <stdint.h>
+
+// //////////////////////////////////////////////////////////////////
+// Layout of the reports of a device, as described by the Input,
+// Output and Feature main items of its HID report descriptor
+// //////////////////////////////////////////////////////////////////
+struct ReportField
+{
+  enum Type { input, output, feature };
+
+  // Bits of the main item's data
+  enum Flags {
+    constant = 0x01,
+    variable = 0x02,
+    relative = 0x04
+  };
+
+  ReportField()
+    : _type(input),
+      _reportId(0),
+      _bitOffset(0),
+      _bitSize(0),
+      _count(0),
+      _flags(0),
+      _logicalMinimum(0),
+      _logicalMaximum(0),
+      _usageMinimum(0),
+      _usageMaximum(0)
+  {}
+
+  bool isSigned() const { return _logicalMinimum < 0; }
+
+  Type _type;
+  unsigned char _reportId; // 0 if the device does not use report IDs
+  // Position of the first element in the report as hidapi returns
+  // it, that is, counting the report ID byte if there is one
+  size_t _bitOffset;
+  size_t _bitSize;
+  size_t _count;
+  unsigned _flags;
+  int32_t _logicalMinimum;
+  int32_t _logicalMaximum;
+  // Extended usages (usage page << 16 | usage ID).  Variable items
+  // have one usage per element; array items report indexes into
+  // the usage range instead.
+  std::vector<uint32_t> _usages;
+  uint32_t _usageMinimum;
+  uint32_t _usageMaximum;
+};
+
+// Parses a report descriptor into the fields of all reports.
+// Returns false if the descriptor is malformed, in which case the
+// fields up to the error are returned.
+bool parseReportDescriptor(const unsigned char* descriptor, size_t length, std::vector<ReportField>& fields);
+
+// //////////////////////////////////////////////////////////////////
+// Extracts the values of a list of fields from reports.  The fields
+// are compiled into one extractor per element, so decoding is a
+// single pass of shifts and masks without looking at the descriptor
+// again.
+// //////////////////////////////////////////////////////////////////
+class FieldExtractor
+{
+public:
+  FieldExtractor(const std::vector<ReportField>& fields);
+
+  // Number of values produced for each report
+  size_t valueCount() const { return _elements.size(); }
+
+  // Stores valueCount() values for the report.  Elements of fields
+  // belonging to another report ID, or lying beyond the end of the
+  // report, are set to NaN.
+  void decode(const unsigned char* report, size_t length, double* values) const;
+
+private:
+  struct Element
+  {
+    bool _numbered;
+    unsigned char _reportId;
+    size_t _byteOffset;
+    unsigned _shift;
+    unsigned _bitSize;
+    bool _signed;
+  };
+
+  std::vector<Element> _elements;
+};
+
+#endif
@@ -0,0 +1,99 @@
+// -*- C++ -*-
+
+// Copyright Hans Huebner and contributors. All rights reserved.
+// Permission is hereby granted, free of charge, to any person
+// obtaining a copy of this software and associated documentation
+// files (the "Software"), to deal in the Software without
+// restriction, including without limitation the rights to use, copy,
+// modify, merge, publish, distribute, sublicense, and/or sell copies
+// of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be
+// included in all copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+
+
+#include "ReportFilter.h"
+
+using namespace std;
+
+ReportFilter::ReportFilter()
+  : _active(false)
+{
+  uv_mutex_init(&_lock);
+}
+
+ReportFilter::~ReportFilter()
+{
+  uv_mutex_destroy(&_lock);
+}
+
+void
+ReportFilter::configure(const Settings& settings)
+{
+  uv_mutex_lock(&_lock);
+  _settings = settings;
+  _acceptedIds.assign(256, settings._reportIds.empty());
+  for (size_t i = 0; i < settings._reportIds.size(); i++) {
+    _acceptedIds[settings._reportIds[i]] = true;
+  }
+  size_t histories = settings._numberedReports ? 256 : 1;
+  _previous.assign(histories, vector<unsigned char>());
+  _seen.assign(histories, false);
+  _active = settings._changesOnly || !settings._reportIds.empty();
+  uv_mutex_unlock(&_lock);
+}
+
+void
+ReportFilter::clear()
+{
+  configure(Settings());
+}
+
+bool
+ReportFilter::changed(const vector<unsigned char>& previous, const unsigned char* data, size_t length) const
+{
+  if (previous.size() != length) {
+    return true;
+  }
+  const vector<unsigned char>& mask = _settings._mask;
+  for (size_t i = 0; i < length; i++) {
+    unsigned char bits = i < mask.size() ? mask[i] : 0xff;
+    if ((previous[i] ^ data[i]) & bits) {
+      return true;
+    }
+  }
+  return false;
+}
+
+bool
+ReportFilter::accept(const unsigned char* data, size_t length, bool deliverable)
+{
+  if (!_active) {
+    return true;
+  }
+
+  bool result = true;
+  uv_mutex_lock(&_lock);
+  if (!_settings._reportIds.empty() && (!length || !_acceptedIds[data[0]])) {
+    result = false;
+  } else if (_settings._changesOnly) {
+    size_t history = _settings._numberedReports && length ? data[0] : 0;
+    if (_seen[history] && !changed(_previous[history], data, length)) {
+      result = false;
+    } else if (deliverable) {
+      _previous[history].assign(data, data + length);
+      _seen[history] = true;
+    }
+  }
+  uv_mutex_unlock(&_lock);
+  return result;
+}
@@ -0,0 +1,92 @@
+// -*- C++ -*-
+
+// Copyright Hans Huebner and contributors. All rights reserved.
+// Permission is hereby granted, free of charge, to any person
+// obtaining a copy of this software and associated documentation
+// files (the "Software"), to deal in the Software without
+// restriction, including without limitation the rights to use, copy,
+// modify, merge, publish, distribute, sublicense, and/or sell copies
+// of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be
+// included in all copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+
+
+#ifndef REPORT_FILTER_H
+#define REPORT_FILTER_H
+
+#include <atomic>
+#include <vector>
+
+#include <stddef.h>
+
+#include <uv.h>
+
+// //////////////////////////////////////////////////////////////////
+// Decides in the reading thread whether an input report is passed
+// on to JavaScript at all, so that uninteresting reports cost
+// neither a Buffer nor a wakeup of the event loop.  Reports can be
+// restricted to a set of report IDs and to those that differ from
+// the previous one passed on, compared under a byte mask.  Safe to
+// use from any thread; an unconfigured filter costs one atomic load.
+// //////////////////////////////////////////////////////////////////
+class ReportFilter
+{
+public:
+  struct Settings
+  {
+    Settings()
+      : _changesOnly(false),
+        _numberedReports(false)
+    {}
+
+    // Only pass on reports that differ from the previous one
+    bool _changesOnly;
+    // Bits to compare for _changesOnly, byte by byte; bytes beyond
+    // the mask are compared completely
+    std::vector<unsigned char> _mask;
+    // Reports start with a report ID; the previous report is
+    // remembered for each ID
+    bool _numberedReports;
+    // If not empty, only reports starting with one of these are
+    // passed on
+    std::vector<unsigned char> _reportIds;
+  };
+
+  ReportFilter();
+  ~ReportFilter();
+
+  void configure(const Settings& settings);
+  void clear();
+
+  // Returns whether the report should be passed on, and if so,
+  // remembers it for comparison with the next one.  Reports that
+  // will be dropped for lack of space are not remembered, so that
+  // the next equal one gets through.
+  bool accept(const unsigned char* data, size_t length, bool deliverable = true);
+
+private:
+  bool changed(const std::vector<unsigned char>& previous, const unsigned char* data, size_t length) const;
+
+  ReportFilter(const ReportFilter&);
+  ReportFilter& operator=(const ReportFilter&);
+
+  std::atomic<bool> _active;
+  uv_mutex_t _lock;
+  // everything below is protected by _lock
+  Settings _settings;
+  std::vector<bool> _acceptedIds; // indexed by report ID
+  std::vector<std::vector<unsigned char> > _previous; // by report ID if numbered
+  std::vector<bool> _seen;
+};
+
+#endif
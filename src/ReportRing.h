@@ -0,0 +1,172 @@
+// -*- C++ -*-
+
+// Copyright Hans Huebner and contributors. All rights reserved.
+// Permission is hereby granted, free of charge, to any person
+// obtaining a copy of this software and associated documentation
+// files (the "Software"), to deal in the Software without
+// restriction, including without limitation the rights to use, copy,
+// modify, merge, publish, distribute, sublicense, and/or sell copies
+// of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be
+// included in all copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+
+#ifndef REPORT_RING_H
+#define REPORT_RING_H
+
+#include <atomic>
+#include <vector>
+
+#include <stddef.h>
+#include <stdint.h>
+
+// //////////////////////////////////////////////////////////////////
+// Lock-free single producer / single consumer ring of fixed size
+// report slots.  The reader thread reserves a slot, lets hid_read
+// fill it in place and commits it; the JS thread peeks at and
+// releases slots in order.  No memory is allocated after
+// construction.  The capacity need not be a power of two; the slots
+// are, but at most capacity of them are used.
+// //////////////////////////////////////////////////////////////////
+class ReportRing
+{
+public:
+  ReportRing(size_t capacity, size_t slotSize)
+    : _capacity(capacity ? capacity : 1),
+      _mask(roundUp(_capacity) - 1),
+      _slotSize(slotSize),
+      _data((_mask + 1) * slotSize),
+      _lengths(_mask + 1),
+      _times(_mask + 1),
+      _tags(_mask + 1),
+      _head(0),
+      _tail(0)
+  {}
+
+  size_t capacity() const { return _capacity; }
+  size_t slotSize() const { return _slotSize; }
+
+  size_t size() const
+  {
+    return _head.load(std::memory_order_acquire) - _tail.load(std::memory_order_acquire);
+  }
+
+  // Producer side: returns the slot to be filled next, or 0 if the
+  // ring is full.
+  unsigned char* reserve()
+  {
+    size_t head = _head.load(std::memory_order_relaxed);
+    if (head - _tail.load(std::memory_order_acquire) == _capacity) {
+      return 0;
+    }
+    return &_data[(head & _mask) * _slotSize];
+  }
+
+  // Producer side: discards the oldest report if the ring is full.
+  // Moves the consumer's end of the ring, so the caller has to keep
+  // the consumer from looking at the ring in the meantime.  Returns
+  // whether a report was discarded.
+  bool dropOldest()
+  {
+    size_t tail = _tail.load(std::memory_order_acquire);
+    if (_head.load(std::memory_order_relaxed) - tail != _capacity) {
+      return false;
+    }
+    _tail.store(tail + 1, std::memory_order_release);
+    return true;
+  }
+
+  // Producer side: publishes the slot returned by reserve() along
+  // with the uv_hrtime() at which the report was received and a tag
+  // of the producer's choosing, such as the device it came from
+  void commit(size_t length, uint64_t time, unsigned int tag = 0)
+  {
+    size_t head = _head.load(std::memory_order_relaxed);
+    _lengths[head & _mask] = length;
+    _times[head & _mask] = time;
+    _tags[head & _mask] = tag;
+    _head.store(head + 1, std::memory_order_release);
+  }
+
+  // Consumer side: returns the oldest report, or 0 if the ring is
+  // empty.  The slot stays valid until release() is called.
+  const unsigned char* peek(size_t& length) const
+  {
+    return peek(0, length);
+  }
+
+  // Consumer side: returns the report at the given position counted
+  // from the oldest one, or 0 if fewer reports are queued
+  const unsigned char* peek(size_t index, size_t& length) const
+  {
+    size_t tail = _tail.load(std::memory_order_acquire);
+    if (index >= _head.load(std::memory_order_acquire) - tail) {
+      return 0;
+    }
+    tail += index;
+    length = _lengths[tail & _mask];
+    return &_data[(tail & _mask) * _slotSize];
+  }
+
+  // Consumer side: like peek(), also returning the time passed to
+  // commit()
+  const unsigned char* peek(size_t index, size_t& length, uint64_t& time) const
+  {
+    const unsigned char* data = peek(index, length);
+    if (data) {
+      time = _times[(_tail.load(std::memory_order_acquire) + index) & _mask];
+    }
+    return data;
+  }
+
+  // Consumer side: like peek(), also returning the tag passed to
+  // commit()
+  const unsigned char* peek(size_t index, size_t& length, uint64_t& time, unsigned int& tag) const
+  {
+    const unsigned char* data = peek(index, length, time);
+    if (data) {
+      tag = _tags[(_tail.load(std::memory_order_acquire) + index) & _mask];
+    }
+    return data;
+  }
+
+  // Consumer side: hands the oldest slots back to the producer
+  void release(size_t count = 1)
+  {
+    _tail.store(_tail.load(std::memory_order_relaxed) + count, std::memory_order_release);
+  }
+
+private:
+  static size_t roundUp(size_t n)
+  {
+    size_t result = 1;
+    while (result < n) {
+      result <<= 1;
+    }
+    return result;
+  }
+
+  ReportRing(const ReportRing&);
+  ReportRing& operator=(const ReportRing&);
+
+  const size_t _capacity;
+  const size_t _mask;
+  const size_t _slotSize;
+  std::vector<unsigned char> _data;
+  std::vector<size_t> _lengths;
+  std::vector<uint64_t> _times;
+  std::vector<unsigned int> _tags;
+  std::atomic<size_t> _head;
+  std::atomic<size_t> _tail;
+};
+
+#endif
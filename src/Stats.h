@@ -0,0 +1,217 @@
+// -*- C++ -*-
+
+// Copyright Hans Huebner and contributors. All rights reserved.
+// Permission is hereby granted, free of charge, to any person
+// obtaining a copy of this software and associated documentation
+// files (the "Software"), to deal in the Software without
+// restriction, including without limitation the rights to use, copy,
+// modify, merge, publish, distribute, sublicense, and/or sell copies
+// of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be
+// included in all copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+
+
+#ifndef STATS_H
+#define STATS_H
+
+#include <atomic>
+
+#include <stddef.h>
+#include <stdint.h>
+
+// //////////////////////////////////////////////////////////////////
+// Latency histogram in the style of HdrHistogram: values are counted
+// in buckets that are linear within each power of two, which keeps
+// the relative error below 1/subBuckets over the whole range.
+// Recording only increments atomic counters, so the histogram can be
+// fed from any thread and stay enabled in production.
+// //////////////////////////////////////////////////////////////////
+class LatencyHistogram
+{
+public:
+  // Values are nanoseconds; anything above 2^maxBits (about 4.9
+  // hours) ends up in the last bucket
+  static const unsigned subBucketBits = 4;
+  static const unsigned subBuckets = 1 << subBucketBits;
+  static const unsigned maxBits = 44;
+  static const unsigned bucketCount = (maxBits - subBucketBits + 1) * subBuckets;
+
+  LatencyHistogram()
+  {
+    reset();
+  }
+
+  void record(uint64_t value)
+  {
+    _counts[bucketIndex(value)].fetch_add(1, std::memory_order_relaxed);
+    _count.fetch_add(1, std::memory_order_relaxed);
+    _sum.fetch_add(value, std::memory_order_relaxed);
+    uint64_t max = _max.load(std::memory_order_relaxed);
+    while (value > max && !_max.compare_exchange_weak(max, value, std::memory_order_relaxed))
+      ;
+  }
+
+  // Not atomic with respect to concurrent record() calls; a value
+  // recorded meanwhile may or may not be counted
+  void reset()
+  {
+    for (unsigned i = 0; i < bucketCount; i++) {
+      _counts[i].store(0, std::memory_order_relaxed);
+    }
+    _count.store(0, std::memory_order_relaxed);
+    _sum.store(0, std::memory_order_relaxed);
+    _max.store(0, std::memory_order_relaxed);
+  }
+
+  uint64_t count() const { return _count.load(std::memory_order_relaxed); }
+  uint64_t max() const { return _max.load(std::memory_order_relaxed); }
+
+  double mean() const
+  {
+    uint64_t count = this->count();
+    return count ? (double) _sum.load(std::memory_order_relaxed) / count : 0;
+  }
+
+  // Returns the highest value equivalent to the one below which the
+  // given fraction of all recorded values lies
+  uint64_t percentile(double fraction) const
+  {
+    uint64_t count = this->count();
+    if (!count) {
+      return 0;
+    }
+    uint64_t rank = (uint64_t) (fraction * count + 0.5);
+    if (rank < 1) {
+      rank = 1;
+    }
+    uint64_t seen = 0;
+    for (unsigned i = 0; i < bucketCount; i++) {
+      seen += _counts[i].load(std::memory_order_relaxed);
+      if (seen >= rank) {
+        uint64_t value = highestEquivalentValue(i);
+        return value < max() ? value : max();
+      }
+    }
+    return max();
+  }
+
+private:
+  static unsigned bucketIndex(uint64_t value)
+  {
+    // Values below 2 * subBuckets are counted exactly; above that,
+    // each power of two is split into subBuckets buckets
+    unsigned shift = 0;
+    while (value >= 2 * subBuckets) {
+      value >>= 1;
+      shift++;
+    }
+    unsigned index = shift * subBuckets + (unsigned) value;
+    return index < bucketCount ? index : bucketCount - 1;
+  }
+
+  static uint64_t highestEquivalentValue(unsigned index)
+  {
+    if (index < 2 * subBuckets) {
+      return index;
+    }
+    unsigned shift = index / subBuckets - 1;
+    uint64_t sub = index % subBuckets + subBuckets;
+    return ((sub + 1) << shift) - 1;
+  }
+
+  std::atomic<uint64_t> _counts[bucketCount];
+  std::atomic<uint64_t> _count;
+  std::atomic<uint64_t> _sum;
+  std::atomic<uint64_t> _max;
+};
+
+// //////////////////////////////////////////////////////////////////
+// Performance counters of one device.  Updated from the threadpool,
+// the reader and writer threads and the JS thread alike.
+// //////////////////////////////////////////////////////////////////
+struct DeviceStats
+{
+  DeviceStats()
+  {
+    reset();
+  }
+
+  void reset()
+  {
+    _reportsRead = 0;
+    _bytesRead = 0;
+    _readErrors = 0;
+    _droppedReports = 0;
+    _filteredReports = 0;
+    _readerPauses = 0;
+    _transactions = 0;
+    _transactionTimeouts = 0;
+    _expiredCommands = 0;
+    _periodicWrites = 0;
+    _periodicMissed = 0;
+    _writes = 0;
+    _bytesWritten = 0;
+    _writeErrors = 0;
+    _deliveryLatency.reset();
+    _queueWait.reset();
+    _writeLatency.reset();
+    _transactionLatency.reset();
+    _periodicJitter.reset();
+  }
+
+  void countRead(size_t length)
+  {
+    _reportsRead.fetch_add(1, std::memory_order_relaxed);
+    _bytesRead.fetch_add(length, std::memory_order_relaxed);
+  }
+
+  void countWrite(int result)
+  {
+    if (result < 0) {
+      _writeErrors.fetch_add(1, std::memory_order_relaxed);
+    } else {
+      _writes.fetch_add(1, std::memory_order_relaxed);
+      _bytesWritten.fetch_add(result, std::memory_order_relaxed);
+    }
+  }
+
+  std::atomic<uint64_t> _reportsRead;
+  std::atomic<uint64_t> _bytesRead;
+  std::atomic<uint64_t> _readErrors;
+  std::atomic<uint64_t> _droppedReports;
+  std::atomic<uint64_t> _filteredReports;
+  // Times the reader stopped reading because its ring was full
+  std::atomic<uint64_t> _readerPauses;
+  std::atomic<uint64_t> _transactions;
+  std::atomic<uint64_t> _transactionTimeouts;
+  // Asynchronous writes and transactions not sent by their deadline
+  std::atomic<uint64_t> _expiredCommands;
+  // Periodic outputs sent, and sends skipped for being too late
+  std::atomic<uint64_t> _periodicWrites;
+  std::atomic<uint64_t> _periodicMissed;
+  std::atomic<uint64_t> _writes;
+  std::atomic<uint64_t> _bytesWritten;
+  std::atomic<uint64_t> _writeErrors;
+  // From the report arriving in native code to the JS callback
+  LatencyHistogram _deliveryLatency;
+  // From queueing a read to a threadpool thread picking it up
+  LatencyHistogram _queueWait;
+  // From queueing an asynchronous write to its callback
+  LatencyHistogram _writeLatency;
+  // From writing a transaction's request to its reply arriving
+  LatencyHistogram _transactionLatency;
+  // From a periodic output being due to it being sent
+  LatencyHistogram _periodicJitter;
+};
+
+#endif
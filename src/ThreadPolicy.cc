@@ -0,0 +1,271 @@
+// -*- C++ -*-
+
+// Copyright Hans Huebner and contributors. All rights reserved.
+// Permission is hereby granted, free of charge, to any person
+// obtaining a copy of this software and associated documentation
+// files (the "Software"), to deal in the Software without
+// restriction, including without limitation the rights to use, copy,
+// modify, merge, publish, distribute, sublicense, and/or sell copies
+// of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be
+// included in all copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+
+
+#include <sstream>
+
+#include <errno.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+#ifdef __APPLE__
+#include <mach/mach.h>
+#include <mach/mach_error.h>
+#include <mach/mach_time.h>
+#include <mach/thread_policy.h>
+#endif
+
+#include "ThreadPolicy.h"
+
+using namespace std;
+
+namespace {
+
+#if defined(_WIN32)
+
+bool
+applyScheduling(uv_thread_t thread, const ThreadPolicy& policy, string& error)
+{
+  if (policy._priority) {
+    error = "real-time priorities are only supported on Linux";
+    return false;
+  }
+  if (!SetThreadPriority(thread, policy._realtime ? THREAD_PRIORITY_TIME_CRITICAL : THREAD_PRIORITY_NORMAL)) {
+    ostringstream os;
+    os << "cannot set thread priority: error " << GetLastError();
+    error = os.str();
+    return false;
+  }
+  return true;
+}
+
+bool
+applyAffinity(uv_thread_t thread, const ThreadPolicy& policy, string& error)
+{
+  DWORD_PTR processMask, systemMask;
+  if (!GetProcessAffinityMask(GetCurrentProcess(), &processMask, &systemMask)) {
+    processMask = 0;
+  }
+  DWORD_PTR mask = policy._cpus.empty() ? processMask : 0;
+  for (size_t i = 0; i < policy._cpus.size(); i++) {
+    if (policy._cpus[i] >= sizeof(DWORD_PTR) * 8) {
+      error = "CPU number out of range";
+      return false;
+    }
+    mask |= (DWORD_PTR) 1 << policy._cpus[i];
+  }
+  if (mask && !SetThreadAffinityMask(thread, mask)) {
+    ostringstream os;
+    os << "cannot set CPU affinity: error " << GetLastError();
+    error = os.str();
+    return false;
+  }
+  return true;
+}
+
+#elif defined(__APPLE__)
+
+// Mac OS only lets threads pick their QoS class themselves, whereas
+// the time constraint policy can be set from outside
+bool
+applyScheduling(uv_thread_t thread, const ThreadPolicy& policy, string& error)
+{
+  if (policy._priority) {
+    error = "real-time priorities are only supported on Linux";
+    return false;
+  }
+  thread_port_t port = pthread_mach_thread_np(thread);
+  kern_return_t result;
+  if (policy._realtime) {
+    // Up to half a millisecond of work to be done within one
+    mach_timebase_info_data_t timebase;
+    mach_timebase_info(&timebase);
+    uint32_t millisecond = (uint32_t) (1000000ULL * timebase.denom / timebase.numer);
+    thread_time_constraint_policy_data_t constraint;
+    constraint.period = 0;
+    constraint.computation = millisecond / 2;
+    constraint.constraint = millisecond;
+    constraint.preemptible = TRUE;
+    result = thread_policy_set(port, THREAD_TIME_CONSTRAINT_POLICY,
+                               (thread_policy_t) &constraint, THREAD_TIME_CONSTRAINT_POLICY_COUNT);
+  } else {
+    thread_standard_policy_data_t standard;
+    result = thread_policy_set(port, THREAD_STANDARD_POLICY,
+                               (thread_policy_t) &standard, THREAD_STANDARD_POLICY_COUNT);
+  }
+  if (result != KERN_SUCCESS) {
+    ostringstream os;
+    os << "cannot set thread policy: " << mach_error_string(result);
+    error = os.str();
+    return false;
+  }
+  return true;
+}
+
+bool
+applyAffinity(uv_thread_t, const ThreadPolicy& policy, string& error)
+{
+  if (!policy._cpus.empty()) {
+    error = "CPU affinity is not supported on this platform";
+    return false;
+  }
+  return true;
+}
+
+#else
+
+string
+failure(const char* what, int code)
+{
+  ostringstream os;
+  os << "cannot " << what << ": " << strerror(code);
+  return os.str();
+}
+
+bool
+applyScheduling(uv_thread_t thread, const ThreadPolicy& policy, string& error)
+{
+  struct sched_param param;
+  memset(&param, 0, sizeof param);
+  int schedPolicy = SCHED_OTHER;
+  if (policy._realtime) {
+    schedPolicy = SCHED_FIFO;
+    param.sched_priority = policy._priority ? policy._priority : ThreadPolicy::defaultPriority;
+    if (param.sched_priority < sched_get_priority_min(SCHED_FIFO)
+        || param.sched_priority > sched_get_priority_max(SCHED_FIFO)) {
+      ostringstream os;
+      os << "real-time priority must be between " << sched_get_priority_min(SCHED_FIFO)
+         << " and " << sched_get_priority_max(SCHED_FIFO);
+      error = os.str();
+      return false;
+    }
+  }
+  int result = pthread_setschedparam(thread, schedPolicy, &param);
+  if (result) {
+    error = failure(policy._realtime ? "set real-time scheduling" : "set scheduling", result);
+    return false;
+  }
+  return true;
+}
+
+bool
+applyAffinity(uv_thread_t thread, const ThreadPolicy& policy, string& error)
+{
+#ifdef __linux__
+  cpu_set_t cpus;
+  CPU_ZERO(&cpus);
+  if (policy._cpus.empty()) {
+    // Back to the CPUs the JS thread, and so the process, may use
+    int result = sched_getaffinity(0, sizeof cpus, &cpus) ? errno : 0;
+    if (result) {
+      error = failure("get CPU affinity", result);
+      return false;
+    }
+  }
+  for (size_t i = 0; i < policy._cpus.size(); i++) {
+    if (policy._cpus[i] >= CPU_SETSIZE) {
+      error = "CPU number out of range";
+      return false;
+    }
+    CPU_SET(policy._cpus[i], &cpus);
+  }
+  int result = pthread_setaffinity_np(thread, sizeof cpus, &cpus);
+  if (result) {
+    error = failure("set CPU affinity", result);
+    return false;
+  }
+  return true;
+#else
+  if (!policy._cpus.empty()) {
+    error = "CPU affinity is not supported on this platform";
+    return false;
+  }
+  return true;
+#endif
+}
+
+#endif
+
+void
+probeThread(void* arg)
+{
+  uv_sem_wait(static_cast<uv_sem_t*>(arg));
+}
+
+}
+
+bool
+applyThreadPolicy(uv_thread_t thread, const ThreadPolicy& policy, const ThreadPolicy& previous, string& error)
+{
+  if (!applyScheduling(thread, policy, error)) {
+    return false;
+  }
+  if (!applyAffinity(thread, policy, error)) {
+    string ignored;
+    applyScheduling(thread, previous, ignored);
+    return false;
+  }
+  return true;
+}
+
+bool
+applyThreadPolicy(const vector<uv_thread_t>& threads, const ThreadPolicy& policy, const ThreadPolicy& previous,
+                  string& error)
+{
+  for (size_t i = 0; i < threads.size(); i++) {
+    if (!applyThreadPolicy(threads[i], policy, previous, error)) {
+      string ignored;
+      while (i--) {
+        applyThreadPolicy(threads[i], previous, policy, ignored);
+      }
+      return false;
+    }
+  }
+  return true;
+}
+
+bool
+checkThreadPolicy(const ThreadPolicy& policy, string& error)
+{
+  uv_sem_t applied;
+  uv_thread_t thread;
+  if (uv_sem_init(&applied, 0)) {
+    error = "cannot create semaphore";
+    return false;
+  }
+  if (uv_thread_create(&thread, probeThread, &applied)) {
+    uv_sem_destroy(&applied);
+    error = "cannot create thread";
+    return false;
+  }
+  bool result = applyThreadPolicy(thread, policy, ThreadPolicy(), error);
+  uv_sem_post(&applied);
+  uv_thread_join(&thread);
+  uv_sem_destroy(&applied);
+  return result;
+}
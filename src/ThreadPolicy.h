@@ -0,0 +1,63 @@
+// -*- C++ -*-
+
+// Copyright Hans Huebner and contributors. All rights reserved.
+// Permission is hereby granted, free of charge, to any person
+// obtaining a copy of this software and associated documentation
+// files (the "Software"), to deal in the Software without
+// restriction, including without limitation the rights to use, copy,
+// modify, merge, publish, distribute, sublicense, and/or sell copies
+// of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be
+// included in all copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+
+
+#ifndef THREAD_POLICY_H
+#define THREAD_POLICY_H
+
+#include <string>
+#include <vector>
+
+#include <uv.h>
+
+// //////////////////////////////////////////////////////////////////
+// Scheduling of the native threads reading and writing a device:
+// real-time scheduling (SCHED_FIFO on Linux, time-critical priority
+// on Windows, the time constraint policy on Mac OS) and the CPUs the
+// threads may run on.  The default policy leaves both to the OS.
+// //////////////////////////////////////////////////////////////////
+struct ThreadPolicy
+{
+  ThreadPolicy() : _realtime(false), _priority(0) {}
+
+  bool isDefault() const { return !_realtime && _cpus.empty(); }
+
+  bool _realtime;
+  int _priority; // SCHED_FIFO priority, Linux only, 0 for the default
+  std::vector<unsigned int> _cpus; // empty for all of them
+
+  static const int defaultPriority = 10;
+};
+
+// Applies the policy to running threads which follow previous.
+// Returns false with error set if the OS refuses, typically for lack
+// of privileges, once all threads are back to previous.
+bool applyThreadPolicy(uv_thread_t thread, const ThreadPolicy& policy, const ThreadPolicy& previous,
+                       std::string& error);
+bool applyThreadPolicy(const std::vector<uv_thread_t>& threads, const ThreadPolicy& policy,
+                       const ThreadPolicy& previous, std::string& error);
+
+// Tries the policy on a short-lived thread, to tell whether it can be
+// applied before any thread needs it
+bool checkThreadPolicy(const ThreadPolicy& policy, std::string& error);
+
+#endif
@@ -0,0 +1,599 @@
+// -*- C++ -*-
+
+// Copyright Hans Huebner and contributors. All rights reserved.
+// Permission is hereby granted, free of charge, to any person
+// obtaining a copy of this software and associated documentation
+// files (the "Software"), to deal in the Software without
+// restriction, including without limitation the rights to use, copy,
+// modify, merge, publish, distribute, sublicense, and/or sell copies
+// of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be
+// included in all copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+
+
+// //////////////////////////////////////////////////////////////////
+// Synthetic in-process implementation of the hidapi interface, used
+// by the HID-mock target to measure the binding without devices.
+// Each mock device produces input reports at a fixed rate on a
+// virtual timeline, so a reader that falls behind finds them queued
+// up like it would with a real device.  Configured through
+// environment variables, read by hid_init():
+//
+//   HID_MOCK_DEVICES        number of devices (default 1)
+//   HID_MOCK_REPORT_RATE    input reports per second, 0 for as fast
+//                           as they are read (default 1000)
+//   HID_MOCK_REPORT_SIZE    input and feature report size (default 64)
+//   HID_MOCK_WRITE_LATENCY  microseconds taken by each write and
+//                           feature report transfer (default 0)
+//   HID_MOCK_REPLAY         capture log written by HID.captureStart()
+//                           to replay instead, with one mock device
+//                           per device in the log
+//   HID_MOCK_REPLAY_SPEED   factor to speed up replay by, 0 for as
+//                           fast as the reports are read (default 1)
+//   HID_MOCK_MANUFACTURER   manufacturer string of all devices, in
+//                           UTF-8 (default node-hid)
+//   HID_MOCK_FAIL_AFTER     number of input reports after which reads
+//                           of an opened device fail as if it had been
+//                           unplugged, 0 for never (default 0)
+//
+// The capture log is mapped into memory and its input reports are
+// copied straight from there, so replay costs no more than synthetic
+// reports do.  Replayed reports are never lost, however far behind
+// the reader is.
+// //////////////////////////////////////////////////////////////////
+
+#include <string>
+#include <vector>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <wchar.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#include <uv.h>
+
+#include <hidapi.h>
+
+#include "../CaptureFormat.h"
+
+namespace {
+
+const unsigned short mockVendorId = 0x1209;
+const unsigned short mockProductId = 0x0001;
+const unsigned short mockUsagePage = 0xff00;
+const unsigned short mockUsage = 0x0001;
+
+// Queued reports beyond this are lost, like in the kernel's buffer
+const uint64_t maxQueuedReports = 64;
+
+typedef std::vector<const CaptureFormat::RecordHeader*> Records;
+
+struct Config {
+  int _devices;
+  uint64_t _reportPeriod; // ns, 0 for unlimited
+  size_t _reportSize;
+  uint64_t _writeLatency; // ns
+  std::string _manufacturer;
+  uint64_t _failAfter; // reports, 0 for never
+  // Input records of each device in the mapped capture log, if
+  // replaying one
+  std::vector<Records> _replay;
+  uint64_t _replayStart; // time of the first record
+  double _replaySpeed;
+};
+
+Config config;
+bool configured = false;
+
+long
+environment(const char* name, long defaultValue)
+{
+  const char* value = getenv(name);
+  return value && *value ? strtol(value, 0, 0) : defaultValue;
+}
+
+// Maps the whole file read-only, for the lifetime of the process
+const unsigned char*
+mapFile(const char* path, size_t& size)
+{
+#ifdef _WIN32
+  HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, 0, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, 0);
+  if (file == INVALID_HANDLE_VALUE) {
+    return 0;
+  }
+  LARGE_INTEGER fileSize;
+  HANDLE mapping = 0;
+  if (GetFileSizeEx(file, &fileSize) && fileSize.QuadPart) {
+    mapping = CreateFileMappingA(file, 0, PAGE_READONLY, 0, 0, 0);
+  }
+  CloseHandle(file);
+  if (!mapping) {
+    return 0;
+  }
+  void* data = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+  CloseHandle(mapping);
+  size = (size_t) fileSize.QuadPart;
+  return (const unsigned char*) data;
+#else
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    return 0;
+  }
+  struct stat st;
+  void* data = MAP_FAILED;
+  if (!fstat(fd, &st) && st.st_size) {
+    data = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  }
+  close(fd);
+  if (data == MAP_FAILED) {
+    return 0;
+  }
+  // Replay reads the log from start to end
+  madvise(data, st.st_size, MADV_SEQUENTIAL);
+  size = st.st_size;
+  return (const unsigned char*) data;
+#endif
+}
+
+// Sorts the input records of the capture log by device, numbering
+// the devices in the order they appear in the log
+void
+loadReplay(const char* path)
+{
+  size_t size = 0;
+  const unsigned char* data = mapFile(path, size);
+  if (!data
+      || size < sizeof CaptureFormat::magic
+      || memcmp(data, CaptureFormat::magic, sizeof CaptureFormat::magic)) {
+    fprintf(stderr, "hidapi-mock: %s is not a capture log, not replaying it\n", path);
+    return;
+  }
+  std::vector<uint32_t> devices;
+  size_t offset = sizeof CaptureFormat::magic;
+  while (offset + sizeof(CaptureFormat::RecordHeader) <= size) {
+    const CaptureFormat::RecordHeader* record = (const CaptureFormat::RecordHeader*) (data + offset);
+    size_t recordSize = CaptureFormat::recordSize(record->_length);
+    if (offset + sizeof(CaptureFormat::RecordHeader) + record->_length > size) {
+      // Cut off, as the capture was not stopped
+      break;
+    }
+    if (offset == sizeof CaptureFormat::magic) {
+      config._replayStart = record->_time;
+    }
+    size_t index = 0;
+    while (index < devices.size() && devices[index] != record->_device) {
+      index++;
+    }
+    if (record->_kind == CaptureFormat::device && index == devices.size()) {
+      devices.push_back(record->_device);
+      config._replay.push_back(Records());
+    } else if (record->_kind == CaptureFormat::input && index < devices.size()) {
+      config._replay[index].push_back(record);
+    }
+    offset += recordSize;
+  }
+  config._devices = (int) config._replay.size();
+}
+
+void
+configure()
+{
+  long rate = environment("HID_MOCK_REPORT_RATE", 1000);
+  config._devices = (int) environment("HID_MOCK_DEVICES", 1);
+  config._reportPeriod = rate > 0 ? 1000000000 / rate : 0;
+  config._reportSize = (size_t) environment("HID_MOCK_REPORT_SIZE", 64);
+  config._writeLatency = (uint64_t) environment("HID_MOCK_WRITE_LATENCY", 0) * 1000;
+  const char* manufacturer = getenv("HID_MOCK_MANUFACTURER");
+  config._manufacturer = manufacturer && *manufacturer ? manufacturer : "node-hid";
+  config._failAfter = (uint64_t) environment("HID_MOCK_FAIL_AFTER", 0);
+  const char* speed = getenv("HID_MOCK_REPLAY_SPEED");
+  config._replaySpeed = speed && *speed ? strtod(speed, 0) : 1;
+  const char* replay = getenv("HID_MOCK_REPLAY");
+  if (replay && *replay) {
+    loadReplay(replay);
+  }
+  configured = true;
+}
+
+// Decodes UTF-8 into what hidapi returns: UTF-32, or UTF-16 where
+// wchar_t has 16 bits.  Not validating, the strings are the mock's
+// own or come from its configuration.
+wchar_t*
+wideString(const char* string)
+{
+  size_t length = strlen(string);
+  wchar_t* result = (wchar_t*) calloc(length + 1, sizeof(wchar_t));
+  size_t out = 0;
+  for (const unsigned char* in = (const unsigned char*) string; *in; ) {
+    unsigned long c = *in++;
+    int continuation = c >= 0xf0 ? 3 : c >= 0xe0 ? 2 : c >= 0xc0 ? 1 : 0;
+    c &= 0x7f >> (continuation ? continuation + 1 : 0);
+    for (; continuation && (*in & 0xc0) == 0x80; continuation--) {
+      c = (c << 6) | (*in++ & 0x3f);
+    }
+    if (sizeof(wchar_t) == 2 && c >= 0x10000) {
+      result[out++] = (wchar_t) (0xd800 + ((c - 0x10000) >> 10));
+      c = 0xdc00 + ((c - 0x10000) & 0x3ff);
+    }
+    result[out++] = (wchar_t) c;
+  }
+  return result;
+}
+
+int
+copyWideString(wchar_t* string, size_t maxlen, const char* utf8)
+{
+  wchar_t* wide = wideString(utf8);
+  size_t i = 0;
+  for (; maxlen && i < maxlen - 1 && wide[i]; i++) {
+    string[i] = wide[i];
+  }
+  if (maxlen) {
+    string[i] = 0;
+  }
+  free(wide);
+  return 0;
+}
+
+int
+copyString(wchar_t* string, size_t maxlen, const char* format, int index)
+{
+  char buf[64];
+  snprintf(buf, sizeof buf, format, index);
+  size_t i = 0;
+  for (; maxlen && i < maxlen - 1 && buf[i]; i++) {
+    string[i] = buf[i];
+  }
+  if (maxlen) {
+    string[i] = 0;
+  }
+  return 0;
+}
+
+}
+
+struct hid_device_ {
+  int _index;
+  uint64_t _opened; // uv_hrtime() of hid_open
+  uint64_t _sequence; // number of the next input report
+  bool _nonblocking;
+  uv_mutex_t _lock;
+  uv_cond_t _timer; // only waited on, to sleep
+};
+
+namespace {
+
+void
+sleepUntil(hid_device* dev, uint64_t deadline)
+{
+  uv_mutex_lock(&dev->_lock);
+  uint64_t now;
+  while ((now = uv_hrtime()) < deadline) {
+    uv_cond_timedwait(&dev->_timer, &dev->_lock, deadline - now);
+  }
+  uv_mutex_unlock(&dev->_lock);
+}
+
+void
+transferDelay(hid_device* dev)
+{
+  if (config._writeLatency) {
+    sleepUntil(dev, uv_hrtime() + config._writeLatency);
+  }
+}
+
+size_t
+fillReport(unsigned char* data, size_t length, uint64_t sequence, size_t start)
+{
+  if (length > config._reportSize) {
+    length = config._reportSize;
+  }
+  // Sequence number in little endian, then a counting pattern
+  for (size_t i = start; i < length; i++) {
+    size_t j = i - start;
+    data[i] = j < 8 ? (unsigned char) (sequence >> (8 * j)) : (unsigned char) j;
+  }
+  return length;
+}
+
+}
+
+int HID_API_EXPORT
+hid_init(void)
+{
+  configure();
+  return 0;
+}
+
+int HID_API_EXPORT
+hid_exit(void)
+{
+  return 0;
+}
+
+struct hid_device_info HID_API_EXPORT*
+hid_enumerate(unsigned short vendor_id, unsigned short product_id)
+{
+  if (!configured) {
+    configure();
+  }
+  if ((vendor_id && vendor_id != mockVendorId)
+      || (product_id && product_id != mockProductId)) {
+    return 0;
+  }
+
+  struct hid_device_info* root = 0;
+  struct hid_device_info** next = &root;
+  for (int i = 0; i < config._devices; i++) {
+    char buf[64];
+    struct hid_device_info* info = (struct hid_device_info*) calloc(1, sizeof(struct hid_device_info));
+    snprintf(buf, sizeof buf, "mock:%d", i);
+    info->path = strdup(buf);
+    info->vendor_id = mockVendorId;
+    info->product_id = mockProductId;
+    snprintf(buf, sizeof buf, "MOCK%04d", i);
+    info->serial_number = wideString(buf);
+    info->release_number = 0x0100;
+    info->manufacturer_string = wideString(config._manufacturer.c_str());
+    snprintf(buf, sizeof buf, "Mock device %d", i);
+    info->product_string = wideString(buf);
+    info->usage_page = mockUsagePage;
+    info->usage = mockUsage;
+    info->interface_number = -1;
+    *next = info;
+    next = &info->next;
+  }
+  return root;
+}
+
+void HID_API_EXPORT
+hid_free_enumeration(struct hid_device_info* devs)
+{
+  while (devs) {
+    struct hid_device_info* next = devs->next;
+    free(devs->path);
+    free(devs->serial_number);
+    free(devs->manufacturer_string);
+    free(devs->product_string);
+    free(devs);
+    devs = next;
+  }
+}
+
+hid_device* HID_API_EXPORT
+hid_open(unsigned short vendor_id, unsigned short product_id, const wchar_t* serial_number)
+{
+  struct hid_device_info* devs = hid_enumerate(vendor_id, product_id);
+  hid_device* result = 0;
+  for (struct hid_device_info* dev = devs; dev && !result; dev = dev->next) {
+    if (!serial_number || !wcscmp(serial_number, dev->serial_number)) {
+      result = hid_open_path(dev->path);
+    }
+  }
+  hid_free_enumeration(devs);
+  return result;
+}
+
+hid_device* HID_API_EXPORT
+hid_open_path(const char* path)
+{
+  if (!configured) {
+    configure();
+  }
+  int index;
+  if (sscanf(path, "mock:%d", &index) != 1 || index < 0 || index >= config._devices) {
+    return 0;
+  }
+
+  hid_device* dev = new hid_device;
+  dev->_index = index;
+  dev->_opened = uv_hrtime();
+  dev->_sequence = 0;
+  dev->_nonblocking = false;
+  uv_mutex_init(&dev->_lock);
+  uv_cond_init(&dev->_timer);
+  return dev;
+}
+
+int HID_API_EXPORT
+hid_write(hid_device* dev, const unsigned char*, size_t length)
+{
+  transferDelay(dev);
+  return (int) length;
+}
+
+namespace {
+
+// Returns the next report of the capture log at its time, measured
+// from opening the device
+int
+replayReport(hid_device* dev, unsigned char* data, size_t length, int milliseconds)
+{
+  const Records& records = config._replay[dev->_index];
+  uv_mutex_lock(&dev->_lock);
+  uint64_t sequence = dev->_sequence;
+  uv_mutex_unlock(&dev->_lock);
+
+  uint64_t now = uv_hrtime();
+  if (sequence >= records.size()) {
+    // Nothing more to come, but blocking reads must return now and
+    // then to be cancellable
+    if (milliseconds) {
+      sleepUntil(dev, now + (uint64_t) (milliseconds > 0 ? milliseconds : 100) * 1000000);
+    }
+    return 0;
+  }
+  uint64_t arrival = config._replaySpeed > 0
+    ? dev->_opened + (uint64_t) ((records[sequence]->_time - config._replayStart) / config._replaySpeed)
+    : now;
+  if (arrival > now) {
+    if (milliseconds == 0) {
+      return 0;
+    }
+    if (milliseconds > 0 && arrival > now + (uint64_t) milliseconds * 1000000) {
+      sleepUntil(dev, now + (uint64_t) milliseconds * 1000000);
+      return 0;
+    }
+    sleepUntil(dev, arrival);
+  }
+
+  uv_mutex_lock(&dev->_lock);
+  if (sequence < dev->_sequence) {
+    // Another thread has read this one meanwhile
+    sequence = dev->_sequence;
+  }
+  if (sequence >= records.size()) {
+    uv_mutex_unlock(&dev->_lock);
+    return 0;
+  }
+  dev->_sequence = sequence + 1;
+  uv_mutex_unlock(&dev->_lock);
+
+  const CaptureFormat::RecordHeader* record = records[sequence];
+  if (length > record->_length) {
+    length = record->_length;
+  }
+  memcpy(data, record + 1, length);
+  return (int) length;
+}
+
+}
+
+int HID_API_EXPORT
+hid_read_timeout(hid_device* dev, unsigned char* data, size_t length, int milliseconds)
+{
+  if (config._failAfter) {
+    uv_mutex_lock(&dev->_lock);
+    bool unplugged = dev->_sequence >= config._failAfter;
+    uv_mutex_unlock(&dev->_lock);
+    if (unplugged) {
+      return -1;
+    }
+  }
+  if (!config._replay.empty()) {
+    return replayReport(dev, data, length, milliseconds);
+  }
+
+  uv_mutex_lock(&dev->_lock);
+  uint64_t sequence = dev->_sequence;
+  uv_mutex_unlock(&dev->_lock);
+
+  uint64_t now = uv_hrtime();
+  if (config._reportPeriod) {
+    uint64_t arrival = dev->_opened + sequence * config._reportPeriod;
+    if (arrival > now) {
+      if (milliseconds == 0) {
+        return 0;
+      }
+      if (milliseconds > 0 && arrival > now + (uint64_t) milliseconds * 1000000) {
+        sleepUntil(dev, now + (uint64_t) milliseconds * 1000000);
+        return 0;
+      }
+      sleepUntil(dev, arrival);
+    } else {
+      // Skip the reports that would have overflowed the queue
+      uint64_t produced = (now - dev->_opened) / config._reportPeriod + 1;
+      if (produced - sequence > maxQueuedReports) {
+        sequence = produced - maxQueuedReports;
+      }
+    }
+  }
+
+  uv_mutex_lock(&dev->_lock);
+  if (sequence < dev->_sequence) {
+    // Another thread has read this one meanwhile
+    sequence = dev->_sequence;
+  }
+  dev->_sequence = sequence + 1;
+  uv_mutex_unlock(&dev->_lock);
+
+  return (int) fillReport(data, length, sequence, 0);
+}
+
+int HID_API_EXPORT
+hid_read(hid_device* dev, unsigned char* data, size_t length)
+{
+  return hid_read_timeout(dev, data, length, dev->_nonblocking ? 0 : -1);
+}
+
+int HID_API_EXPORT
+hid_set_nonblocking(hid_device* dev, int nonblock)
+{
+  dev->_nonblocking = nonblock != 0;
+  return 0;
+}
+
+int HID_API_EXPORT
+hid_send_feature_report(hid_device* dev, const unsigned char*, size_t length)
+{
+  transferDelay(dev);
+  return (int) length;
+}
+
+int HID_API_EXPORT
+hid_get_feature_report(hid_device* dev, unsigned char* data, size_t length)
+{
+  transferDelay(dev);
+  // The first byte is the report ID asked for
+  return length ? (int) fillReport(data, length, dev->_index, 1) : -1;
+}
+
+void HID_API_EXPORT
+hid_close(hid_device* dev)
+{
+  if (!dev) {
+    return;
+  }
+  uv_cond_destroy(&dev->_timer);
+  uv_mutex_destroy(&dev->_lock);
+  delete dev;
+}
+
+int HID_API_EXPORT_CALL
+hid_get_manufacturer_string(hid_device*, wchar_t* string, size_t maxlen)
+{
+  return copyWideString(string, maxlen, config._manufacturer.c_str());
+}
+
+int HID_API_EXPORT_CALL
+hid_get_product_string(hid_device* dev, wchar_t* string, size_t maxlen)
+{
+  return copyString(string, maxlen, "Mock device %d", dev->_index);
+}
+
+int HID_API_EXPORT_CALL
+hid_get_serial_number_string(hid_device* dev, wchar_t* string, size_t maxlen)
+{
+  return copyString(string, maxlen, "MOCK%04d", dev->_index);
+}
+
+int HID_API_EXPORT_CALL
+hid_get_indexed_string(hid_device*, int, wchar_t*, size_t)
+{
+  return -1;
+}
+
+HID_API_EXPORT const wchar_t* HID_API_CALL
+hid_error(hid_device*)
+{
+  return 0;
+}
@@ -41,7 +41,22 @@ function PowerMate(index)
 util.inherits(PowerMate, events.EventEmitter);
 
 PowerMate.prototype.setLed = function(brightness) {
-    this.hid.write([0, brightness]);
+    if (this.led) {
+        this.led.update([0, brightness]);
+    } else {
+        this.hid.write([0, brightness]);
+    }
+}
+
+// Callers that change the brightness faster than the PowerMate can
+// follow may have the native writer thread send only the latest one,
+// at most every interval milliseconds.  Write errors are then no
+// longer thrown by setLed.
+PowerMate.prototype.conflateLed = function(interval, brightness) {
+    if (this.led) {
+        this.led.stop();
+    }
+    this.led = this.hid.periodicOutput([0, brightness || 0], interval, { changesOnly: true });
 }
 
 PowerMate.prototype.interpretData = function(error, data) {
@@ -0,0 +1,417 @@
+/* Tests of the extension against the mock hidapi backend, so that
+	no device needs to be attached.  `npm test` builds the mock binding
+	and runs all of them.  With a mock build in place, those whose name
+	contains `filter` run with:
+
+		node src/test-mock.js [filter]
+
+	The mock reads its HID_MOCK_* configuration once, so every test
+	runs in a process of its own with the environment it asks for.
+	Mock input reports start with their sequence number since the
+	device was opened, in little endian, see `src/mock/hid.cc`. */
+var assert = require("assert"),
+	child_process = require("child_process");
+
+//Milliseconds a test may take before it counts as failed
+var testTimeout = 10000;
+
+function sequence(data, offset) {
+	return data.readUInt32LE(offset || 0);
+}
+
+//Reports of a batch as passed to "reports" listeners
+function eachReport(data, offsets, callback) {
+	for(var i = 0; i + 1 < offsets.length; i++)
+		callback(offsets[i + 1] - offsets[i], sequence(data, offsets[i]), i);
+}
+
+//Keeps the event loop busy, so that the native reader gets ahead
+function block(ms) {
+	var end = Date.now() + ms;
+	while(Date.now() < end)
+		;
+}
+
+/* Starts the native reader with a small ring, stalls JavaScript once
+	and returns the sequence numbers of the first two batches and the
+	device's stats to `check` */
+function overflow(HID, policy, check) {
+	var device = new HID.HID("mock:0");
+	var batches = [];
+	device.readStart(function(err, data, offsets) {
+		assert.ifError(err);
+		var batch = [];
+		eachReport(data, offsets, function(length, seq) {
+			batch.push(seq);
+		});
+		batches.push(batch);
+		if(batches.length == 1)
+			block(50);
+		else if(batches.length == 2)
+		{
+			device.readStop();
+			var stats = device.stats();
+			device.close();
+			check(batches[0], batches[1], stats);
+		}
+	}, 64, 16, policy);
+}
+
+function consecutive(sequences, first) {
+	for(var i = 0; i < sequences.length; i++)
+		assert.equal(sequences[i], first + i);
+}
+
+var tests = [
+	{
+		name: "ring delivers every report in order",
+		env: { HID_MOCK_REPORT_RATE: "0" },
+		run: function(HID, done) {
+			var device = new HID.HID("mock:0");
+			device.readQueueCapacity = 64;
+			device.readOverflow = "pause";
+			device.setStreaming(true);
+			var next = 0, last = 0, largest = 0;
+			device.on("reports", function(data, offsets, timestamps) {
+				assert.equal(offsets[0], 0);
+				assert.equal(offsets[offsets.length - 1], data.length);
+				assert.equal(timestamps.length, offsets.length - 1);
+				eachReport(data, offsets, function(length, seq, i) {
+					assert.equal(length, 64);
+					assert.equal(seq, next++);
+					assert(timestamps[i] >= last);
+					last = timestamps[i];
+				});
+				largest = Math.max(largest, offsets.length - 1);
+				if(next >= 10000)
+				{
+					device.pause();
+					assert(largest > 1, "reports were never batched");
+					assert.equal(device.stats().droppedReports, 0);
+					device.close();
+					done();
+				}
+			});
+		}
+	},
+	{
+		name: "drop-newest keeps the oldest reports",
+		env: { HID_MOCK_REPORT_RATE: "0" },
+		run: function(HID, done) {
+			overflow(HID, "drop-newest", function(first, second, stats) {
+				consecutive(second, first[first.length - 1] + 1);
+				assert(stats.droppedReports > 0);
+				done();
+			});
+		}
+	},
+	{
+		name: "drop-oldest keeps the newest reports",
+		env: { HID_MOCK_REPORT_RATE: "0" },
+		run: function(HID, done) {
+			overflow(HID, "drop-oldest", function(first, second, stats) {
+				assert(second[0] > first[first.length - 1] + 1);
+				consecutive(second, second[0]);
+				assert(stats.droppedReports > 0);
+				done();
+			});
+		}
+	},
+	{
+		name: "pause stops reading instead of dropping",
+		env: { HID_MOCK_REPORT_RATE: "0" },
+		run: function(HID, done) {
+			overflow(HID, "pause", function(first, second, stats) {
+				consecutive(first, 0);
+				consecutive(second, first.length);
+				assert(stats.readerPauses > 0);
+				assert.equal(stats.droppedReports, 0);
+				done();
+			});
+		}
+	},
+	{
+		name: "filter by report ID",
+		env: { HID_MOCK_REPORT_RATE: "0" },
+		run: function(HID, done) {
+			var device = new HID.HID("mock:0");
+			//The first byte is the low byte of the sequence number
+			device.setFilter({ reportIds: [5] });
+			device.setStreaming(true);
+			var seen = [];
+			device.on("data", function(data) {
+				assert.equal(data[0], 5);
+				seen.push(sequence(data));
+				if(seen.length == 4)
+				{
+					device.pause();
+					assert.deepEqual(seen, [5, 261, 517, 773]);
+					assert(device.stats().filteredReports >= 3 * 255);
+					device.close();
+					done();
+				}
+			});
+		}
+	},
+	{
+		name: "filter unchanged reports through a mask",
+		env: { HID_MOCK_REPORT_RATE: "0" },
+		run: function(HID, done) {
+			var device = new HID.HID("mock:0");
+			//Only the sequence number changes, and the mask hides it
+			device.setFilter({ changesOnly: true, mask: [0, 0, 0, 0, 0, 0, 0, 0] });
+			device.setStreaming(true);
+			var seen = 0;
+			device.on("data", function() {
+				seen++;
+			});
+			setTimeout(function() {
+				device.pause();
+				assert.equal(seen, 1);
+				assert(device.stats().filteredReports > 0);
+				device.close();
+				done();
+			}, 100);
+		}
+	},
+	{
+		name: "report descriptor parsing and decoding",
+		env: {},
+		run: function(HID, done) {
+			//Boot protocol mouse: three buttons, padding, relative X and Y
+			var mouse = [
+				0x05, 0x01, 0x09, 0x02, 0xa1, 0x01, 0x09, 0x01, 0xa1, 0x00,
+				0x05, 0x09, 0x19, 0x01, 0x29, 0x03, 0x15, 0x00, 0x25, 0x01,
+				0x95, 0x03, 0x75, 0x01, 0x81, 0x02, 0x95, 0x01, 0x75, 0x05,
+				0x81, 0x01, 0x05, 0x01, 0x09, 0x30, 0x09, 0x31, 0x15, 0x81,
+				0x25, 0x7f, 0x75, 0x08, 0x95, 0x02, 0x81, 0x06, 0xc0, 0xc0
+			];
+			var fields = HID.parseReportDescriptor(mouse);
+			assert.equal(fields.length, 2);
+			var buttons = fields[0], axes = fields[1];
+			assert.equal(buttons.type, "input");
+			assert.equal(buttons.reportId, 0);
+			assert.equal(buttons.bitOffset, 0);
+			assert.equal(buttons.bitSize, 1);
+			assert.equal(buttons.count, 3);
+			assert(buttons.variable && !buttons.relative && !buttons.signed);
+			assert.equal(buttons.usagePage, 9);
+			assert.deepEqual(buttons.usages, [0x90001, 0x90002, 0x90003]);
+			assert.equal(axes.bitOffset, 8);
+			assert.equal(axes.bitSize, 8);
+			assert.equal(axes.count, 2);
+			assert(axes.variable && axes.relative && axes.signed);
+			assert.equal(axes.logicalMinimum, -127);
+			assert.equal(axes.logicalMaximum, 127);
+			assert.deepEqual(axes.usages, [0x10030, 0x10031]);
+
+			var decoder = new HID.ReportDecoder(fields);
+			assert.equal(decoder.valueCount, 5);
+			var values = decoder.decode(new Buffer([0x05, 0x10, 0xf0]));
+			assert(values instanceof Float64Array);
+			assert.deepEqual(Array.prototype.slice.call(values), [1, 0, 1, 16, -16]);
+			//Batches decode report by report; the second one is cut short
+			values = decoder.decode(new Buffer([0x01, 0x00, 0x00, 0x02, 0x7f]), [0, 3, 5]);
+			assert.equal(values.length, 10);
+			assert.deepEqual(Array.prototype.slice.call(values, 0, 9), [1, 0, 0, 0, 0, 0, 1, 0, 127]);
+			assert(isNaN(values[9]));
+
+			assert.throws(function() {
+				HID.parseReportDescriptor([0x05]);
+			}, /malformed/);
+			done();
+		}
+	},
+	{
+		name: "transaction replies are picked out of the input",
+		env: { HID_MOCK_REPORT_RATE: "1000" },
+		run: function(HID, done) {
+			var device = new HID.HID("mock:0");
+			device.setInputQueue(64);
+			device.transact([0x01], { matchPrefix: [7] }, function(err, reply, timestamp) {
+				assert.ifError(err);
+				assert.equal(sequence(reply), 7);
+				assert.equal(typeof timestamp, "number");
+				/* The reports read while waiting wait in the input queue
+					and come first, the reply is left out */
+				device.setStreaming(true);
+				var seen = [];
+				device.on("data", function(data) {
+					seen.push(sequence(data));
+					if(seen.length == 10)
+					{
+						device.pause();
+						assert.deepEqual(seen, [0, 1, 2, 3, 4, 5, 6, 8, 9, 10]);
+						assert.equal(device.stats().transactions, 1);
+						device.close();
+						done();
+					}
+				});
+			});
+		}
+	},
+	{
+		name: "transactions need an input queue",
+		env: {},
+		run: function(HID, done) {
+			var device = new HID.HID("mock:0");
+			assert.throws(function() {
+				device.transact([0x01], { matchPrefix: [7] }, function() {});
+			}, /input queue/);
+			assert.equal(device.stats().transactions, 0);
+			device.close();
+			done();
+		}
+	},
+	{
+		name: "transactions time out",
+		env: { HID_MOCK_REPORT_RATE: "1000" },
+		run: function(HID, done) {
+			var device = new HID.HID("mock:0");
+			device.setInputQueue(64);
+			//The second byte of the sequence number stays 0 for 256 ms
+			device.transact([0x01], { matchPrefix: [0, 0xff], timeoutMs: 50 }, function(err, reply) {
+				assert(err && err.timeout);
+				assert.equal(reply, undefined);
+				assert.equal(device.stats().transactionTimeouts, 1);
+				device.close();
+				done();
+			});
+		}
+	},
+	{
+		name: "device strings are converted from UTF-32 to UTF-8",
+		env: { HID_MOCK_MANUFACTURER: "Ünïcødé ☃ 𝄞" },
+		run: function(HID, done) {
+			var devices = HID.devices();
+			assert.equal(devices.length, 1);
+			var info = devices[0];
+			assert.equal(info.manufacturer, "Ünïcødé ☃ 𝄞");
+			assert.equal(info.product, "Mock device 0");
+			assert.equal(info.serialNumber, "MOCK0000");
+			assert.equal(info.path, "mock:0");
+			//The strings stay as writable as plain properties
+			info.product = undefined;
+			assert.strictEqual(info.product, undefined);
+			info.serialNumber = "changed";
+			assert.equal(info.serialNumber, "changed");
+			done();
+		}
+	},
+	{
+		name: "reconnect reopens the device and resends writes",
+		env: { HID_MOCK_REPORT_RATE: "1000", HID_MOCK_FAIL_AFTER: "20" },
+		run: function(HID, done) {
+			var target = { vendorId: 0x1209, productId: 0x0001 };
+			HID.open(target, { reconnect: { initialDelay: 10 } }).then(function(device) {
+				var disconnects = 0, reconnects = 0, written = false, last = -1;
+				device.on("error", function(err) {
+					throw err;
+				});
+				device.on("disconnect", function(err) {
+					assert(err instanceof Error);
+					disconnects++;
+					//Held back until the device is back
+					device.writeAsync([0x01], function(err) {
+						assert.ifError(err);
+						written = true;
+					});
+				});
+				device.on("reconnect", function() {
+					reconnects++;
+				});
+				device.on("data", function(data) {
+					var seq = sequence(data);
+					if(!reconnects)
+					{
+						assert.equal(seq, last + 1);
+						last = seq;
+						return;
+					}
+					//The reopened device counts from 0 again
+					if(!written)
+						return;
+					assert.equal(last, 19);
+					assert.equal(disconnects, 1);
+					assert.equal(reconnects, 1);
+					device.close();
+					done();
+				});
+			}, function(err) {
+				throw err;
+			});
+		}
+	},
+	{
+		//The mock build has no hotplug notifications to watch the path with
+		name: "reconnect by path falls back to read errors",
+		env: { HID_MOCK_REPORT_RATE: "1000", HID_MOCK_FAIL_AFTER: "20" },
+		run: function(HID, done) {
+			HID.open("mock:0", { reconnect: { initialDelay: 10 } }).then(function(device) {
+				var disconnects = 0, reconnects = 0;
+				device.on("error", function(err) {
+					throw err;
+				});
+				device.on("disconnect", function() {
+					disconnects++;
+				});
+				device.on("reconnect", function() {
+					reconnects++;
+					assert.equal(disconnects, 1);
+					device.close();
+					done();
+				});
+				device.on("data", function() {});
+			}, function(err) {
+				throw err;
+			});
+		}
+	}
+];
+
+function runTest(name) {
+	process.env.NODE_HID_MOCK = "1";
+	var HID = require("..");
+	var test = tests.filter(function(test) {
+		return test.name == name;
+	})[0];
+	setTimeout(function() {
+		throw new Error("timed out");
+	}, testTimeout);
+	test.run(HID, function done() {
+		process.exit(0);
+	});
+}
+
+function runAll(filter) {
+	var selected = tests.filter(function(test) {
+		return !filter || test.name.indexOf(filter) >= 0;
+	});
+	var failed = 0;
+	function runNext() {
+		var test = selected.shift();
+		if(!test)
+		{
+			console.log(failed ? failed + " failed" : "all passed");
+			process.exit(failed ? 1 : 0);
+		}
+		var env = {};
+		for(var i in process.env)
+			env[i] = process.env[i];
+		for(i in test.env)
+			env[i] = test.env[i];
+		child_process.fork(__filename, ["--run", test.name], { env: env })
+			.on("exit", function(code) {
+				if(code)
+					failed++;
+				console.log((code ? "FAIL " : "ok   ") + test.name);
+				runNext();
+			});
+	}
+	runNext();
+}
+
+if(process.argv[2] == "--run")
+	runTest(process.argv[3]);
+else
+	runAll(process.argv[2]);